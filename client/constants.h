@@ -22,6 +22,8 @@
 
 #define STRING_SPLIT "::"
 #define COMMAND_MARK "/"
+#define JOIN_COMMAND "join"  // Commands the client turns into MSG_JOIN and
+#define PART_COMMAND "part"  // MSG_PART; both are as long as each other
 
 // Color pairs used by Curses:
 
@@ -38,6 +40,7 @@ extern WINDOW* text_window;  // The window the user types into
 
 extern char current_message[MSG_BUFF];  // Current message being typed
 extern char my_username[USERNAME_MAX];  // User's username
+extern unsigned char my_checksum;        // Checksum to ask the server for
 extern unsigned int pos;                // Tracked cursor pos in the buffer
 
 // Displayed at the start of the program
@@ -11,14 +11,18 @@
  *                `/shared/constants.h` and allows a user to send and receive
  *                broadcasts and whispers to and from other connected clients.
  *
- * @usage:        ./client.o name addr
+ * @usage:        ./client.o name addr [checksum]
  *
  * @parameters:   - name :: the username of the connecting client  
  *                - addr :: the remote address to connect to. Can be either a
- *                          hostname or an IP address.
+ *                          hostname or an IP address.  
+ *                - checksum :: optional; the packet checksum to ask the server
+ *                          for. One of sha1, crc32c, xxh64, sha256, or none.
+ *                          Defaults to crc32c.
  *
  * @example:      ./client.o matt localhost
  *                ./client.o jacques 192.168.2.82
+ *                ./client.o matt localhost sha256
  *
  * ===========================================================================
  *
@@ -45,6 +49,7 @@
 #include <curses.h>
 
 #include "../shared/constants.h"
+#include "../shared/checksum.h"
 #include "../shared/messaging.h"
 #include "../shared/utility.h"
 
@@ -60,6 +65,7 @@ WINDOW* text_window;
 
 char current_message[MSG_BUFF];
 char my_username[USERNAME_MAX];
+unsigned char my_checksum = CHECKSUM_CRC32C;
 unsigned int pos = 0;
 
 const char prompt_message[] = "Enter a message: >>";
@@ -72,14 +78,30 @@ const char help_message[] =
   "      -> Broadcast your message to all connected users.\n"
   "    [name]" STRING_SPLIT "[message]\n"
   "      -> Whisper your message to [name].\n"
+  "    #[room]" STRING_SPLIT "[message]\n"
+  "      -> Send your message to everyone in #[room].\n"
   "    " COMMAND_MARK "[command]\n"
   "      -> Run a command.\n"
   "\n"
   "Commands are as follows:\n"
   "    " COMMAND_MARK "exit, " COMMAND_MARK "bye\n"
   "      -> Leave the server and close the app.\n"
+  "    " COMMAND_MARK JOIN_COMMAND " #[room], " COMMAND_MARK PART_COMMAND " #[room]\n"
+  "      -> Join or leave #[room]. Joining one that doesn't exist makes it.\n"
   "    " COMMAND_MARK "who\n"
   "      -> See all currently connected users.\n"
+  "    " COMMAND_MARK "presence, " COMMAND_MARK "presence [version]\n"
+  "      -> See who's here and the version that's as of, or just who's come\n"
+  "         and gone since [version].\n"
+  "    " COMMAND_MARK "history, " COMMAND_MARK "history #[room]\n"
+  "      -> See what was said lately, to everyone or in #[room].\n"
+  "    " COMMAND_MARK "history since [time]\n"
+  "      -> See what you can of everything said since [time], from the\n"
+  "         server's archive: HH:MM, a while ago like 10m or 2h, or @[seconds].\n"
+  "    " COMMAND_MARK "last [name], " COMMAND_MARK "last [name] [count]\n"
+  "      -> See the last 20 (or [count]) archived messages [name] sent.\n"
+  "    " COMMAND_MARK "stats\n"
+  "      -> See how often the server has had to slow users down.\n"
   "    " COMMAND_MARK "help\n"
   "      -> Read this message again.\n"
   "\n"
@@ -90,7 +112,8 @@ const char help_message[] =
 
 static void setup_curses();
 static void parse_args(int argc, char* argv[], in_addr_t* addr);
-static void server_login(int* sock_fd, struct sockaddr* addr, socklen_t* size);
+static void server_login(Connection* conn, struct sockaddr* addr,
+  socklen_t* size);
 
 
 /**
@@ -104,6 +127,7 @@ int main(int argc, char* argv[]) {
   unsigned int y, x;  // used for positioning cursor in pad
 
   int server_sock;                 // socket FD for main server
+  Connection server_conn;          // messaging state for main server
   struct sockaddr_in server_addr;  // address of the main server
   socklen_t serv_a_size = sizeof(server_addr);
 
@@ -121,7 +145,8 @@ int main(int argc, char* argv[]) {
   server_addr.sin_family = AF_INET;
 
   // >> Log into server
-  server_login(&server_sock, (struct sockaddr*)&server_addr, &serv_a_size);
+  server_login(&server_conn, (struct sockaddr*)&server_addr, &serv_a_size);
+  server_sock = server_conn.socket;
 
   // >> Setup epoll
   rc = setup_epoll(&epoll_fd, (int[]){ server_sock, STDIN_FILENO }, 2);
@@ -133,7 +158,7 @@ int main(int argc, char* argv[]) {
       case 2: perror("epoll_add stdin"); break;
     }
 
-    close(server_sock);
+    close_connection(&server_conn);
     exit(1);
   }
 
@@ -145,13 +170,20 @@ int main(int argc, char* argv[]) {
     do {
       // >> watch for EINTR, which can be sent when resizing terminal screen
       //    (need this here only since we're listening on stdin)
-      num_events = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+      // >> Don't wait if some of what the server sent has already been read;
+      //    epoll won't report it again
+      int pending = connection_pending(&server_conn);
+      num_events = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS,
+        pending ? 0 : -1);
 
       if (num_events == -1) {
         endwin();
-        close(server_sock);
+        close_connection(&server_conn);
         perror("epoll_wait");
         exit(1);
+      } else if (num_events == 0 && pending) {
+        events[0].data.fd = server_sock;
+        num_events = 1;
       }
 
     } while (num_events < 0 && errno != EINTR);
@@ -194,7 +226,7 @@ int main(int argc, char* argv[]) {
           request.body = (char*)(encoding_buff);  // point to new body
           request.type |= MSG_IS_ENC;
 
-          send_message(server_sock, request);
+          send_message(&server_conn, request);
 
 refresh:;
           // Extra check not to free the main message buffer because I don't
@@ -215,13 +247,13 @@ refresh:;
 
       } else if (events[n].data.fd == server_sock) {
 
-        Message response = recv_message(server_sock);
+        Message response = recv_message(&server_conn);
 
         if (response.type == MSG_UNSET) {
           // >> Socket closed
           endwin();
           printf("Lost connection to server.\n");
-          close(server_sock);
+          close_connection(&server_conn);
           goto exit;
         }
 
@@ -345,10 +377,16 @@ static void parse_args(int argc, char* argv[], in_addr_t* addr) {
     }
   }
 
-  if (argc != 3) {
+  if (argc != 3 && argc != 4) {
     if (argc < 2) fprintf(stderr, "Missing username as argument.\n");
     if (argc < 3) fprintf(stderr, "Missing server address as argument.\n");
-    if (argc > 3) fprintf(stderr, "Too many arguments given.\n");
+    if (argc > 4) fprintf(stderr, "Too many arguments given.\n");
+    f = stderr;
+    goto print_usage;
+  }
+
+  if (argc == 4 && (my_checksum = checksum_by_name(argv[3])) == CHECKSUM_ANY) {
+    fprintf(stderr, "Unknown checksum \"%s\".\n", argv[3]);
     f = stderr;
     goto print_usage;
   }
@@ -386,9 +424,10 @@ static void parse_args(int argc, char* argv[], in_addr_t* addr) {
 print_usage:
   fprintf(f,
     "Usage:\n\n"
-    " >> %s username host\n\n"
-    "where 'username' is at most %i characters and 'host' is either an IP\n"
-    "address or a hostname.\n",
+    " >> %s username host [checksum]\n\n"
+    "where 'username' is at most %i characters, 'host' is either an IP\n"
+    "address or a hostname, and 'checksum' is one of sha1, crc32c, xxh64,\n"
+    "sha256, or none (crc32c if not given).\n",
     argv[0], USERNAME_MAX - 1
   );
 
@@ -398,27 +437,33 @@ print_usage:
 
 /**
  * Logs into the server.
- * @param sock_fd A pointer to the FD to put the socket on
+ * @param conn A pointer to the connection to set up
  * @param addr A pointer to place the address in
  * @param size Used for bind; pointer to value in main
  */
-static void server_login(int* sock_fd, struct sockaddr* addr, socklen_t* size) {
+static void server_login(Connection* conn, struct sockaddr* addr,
+  socklen_t* size) {
+
+  int sock_fd;
 
   // >> Create socket and establish connection
 
-  if ((*sock_fd = socket(AF_INET, SOCK_STREAM, 0))  < 0) {
+  if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0))  < 0) {
     perror("socket");
     exit(1);
   }
 
-  if (connect(*sock_fd, addr, *size) < 0) {
+  if (connect(sock_fd, addr, *size) < 0) {
     fprintf(stderr,
       "Could not connect to server.\n"
       "Is it running? Did you get the address right?\n");
-    close(*sock_fd);
+    close(sock_fd);
     exit(1);
   }
 
+  init_connection(conn, sock_fd);
+  conn->checksum_pref = my_checksum;
+
   Message request;
 
   request.type = MSG_LOGIN;
@@ -427,13 +472,13 @@ static void server_login(int* sock_fd, struct sockaddr* addr, socklen_t* size) {
   memcpy(request.sender_name, my_username, USERNAME_MAX);
   memset(request.receiver_name, 0, USERNAME_MAX);
 
-  if (send_message(*sock_fd, request) != 0) {
+  if (send_message(conn, request) != 0) {
     fprintf(stderr, "Login request failed.\n");
-    close(*sock_fd);
+    close_connection(conn);
     exit(1);
   }
 
-  Message response = recv_message(*sock_fd);
+  Message response = recv_message(conn);
 
   if (response.type != SRV_RESPONSE) {
 
@@ -445,7 +490,12 @@ static void server_login(int* sock_fd, struct sockaddr* addr, socklen_t* size) {
       fprintf(stderr, "An unknown error occurred. Could not log in.\n");
     }
 
-    close(*sock_fd);
+    close_connection(conn);
     exit(1);
   }
+
+  if (response.body != NULL) free(response.body);
+
+  // >> Logged in; switch to whatever the server agreed to
+  negotiate_connection(conn);
 }
\ No newline at end of file
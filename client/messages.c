@@ -60,9 +60,9 @@ Message parse_buffer(const char buffer[]) {
       memcpy(result.body, err, result.size);
 
     } else {
-      // >> Ready to send
+      // >> Ready to send, to a room if that's what they named
 
-      result.type = MSG_WHISPER;
+      result.type = receiver_name[0] == ROOM_MARK ? MSG_ROOM : MSG_WHISPER;
       memcpy(result.sender_name, my_username, USERNAME_MAX);
 
       // >> Include the new '\0' byte in the receiver name
@@ -74,6 +74,40 @@ Message parse_buffer(const char buffer[]) {
 
     }
 
+  } else if (
+    strstr(buffer, COMMAND_MARK JOIN_COMMAND) == buffer ||
+    strstr(buffer, COMMAND_MARK PART_COMMAND) == buffer
+  ) {
+    // >> Joining or leaving a room; the room goes where a whisper's target
+    //    would, and the server only looks at that
+    const char* room = buffer + CMARK_SIZE + strlen(JOIN_COMMAND);
+
+    while (*room == ' ') room++;
+
+    memset(result.receiver_name, 0, USERNAME_MAX);
+    memcpy(result.sender_name, my_username, USERNAME_MAX);
+
+    if (room[0] != ROOM_MARK || strlen(room) >= USERNAME_MAX) {
+      const char* err = "Room names start with '#', and can't be too long.\n";
+
+      result.type = USR_ERROR;
+      memset(result.sender_name, 0, USERNAME_MAX);
+
+      result.size = strlen(err) + 1;
+      result.body = calloc(result.size, 1);
+      memcpy(result.body, err, result.size);
+
+    } else {
+      result.type =
+        strstr(buffer, COMMAND_MARK JOIN_COMMAND) == buffer ? MSG_JOIN : MSG_PART;
+
+      memcpy(result.receiver_name, room, strlen(room) + 1);
+
+      result.size = strlen(room) + 1;
+      result.body = calloc(result.size, 1);
+      memcpy(result.body, room, result.size);
+    }
+
   } else if (strstr(buffer, COMMAND_MARK) == buffer) {
     // >> COMMAND_MARK was found at the start
     result.type = MSG_COMMAND;
@@ -101,9 +135,52 @@ Message parse_buffer(const char buffer[]) {
 }
 
 
+/**
+ * Shows who's here, or who came or went, from a SRV_PRESENCE message: an op
+ * and a version, then names, each ending in a '\0'.
+ * @param message The message to show
+ */
+static void display_presence(Message message) {
+  const char* end = message.body + message.size;
+  const char* name;
+  char op;
+  unsigned long version;
+
+  // >> Don't trust it to be well-formed
+  if (message.size == 0 || message.body[message.size - 1] != '\0' ||
+      sscanf(message.body, "%c %lu", &op, &version) != 2) {
+    wprintw(chat_window, "A garbled presence update was received.\n");
+    wrefresh(chat_window);
+    return;
+  }
+
+  name = message.body + strlen(message.body) + 1;
+
+  if (has_colors()) wattr_on(chat_window, COLOR_PAIR(CPAIR_NOTICE), NULL);
+  wprintw(chat_window, "%s Server says:\n", timestamp());
+  if (has_colors()) wattr_off(chat_window, COLOR_PAIR(CPAIR_NOTICE), NULL);
+
+  if (op == '+' && name < end) {
+    wprintw(chat_window, "%s has joined!\n\n", name);
+  } else if (op == '-' && name < end) {
+    wprintw(chat_window, "User \"%s\" has disconnected.\n\n", name);
+  } else {
+    wprintw(chat_window, "Here now, as of version %lu:", version);
+
+    for (; name < end; name += strlen(name) + 1) {
+      wprintw(chat_window, " %s", name);
+    }
+
+    wprintw(chat_window, "\n\n");
+  }
+
+  wrefresh(chat_window);
+}
+
+
 void display_message(Message message) {
   short pair = -1;
-  char preface[48];
+  char preface[48 + USERNAME_MAX];
 
   switch (message.type) {
     case MSG_BROADCAST:
@@ -114,6 +191,11 @@ void display_message(Message message) {
       pair = CPAIR_WHISPER;
       sprintf(preface, "%s whispers to you:\n", message.sender_name);
       break;
+    case MSG_ROOM:
+      pair = CPAIR_BROADCAST;
+      sprintf(preface, "%s says in %s:\n", message.sender_name,
+        message.receiver_name);
+      break;
     case SRV_ANNOUNCE:
       pair = CPAIR_NOTICE;
       sprintf(preface, "Server says:\n");
@@ -122,6 +204,9 @@ void display_message(Message message) {
       pair = CPAIR_NOTICE;
       sprintf(preface, "Server replied with:\n");
       break;
+    case SRV_PRESENCE:
+      display_presence(message);
+      return;
     case SRV_ERROR:
       pair = CPAIR_ERROR;
       sprintf(preface, "Something went wrong! (Server-side) error:\n");
@@ -153,7 +238,8 @@ void display_own_message(Message message) {
 
   if (
     strcmp(message.sender_name, my_username) == 0 &&
-    (message.type == MSG_WHISPER || message.type == MSG_BROADCAST)
+    (message.type == MSG_WHISPER || message.type == MSG_BROADCAST ||
+      message.type == MSG_ROOM)
   ) {
 
     if (has_colors()) wattr_on(chat_window, COLOR_PAIR(CPAIR_OWN_MSG), NULL);
@@ -167,6 +253,10 @@ void display_own_message(Message message) {
         wprintw(chat_window, "%s You said:\n",
           timestamp());
         break;
+      case MSG_ROOM:
+        wprintw(chat_window, "%s You said in %s:\n",
+          timestamp(), message.receiver_name);
+        break;
     }
 
     if (has_colors()) wattr_off(chat_window, COLOR_PAIR(CPAIR_OWN_MSG), NULL);
@@ -174,8 +264,11 @@ void display_own_message(Message message) {
     wprintw(chat_window, "%s\n\n", message.body);
     wrefresh(chat_window);
 
-  } else if (message.type != MSG_COMMAND) {
-    // Don't want to display anything for commands
+  } else if (
+    message.type != MSG_COMMAND &&
+    message.type != MSG_JOIN && message.type != MSG_PART
+  ) {
+    // Don't want to display anything for commands; the server answers them
     display_message(message);
   }
 }
\ No newline at end of file
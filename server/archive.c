@@ -0,0 +1,636 @@
+/**
+ * COIS-4310H: Chat App
+ *
+ * @name:         Chat App -- Message archive
+ *
+ * @author:       Matthew Brown, #0648289
+ * @date:         March 1st to March 9th, 2021
+ *
+ * @purpose:      This file keeps every message users send on disk, in an
+ *                append-only log split into numbered segments. The router
+ *                only copies each message into a record and hands it off; one
+ *                background thread writes them out, and syncs everything that
+ *                came in over a short window at once, so that nobody's message
+ *                waits on the disk and the disk isn't synced for every one.
+ *                Segments stay mapped once they're written, so the catalog
+ *                can read them back without going to the disk.
+ *
+ */
+
+
+// fdatasync, clock_gettime and nanosleep are POSIX; dirent and mmap are too
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "../shared/constants.h"
+#include "../shared/checksum.h"
+
+#include "./utility.h"
+#include "./archive.h"
+#include "./catalog.h"
+#include "./log.h"
+
+
+/**
+ * One record waiting to be written, exactly as it'll be on disk.
+ */
+typedef struct pending {
+  struct pending* next;   // The next record handed off before it
+  ArchiveHeader header;   // Then the body, then padding, right after
+} Pending;
+
+
+ArchiveCounts archive_counts;
+
+static const char* archive_dir = NULL; // Where the segments are
+static unsigned int sync_window;       // Milliseconds to gather records over
+static int segment = -1;               // The segment being written to
+static const char* segment_data;       // The same, mapped
+static size_t segment_size = 0;        // How much of it is written already
+static uint64_t next_sequence = 1;     // Given out by the router only
+
+static Pending* incoming = NULL;       // Handed off, newest first
+static int archive_event = -1;         // eventfd the writer waits on
+static unsigned char signalled = 0;    // Set once archive_event was written
+
+
+static void* archive_writer(void* arg);
+static int open_segment(uint64_t first);
+static int load_segment(uint64_t first, int newest);
+static size_t catalog_records(const char* data, size_t size, int check);
+static void sync_segment(size_t from, unsigned long* records,
+  unsigned long* lost);
+static void write_batch(Pending* batch);
+
+
+/**
+ * Works out a record's checksum: everything after the checksum itself, up to
+ * the end of the body.
+ */
+static uint32_t record_checksum(const ArchiveHeader* header) {
+  const char* start = (const char*)&header->sequence;
+  unsigned char digest[CHECKSUM_MAX_LENGTH];
+  uint32_t checksum;
+
+  compute_checksum(CHECKSUM_CRC32C, start,
+    sizeof(ArchiveHeader) - (start - (const char*)header) + header->size,
+    digest);
+
+  memcpy(&checksum, digest, sizeof(checksum));
+  return checksum;
+}
+
+
+/**
+ * Rounds a record's length up to the next multiple of 8.
+ */
+static inline size_t padded(size_t length) {
+  return (length + 7) & ~(size_t)7;
+}
+
+
+/**
+ * Orders segments by their first record, for qsort.
+ */
+static int by_first(const void* a, const void* b) {
+  unsigned long long x = *(const unsigned long long*)a;
+  unsigned long long y = *(const unsigned long long*)b;
+
+  return x < y ? -1 : x > y;
+}
+
+
+int start_archive(const char directory[], unsigned int window) {
+  DIR* dir;
+  struct dirent* entry;
+  unsigned long long first;
+  unsigned long long* firsts = NULL;
+  unsigned int i, count = 0, space = 0;
+  pthread_t id;
+
+  archive_dir = directory;
+  sync_window = window;
+
+  if (mkdir(directory, 0755) != 0 && errno != EEXIST) return -1;
+
+  // >> Find every segment; each is named after its first record
+  dir = opendir(directory);
+  if (dir == NULL) return -1;
+
+  while ((entry = readdir(dir)) != NULL) {
+    char tail[8];
+
+    if (sscanf(entry->d_name, "%20llu%7s", &first, tail) != 2 ||
+        strcmp(tail, ".log") != 0) continue;
+
+    if (count == space) {
+      unsigned long long* bigger = realloc(firsts,
+        sizeof(unsigned long long) * (space > 0 ? space * 2 : 64));
+
+      if (bigger == NULL) {
+        closedir(dir);
+        free(firsts);
+        return -1;
+      }
+
+      firsts = bigger;
+      space = space > 0 ? space * 2 : 64;
+    }
+
+    firsts[count++] = first;
+  }
+
+  closedir(dir);
+
+  // >> Catalogue them all, oldest first, and carry on in the newest
+  qsort(firsts, count, sizeof(unsigned long long), by_first);
+
+  for (i = 0; i < count; i++) {
+    if (load_segment(firsts[i], i + 1 == count) != 0) {
+      free(firsts);
+      return -1;
+    }
+  }
+
+  free(firsts);
+
+  if (count == 0 && open_segment(1) != 0) return -1;
+
+  archive_event = eventfd(0, EFD_CLOEXEC);
+  if (archive_event == -1) return -1;
+
+  if (pthread_create(&id, NULL, archive_writer, NULL)) return -1;
+  pthread_detach(id);
+
+  log_info("Archiving messages to \"%s\", from #%llu, synced every %u ms",
+    directory, (unsigned long long)next_sequence, window);
+
+  return 0;
+}
+
+
+/**
+ * Maps a segment that's already there, and catalogues every record in it. The
+ * newest one has every record checked, is cut off after the last whole one,
+ * and is left open to carry on writing in.
+ * @param first The sequence number it's named after
+ * @param newest Whether it's the newest segment
+ * @return 0 on success, -1 on error
+ */
+static int load_segment(uint64_t first, int newest) {
+  char path[4096];
+  struct stat info;
+  size_t size, mapped, good;
+  char* data;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%020llu.log", archive_dir,
+    (unsigned long long)first);
+
+  fd = open(path, (newest ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+  if (fd == -1) return -1;
+
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  size = (size_t)info.st_size;
+
+  // >> The one being written to gets room to grow into
+  mapped = size;
+  if (newest && mapped < (size_t)ARCHIVE_MAP_MIB * 1024 * 1024)
+    mapped = (size_t)ARCHIVE_MAP_MIB * 1024 * 1024;
+
+  if (mapped == 0) {
+    close(fd);
+    return 0;
+  }
+
+  data = mmap(NULL, mapped, PROT_READ, MAP_SHARED, fd, 0);
+
+  if (data == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+
+  if (first != next_sequence && next_sequence != 1) {
+    log_warn("Archived messages #%llu to #%llu are missing",
+      (unsigned long long)next_sequence, (unsigned long long)first - 1);
+  }
+
+  next_sequence = first;
+
+  lock_catalog();
+
+  if (add_segment(first, data) != 0) {
+    unlock_catalog();
+    close(fd);
+    return -1;
+  }
+
+  good = catalog_records(data, size, newest);
+  unlock_catalog();
+
+  if (!newest) {
+    if (good < size) {
+      log_warn("Only %lu of %lu bytes of \"%s\" could be read",
+        (unsigned long)good, (unsigned long)size, path);
+    }
+
+    close(fd);
+    return 0;
+  }
+
+  // >> Carry on at the end of it, after whatever was last written in full
+  if (good < size) {
+    log_warn("Cut %lu half-written bytes off the end of \"%s\"",
+      (unsigned long)(size - good), path);
+
+    if (ftruncate(fd, good) != 0 || fdatasync(fd) != 0) return -1;
+  }
+
+  if (lseek(fd, good, SEEK_SET) == -1) return -1;
+
+  segment = fd;
+  segment_data = data;
+  segment_size = good;
+
+  return 0;
+}
+
+
+/**
+ * Walks through a segment that was just mapped, adding every record to the
+ * catalog, up to the first one that isn't whole. Records can skip ahead, where
+ * a batch couldn't be written but later ones were, though never back. Sets
+ * next_sequence to come after the last one. The catalog must be locked.
+ * @param data The segment
+ * @param size How big the file is
+ * @param check Whether to check every record's checksum too
+ * @return How many bytes of it are good
+ */
+static size_t catalog_records(const char* data, size_t size, int check) {
+  size_t offset = 0;
+
+  while (offset + sizeof(ArchiveHeader) <= size) {
+    const ArchiveHeader* header = (const ArchiveHeader*)(data + offset);
+
+    if (
+      header->length < sizeof(ArchiveHeader) ||
+      header->length > size - offset ||
+      header->length != padded(sizeof(ArchiveHeader) + header->size) ||
+      header->sequence < next_sequence ||
+      (check && header->checksum != record_checksum(header))
+    ) break;
+
+    if (header->sequence != next_sequence) {
+      log_warn("Archived messages #%llu to #%llu are missing",
+        (unsigned long long)next_sequence,
+        (unsigned long long)header->sequence - 1);
+    }
+
+    add_record(header);
+
+    offset += header->length;
+    next_sequence = header->sequence + 1;
+  }
+
+  return offset;
+}
+
+
+void archive_message(const Message* message) {
+  struct timespec now;
+  Pending* head;
+  uint64_t one = 1;
+
+  if (archive_event == -1) return;
+
+  // >> Anything bigger wouldn't fit in the space segments are mapped with
+  if (message->size > (size_t)ARCHIVE_SEGMENT_MIB * 1024 * 1024) {
+    __atomic_add_fetch(&archive_counts.lost, 1, __ATOMIC_RELAXED);
+    log_warn("A message from \"%s\" was too big to archive",
+      message->sender_name);
+    return;
+  }
+
+  size_t length = padded(sizeof(ArchiveHeader) + message->size);
+
+  // >> Everything's copied, since the body is about to be shared around
+  Pending* record = calloc(1, offsetof(Pending, header) + length);
+
+  if (record == NULL) {
+    __atomic_add_fetch(&archive_counts.lost, 1, __ATOMIC_RELAXED);
+    log_error("Couldn't allocate a record to archive a message in");
+    return;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  ArchiveHeader* header = &record->header;
+  header->length = (uint32_t)length;
+  header->sequence = next_sequence++;
+  header->when = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+  header->size = (uint32_t)message->size;
+  header->type = message->type;
+  memcpy(header->sender, message->sender_name, USERNAME_MAX);
+  memcpy(header->receiver, message->receiver_name, USERNAME_MAX);
+
+  if (message->size > 0)
+    memcpy((char*)(header + 1), message->body, message->size);
+
+  header->checksum = record_checksum(header);
+
+  // >> Hand it off
+  head = __atomic_load_n(&incoming, __ATOMIC_RELAXED);
+
+  do {
+    record->next = head;
+  } while (!__atomic_compare_exchange_n(&incoming, &head, record, 1,
+    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  // >> Only the first record since the writer last woke up has to wake it
+  if (!__atomic_exchange_n(&signalled, 1, __ATOMIC_SEQ_CST))
+    write(archive_event, &one, sizeof(one));
+}
+
+
+/**
+ * Runs the writer thread. Once a record comes in, it waits out the window for
+ * more, then writes them all and syncs once.
+ * @param arg Unused
+ */
+static void* archive_writer(void* arg) {
+  struct timespec window;
+  Pending* batch;
+  Pending* oldest;
+  uint64_t count;
+
+  (void)arg;
+
+  window.tv_sec = sync_window / 1000;
+  window.tv_nsec = (long)(sync_window % 1000) * 1000000;
+
+  while (1) {
+    if (read(archive_event, &count, sizeof(count)) == -1) continue;
+
+    nanosleep(&window, NULL);
+
+    // >> Anything handed off after this wakes it up again
+    __atomic_store_n(&signalled, 0, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    batch = __atomic_exchange_n(&incoming, NULL, __ATOMIC_ACQUIRE);
+
+    // >> They were handed off newest first
+    oldest = NULL;
+
+    while (batch != NULL) {
+      Pending* newer = batch->next;
+      batch->next = oldest;
+      oldest = batch;
+      batch = newer;
+    }
+
+    if (oldest != NULL) write_batch(oldest);
+  }
+
+  return NULL;
+}
+
+
+/**
+ * Starts a new segment, and makes sure it'll still be there after a crash.
+ * @param first The sequence number of the first record going in it
+ * @return 0 on success, -1 on error
+ */
+static int open_segment(uint64_t first) {
+  char path[4096];
+  char* data;
+  int fd, dir, rc;
+
+  snprintf(path, sizeof(path), "%s/%020llu.log", archive_dir,
+    (unsigned long long)first);
+
+  fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd == -1) return -1;
+
+  // >> Mapped once, for good, with room for it to grow, so that it can be read
+  //    from while it's being written
+  data = mmap(NULL, (size_t)ARCHIVE_MAP_MIB * 1024 * 1024, PROT_READ,
+    MAP_SHARED, fd, 0);
+
+  if (data == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+
+  lock_catalog();
+  rc = add_segment(first, data);
+  unlock_catalog();
+
+  if (rc != 0) {
+    munmap(data, (size_t)ARCHIVE_MAP_MIB * 1024 * 1024);
+    close(fd);
+    return -1;
+  }
+
+  segment = fd;
+  segment_data = data;
+  segment_size = 0;
+
+  dir = open(archive_dir, O_RDONLY | O_CLOEXEC);
+  if (dir != -1) {
+    fsync(dir);
+    close(dir);
+  }
+
+  return 0;
+}
+
+
+/**
+ * Syncs the segment being written to, then lets the catalog look up whatever
+ * was written to it since it was last synced. If it couldn't be synced, those
+ * records might not be there after all, so they're counted as lost instead.
+ * @param from Where the first record not synced yet starts in the segment
+ * @param records Added to for each record the catalog can look up now
+ * @param lost Added to for each record it can't
+ */
+static void sync_segment(size_t from, unsigned long* records,
+    unsigned long* lost) {
+  const ArchiveHeader* header;
+  size_t offset;
+  unsigned long count = 0;
+  int synced = fdatasync(segment) == 0;
+
+  if (!synced) log_error("Couldn't sync the archive: %s", strerror(errno));
+
+  if (synced) lock_catalog();
+
+  for (offset = from; offset < segment_size; offset += header->length) {
+    header = (const ArchiveHeader*)(segment_data + offset);
+    if (synced) add_record(header);
+    count += 1;
+  }
+
+  if (synced) {
+    unlock_catalog();
+    *records += count;
+  } else {
+    *lost += count;
+  }
+}
+
+
+/**
+ * Writes out every record in a batch, ARCHIVE_BATCH at a time, then syncs
+ * them all at once. Segments are started over between records once they get
+ * too big. Nothing can be looked up until it's synced, so that nobody's shown
+ * a message that could still be gone after a crash.
+ * @param batch The records, oldest first; they're freed
+ */
+static void write_batch(Pending* batch) {
+  struct iovec parts[ARCHIVE_BATCH];
+  unsigned long written = 0, records = 0, lost = 0;
+  size_t unsynced = segment_size;
+
+  while (batch != NULL) {
+    Pending* record = batch;
+    size_t total = 0;
+    int count = 0;
+
+    // >> A segment that couldn't be started before gets another try; until one
+    //    is, there's nowhere to write anything
+    if (segment == -1) {
+      if (open_segment(batch->header.sequence) != 0) {
+        log_error("Couldn't start a new archive segment: %s", strerror(errno));
+
+        while (batch != NULL) {
+          Pending* next = batch->next;
+          free(batch);
+          batch = next;
+          lost += 1;
+        }
+
+        break;
+      }
+
+      unsynced = 0;
+    }
+
+    // >> Gather up as many as go in the current segment
+    while (record != NULL && count < ARCHIVE_BATCH) {
+      if (
+        segment_size + total + record->header.length >
+          (size_t)ARCHIVE_SEGMENT_MIB * 1024 * 1024 &&
+        segment_size + total > 0
+      ) break;
+
+      parts[count].iov_base = &record->header;
+      parts[count].iov_len = record->header.length;
+      total += record->header.length;
+      count += 1;
+      record = record->next;
+    }
+
+    if (count == 0) {
+      // >> The segment's full; whatever's in it is synced before moving on.
+      //    The next one's started at the top, and the descriptor is forgotten
+      //    now, since its number could go to a client's socket next
+      sync_segment(unsynced, &records, &lost);
+      close(segment);
+      segment = -1;
+
+      continue;
+    }
+
+    // >> Write them, picking up after short writes
+    struct iovec* part = parts;
+    size_t before = segment_size;
+    int left = count;
+
+    while (left > 0) {
+      ssize_t rc = writev(segment, part, left);
+
+      if (rc == -1) {
+        if (errno == EINTR) continue;
+        break;
+      }
+
+      segment_size += rc;
+      written += rc;
+
+      while (left > 0 && (size_t)rc >= part->iov_len) {
+        rc -= part->iov_len;
+        part++;
+        left--;
+      }
+
+      if (left > 0) {
+        part->iov_base = (char*)part->iov_base + rc;
+        part->iov_len -= rc;
+      }
+    }
+
+    if (left > 0) {
+      // >> Nothing can be read past a half-written record, so none of these
+      //    are kept; the next ones go where they would have
+      log_error("Couldn't write to the archive: %s", strerror(errno));
+
+      written -= segment_size - before;
+      segment_size = before;
+      lost += count;
+
+      // >> Their numbers are skipped for good, which is fine when it's read
+      //    back. If what was half-written can't be cut off, though, nothing
+      //    after it could be read, so a new segment's started instead
+      if (ftruncate(segment, before) != 0 ||
+          lseek(segment, before, SEEK_SET) == -1) {
+        sync_segment(unsynced, &records, &lost);
+        close(segment);
+        segment = -1;
+      }
+    }
+
+    // >> Let go of them
+    while (batch != record) {
+      Pending* next = batch->next;
+      free(batch);
+      batch = next;
+    }
+  }
+
+  // >> One sync for the whole lot
+  long long started = now_us();
+
+  if (segment != -1) sync_segment(unsynced, &records, &lost);
+
+  long long took = now_us() - started;
+
+  __atomic_add_fetch(&archive_counts.records, records, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&archive_counts.bytes, written, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&archive_counts.syncs, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&archive_counts.lost, lost, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&archive_counts.sync_us, took, __ATOMIC_RELAXED);
+
+  if (took > archive_counts.slowest_us)
+    __atomic_store_n(&archive_counts.slowest_us, took, __ATOMIC_RELAXED);
+}
\ No newline at end of file
@@ -0,0 +1,65 @@
+#ifndef __SERVER_ARCHIVE__
+#define __SERVER_ARCHIVE__
+
+#include <stdint.h>
+
+#include "../shared/constants.h"
+#include "../shared/messaging.h"
+
+#define ARCHIVE_SEGMENT_MIB 64  // Size segments are started over at
+#define ARCHIVE_MAP_MIB (ARCHIVE_SEGMENT_MIB * 2) // Space the segment being
+                                                  // written to is mapped with
+#define ARCHIVE_BATCH 64        // Most records written with one writev
+
+/**
+ * What's in front of every message in the archive. Records are padded out to
+ * a multiple of 8 bytes, so that each header is aligned wherever a segment is
+ * mapped.
+ */
+typedef struct archive_header {
+  uint32_t length;    // Bytes in the whole record, padding included
+  uint32_t checksum;  // CRC32C of the rest of the header, and the body
+  uint64_t sequence;  // Counts up from 1, across every segment
+  int64_t when;       // When it was routed, in microseconds since the epoch
+  uint32_t size;      // Bytes in the body, which follows the header
+  uint16_t type;      // The message's MSG_ type, as it was sent
+  uint16_t reserved;
+  char sender[USERNAME_MAX];
+  char receiver[USERNAME_MAX];  // The user or room; empty for broadcasts
+} ArchiveHeader;
+
+/**
+ * How much the archive has written, and how long it's spent syncing it, for
+ * /stats. Only the writer changes them; read anywhere.
+ */
+typedef struct archive_counts {
+  unsigned long records;   // Messages written and synced
+  unsigned long bytes;     // Bytes of them, headers included
+  unsigned long syncs;     // How many syncs they took
+  unsigned long lost;      // Messages that couldn't be written
+  long long sync_us;       // Microseconds spent syncing, all together
+  long long slowest_us;    // The longest any one sync took
+} ArchiveCounts;
+
+extern ArchiveCounts archive_counts;
+
+/**
+ * Opens the archive in a directory, making it if it doesn't exist, and starts
+ * the thread that writes to it. Writing picks up at the end of the newest
+ * segment, after cutting off anything half-written there.
+ * @param directory Where the segments go
+ * @param window Most milliseconds a message waits to be synced; whatever comes
+ * in meanwhile is synced along with it
+ * @return 0 on success, -1 if the archive couldn't be opened
+ */
+int start_archive(const char directory[], unsigned int window);
+
+/**
+ * Keeps a copy of a message in the archive. It's written and synced in the
+ * background; this never waits on the disk. Does nothing if the archive was
+ * never started. Only the router thread may call this.
+ * @param message The message, as it's being routed
+ */
+void archive_message(const Message* message);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,364 @@
+/**
+ * COIS-4310H: Chat App
+ *
+ * @name:         Chat App -- Archive catalog
+ *
+ * @author:       Matthew Brown, #0648289
+ * @date:         March 1st to March 9th, 2021
+ *
+ * @purpose:      This file keeps track of where things are in the archive, so
+ *                it can be looked through without reading all of it. Each
+ *                segment has a sparse index of when its records were sent, and
+ *                each sender has a list of where every one of their records
+ *                is. Records are read right out of the mapped segments and
+ *                sent back as they are; nothing is copied for a query.
+ *
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "../shared/constants.h"
+#include "../shared/messaging.h"
+
+#include "./constants.h"
+#include "./utility.h"
+#include "./worker.h"
+#include "./rooms.h"
+#include "./catalog.h"
+#include "./log.h"
+
+
+/**
+ * When one record in a segment was sent, and where it is.
+ */
+typedef struct mark {
+  int64_t when;
+  size_t offset;
+} Mark;
+
+/**
+ * One segment of the archive, with a mark for every CATALOG_EVERY records.
+ */
+typedef struct segment {
+  uint64_t first;          // Sequence number of its first record
+  const char* data;        // The whole segment, mapped
+  size_t end;              // How much of it has been catalogued
+  unsigned long records;   // How many records that is
+  Mark* marks;
+  unsigned int mark_count;
+  unsigned int mark_space;
+} Segment;
+
+/**
+ * Where one record is.
+ */
+typedef struct place {
+  uint32_t segment;  // Which segment, counting from 0
+  uint32_t offset;   // Where in it; segments are never 4 GiB
+} Place;
+
+/**
+ * Where every record from one sender is, oldest first.
+ */
+typedef struct sender {
+  char name[USERNAME_MAX];
+  Place* places;
+  unsigned int count;
+  unsigned int space;
+  struct sender* next;  // Next sender in the same bucket
+} Sender;
+
+/**
+ * Who a query is for, and so what it may send them.
+ */
+typedef struct viewer {
+  char name[USERNAME_MAX];
+  char rooms[USER_ROOMS][USERNAME_MAX];  // Rooms they're in now
+  unsigned int room_count;
+} Viewer;
+
+
+static pthread_mutex_t catalog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Segment* segments = NULL;  // Every segment, oldest first
+static unsigned int segment_count = 0;
+static unsigned int segment_space = 0;
+
+static Sender* senders[CATALOG_BUCKETS];
+
+
+void lock_catalog() {
+  pthread_mutex_lock(&catalog_lock);
+}
+
+
+void unlock_catalog() {
+  pthread_mutex_unlock(&catalog_lock);
+}
+
+
+/**
+ * Makes room for one more of something in a growing array.
+ * @return 0 on success, -1 if there was no memory for it
+ */
+static int grow(void** array, unsigned int* space, unsigned int count,
+    size_t size) {
+  void* bigger;
+
+  if (count < *space) return 0;
+
+  bigger = realloc(*array, size * (*space > 0 ? *space * 2 : 16));
+  if (bigger == NULL) return -1;
+
+  *array = bigger;
+  *space = *space > 0 ? *space * 2 : 16;
+  return 0;
+}
+
+
+/**
+ * Finds a sender's list of records, making it if asked to.
+ */
+static Sender* find_sender(const char name[], int make) {
+  size_t bucket = hash_name(name, CATALOG_BUCKETS - 1);
+  Sender* sender;
+
+  for (sender = senders[bucket]; sender != NULL; sender = sender->next) {
+    if (strncmp(sender->name, name, USERNAME_MAX) == 0) return sender;
+  }
+
+  if (!make) return NULL;
+
+  sender = calloc(1, sizeof(Sender));
+  if (sender == NULL) return NULL;
+
+  memcpy(sender->name, name, USERNAME_MAX);
+  sender->next = senders[bucket];
+  senders[bucket] = sender;
+
+  return sender;
+}
+
+
+int add_segment(uint64_t first, const char* data) {
+  if (grow((void**)&segments, &segment_space, segment_count,
+      sizeof(Segment)) != 0) return -1;
+
+  memset(segments + segment_count, 0, sizeof(Segment));
+  segments[segment_count].first = first;
+  segments[segment_count].data = data;
+  segment_count += 1;
+
+  return 0;
+}
+
+
+void add_record(const ArchiveHeader* header) {
+  Segment* segment = segments + segment_count - 1;
+  size_t offset = (const char*)header - segment->data;
+
+  // >> Every so often, note when it was
+  if (segment->records % CATALOG_EVERY == 0) {
+    if (grow((void**)&segment->marks, &segment->mark_space,
+        segment->mark_count, sizeof(Mark)) == 0) {
+      segment->marks[segment->mark_count].when = header->when;
+      segment->marks[segment->mark_count].offset = offset;
+      segment->mark_count += 1;
+    } else {
+      log_warn("Couldn't add to the archive's time index");
+    }
+  }
+
+  // >> And always note who it was from
+  Sender* sender = find_sender(header->sender, 1);
+
+  if (sender != NULL && grow((void**)&sender->places, &sender->space,
+      sender->count, sizeof(Place)) == 0) {
+    sender->places[sender->count].segment = segment_count - 1;
+    sender->places[sender->count].offset = (uint32_t)offset;
+    sender->count += 1;
+  } else {
+    log_warn("Couldn't add to the archive's index of senders");
+  }
+
+  segment->end = offset + header->length;
+  segment->records += 1;
+}
+
+
+/**
+ * Notes who a query is for, and which rooms they're in right now.
+ */
+static void make_viewer(const User* user, Viewer* viewer) {
+  int i;
+
+  memcpy(viewer->name, user->username, USERNAME_MAX);
+  viewer->room_count = 0;
+
+  pthread_mutex_lock(&ut_lock);
+
+  for (i = 0; i < USER_ROOMS; i++) {
+    if (user->rooms[i] != NULL) {
+      memcpy(viewer->rooms[viewer->room_count++], user->rooms[i]->name,
+        USERNAME_MAX);
+    }
+  }
+
+  pthread_mutex_unlock(&ut_lock);
+}
+
+
+/**
+ * Checks whether somebody may see an archived message: broadcasts, whispers to
+ * or from them, and anything said in rooms they're in.
+ */
+static int visible(const Viewer* viewer, const ArchiveHeader* header) {
+  unsigned int i;
+
+  switch (header->type & ~MSG_IS_ENC) {
+    case MSG_BROADCAST:
+      return 1;
+
+    case MSG_WHISPER:
+      return strncmp(header->sender, viewer->name, USERNAME_MAX) == 0 ||
+        strncmp(header->receiver, viewer->name, USERNAME_MAX) == 0;
+
+    case MSG_ROOM:
+      for (i = 0; i < viewer->room_count; i++) {
+        if (strncmp(header->receiver, viewer->rooms[i], USERNAME_MAX) == 0)
+          return 1;
+      }
+      return 0;
+
+    default:
+      return 0;
+  }
+}
+
+
+/**
+ * Sends one archived message to a user, with its body right out of the
+ * mapped segment.
+ */
+static void send_record(User* user, const ArchiveHeader* header) {
+  Message message;
+
+  message.type = header->type;
+  memcpy(message.sender_name, header->sender, USERNAME_MAX);
+  memcpy(message.receiver_name, header->receiver, USERNAME_MAX);
+  message.size = header->size;
+  message.body = header->size > 0 ? (char*)(header + 1) : NULL;
+
+  deliver(user, share_borrowed(message));
+}
+
+
+unsigned int send_since(User* user, int64_t since, int64_t* next) {
+  Viewer viewer;
+  unsigned int first, last, middle, index, sent = 0;
+  unsigned long scanned = 0;
+  int64_t previous = INT64_MIN;
+  size_t offset;
+
+  *next = 0;
+  make_viewer(user, &viewer);
+
+  lock_catalog();
+
+  // >> Find the last segment that starts before then...
+  first = 0;
+  last = segment_count;
+
+  while (last - first > 1) {
+    middle = first + (last - first) / 2;
+
+    if (segments[middle].mark_count > 0 &&
+        segments[middle].marks[0].when <= since) first = middle;
+    else last = middle;
+  }
+
+  // >> ...and the last mark in it before then, to look through from
+  for (index = first, offset = 0; index < segment_count; index++) {
+    Segment* segment = segments + index;
+
+    if (index == first && segment->mark_count > 0) {
+      unsigned int low = 0, high = segment->mark_count;
+
+      while (high - low > 1) {
+        middle = low + (high - low) / 2;
+
+        if (segment->marks[middle].when < since) low = middle;
+        else high = middle;
+      }
+
+      offset = segment->marks[low].offset;
+    } else {
+      offset = 0;
+    }
+
+    while (offset < segment->end) {
+      const ArchiveHeader* header =
+        (const ArchiveHeader*)(segment->data + offset);
+
+      // >> Whatever's left is for the next time they ask, which picks up from
+      //    this one's time; anything else from the same microsecond has to go
+      //    out now, or it'd be sent twice
+      if ((sent >= QUERY_LIMIT || scanned >= QUERY_SCAN) &&
+          header->when != previous) {
+        *next = header->when;
+        goto done;
+      }
+
+      scanned += 1;
+      offset += header->length;
+      previous = header->when;
+
+      if (header->when >= since && visible(&viewer, header)) {
+        send_record(user, header);
+        sent += 1;
+      }
+    }
+  }
+
+done:
+  unlock_catalog();
+  return sent;
+}
+
+
+unsigned int send_last(User* user, const char sender[], unsigned int count) {
+  const ArchiveHeader* found[QUERY_LIMIT];
+  unsigned int i, total = 0;
+  unsigned long scanned = 0;
+  Viewer viewer;
+
+  if (count > QUERY_LIMIT) count = QUERY_LIMIT;
+
+  make_viewer(user, &viewer);
+
+  lock_catalog();
+
+  Sender* from = find_sender(sender, 0);
+
+  // >> Newest first, until there are enough of them
+  if (from != NULL) {
+    for (i = from->count; i > 0 && total < count && scanned < QUERY_SCAN; i--) {
+      Place place = from->places[i - 1];
+      const ArchiveHeader* header =
+        (const ArchiveHeader*)(segments[place.segment].data + place.offset);
+
+      scanned += 1;
+      if (visible(&viewer, header)) found[total++] = header;
+    }
+  }
+
+  // >> Then send them oldest first
+  for (i = total; i > 0; i--) send_record(user, found[i - 1]);
+
+  unlock_catalog();
+  return total;
+}
\ No newline at end of file
@@ -0,0 +1,63 @@
+#ifndef __SERVER_CATALOG__
+#define __SERVER_CATALOG__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "./constants.h"
+#include "./archive.h"
+
+#define CATALOG_EVERY 32      // Records between marks in a segment's time index
+#define CATALOG_BUCKETS 1024  // Buckets in the table of senders; a power of two
+#define QUERY_LIMIT 100       // Most messages one query sends back
+#define QUERY_SCAN 65536      // Most records one query looks through
+
+/**
+ * Locks the catalog, for adding to it. Only the archive's writer adds to it,
+ * and only for as long as it takes to note down what it just wrote.
+ */
+void lock_catalog();
+
+/**
+ * Unlocks the catalog.
+ */
+void unlock_catalog();
+
+/**
+ * Adds a segment to the end of the catalog; what's added after this goes in
+ * it. The catalog must be locked.
+ * @param first The sequence number of its first record
+ * @param data The segment, mapped; it has to stay mapped for good
+ * @return 0 on success, -1 if there was no memory for it
+ */
+int add_segment(uint64_t first, const char* data);
+
+/**
+ * Adds a record that's just been written to the newest segment. The catalog
+ * must be locked.
+ * @param header The record, where it's mapped in the segment
+ */
+void add_record(const ArchiveHeader* header);
+
+/**
+ * Sends a user the archived messages they can see that were sent at or after
+ * some time, oldest first. It stops after QUERY_LIMIT, or a few more if they
+ * were sent in the same microsecond. Only the router may call this.
+ * @param user Who asked; they must be held
+ * @param since When to start, in microseconds since the epoch
+ * @param next Where to put when to ask from for the rest, or 0 if that was all
+ * @return How many messages were sent
+ */
+unsigned int send_since(User* user, int64_t since, int64_t* next);
+
+/**
+ * Sends a user the last few archived messages from someone, that they can see,
+ * oldest first. Only the router may call this.
+ * @param user Who asked; they must be held
+ * @param sender Whose messages to send
+ * @param count How many, QUERY_LIMIT at most
+ * @return How many messages were sent
+ */
+unsigned int send_last(User* user, const char sender[], unsigned int count);
+
+#endif
\ No newline at end of file
@@ -15,10 +15,18 @@
  *
  */
 
+// localtime_r and clock_gettime are POSIX
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
 
 #include <pthread.h>
 
@@ -26,6 +34,16 @@
 #include "../shared/messaging.h"
 
 #include "./constants.h"
+#include "./membership.h"
+#include "./directory.h"
+#include "./rooms.h"
+#include "./history.h"
+#include "./archive.h"
+#include "./catalog.h"
+#include "./mailbox.h"
+#include "./roster.h"
+#include "./utility.h"
+#include "./worker.h"
 #include "./commands.h"
 
 
@@ -33,91 +51,475 @@
 static struct command_pair {
   // name[] needs to be long enough to hold the longest command name. change as
   // needed.
-  const char name[4];      // The commands name; the string to pass
+  const char name[12];     // The commands name; the string to pass
   const command_ptr func;  // Pointer
 } commands[] = {
 
-  { "who", &command_who }
+  { "who", &command_who },
+  { "stats", &command_stats },
+  { "history", &command_history },
+  { "last", &command_last },
+  { "presence", &command_presence }
 
 };
 
 
+static int history_since(const char text[], const Message* request,
+  Message* dest);
+
+
 // -- Helper functions
 
 command_ptr find_command(const char string[]) {
   int i;
+  size_t length = strcspn(string, " ");
 
   for (i = 0; i < NUM_ELEMS(commands); i++) {
-    if (strcmp(commands[i].name, string) == 0) return commands[i].func;
+    if (
+      strlen(commands[i].name) == length &&
+      strncmp(commands[i].name, string, length) == 0
+    ) return commands[i].func;
   }
 
   return NULL;
 }
 
+
+/**
+ * Starts a response with nothing in it yet, for add_text to fill in.
+ * @param dest The message to place the response in
+ * @param type What type of message it is
+ */
+static void start_response(Message* dest, unsigned short type) {
+  dest->type = type;
+  dest->body = NULL;
+  dest->size = 0;
+
+  memset(dest->sender_name, 0, USERNAME_MAX);
+  memset(dest->receiver_name, 0, USERNAME_MAX);
+}
+
+
+/**
+ * Adds formatted text to the end of a response, making exactly enough room for
+ * it first, so that nothing it says about users or counters can run over.
+ * @param dest The response, from start_response
+ * @param format What to add, like printf's
+ * @return 0 on success, -1 if there was no memory for it; then the response's
+ * body is freed, and the command should return -1
+ */
+static int add_text(Message* dest, const char format[], ...) {
+  size_t used = dest->size > 0 ? dest->size - 1 : 0;
+  va_list args;
+  char* body;
+  int length;
+
+  va_start(args, format);
+  length = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+
+  if (length < 0) goto failed;
+
+  body = realloc(dest->body, used + length + 1);
+  if (body == NULL) goto failed;
+
+  dest->body = body;
+  dest->size = used + length + 1;
+
+  va_start(args, format);
+  vsnprintf(dest->body + used, length + 1, format, args);
+  va_end(args);
+
+  return 0;
+
+failed:
+  if (dest->body != NULL) free(dest->body);
+  dest->body = NULL;
+  dest->size = 0;
+  return -1;
+}
+
 // -- Commands
 
-int command_who(Message* dest) {
-  int i, j;
+int command_who(const Message* request, Message* dest) {
+  (void)dest;
 
-  const char pre[] = "All users: ";
+  User* user = get_user_by_username(request->sender_name);
+  if (user == NULL) return COMMAND_ANSWERED;
 
-  char** chunks; // Array of strings to join at the end
-  size_t* sizes; // Array of chunk sizes
+  // >> The roster is only put back together if somebody's come or gone since
+  //    the last time anybody asked; otherwise they all get the same message
+  SharedMessage* roster = roster_message();
 
-  pthread_mutex_lock(&ut_lock);
+  if (roster == NULL) {
+    release_user(user);
+    return -1;
+  }
+
+  deliver(user, roster);
+  release_user(user);
+
+  return COMMAND_ANSWERED;
+}
 
-  // >> Count number of users for proper allocation
-  int count = 0;
-  for (i = 0; i < CONN_LIMIT; i++) if (threads[i].in_use) count++;
-  if (count == 0) return -1; // Somehow, nobody is connected but command ran??
 
-  // Each entry in array is a pointer to one chunk of the output
-  chunks = malloc(sizeof(char*) * count);
-  sizes = malloc(sizeof(size_t) * count);
+int command_stats(const Message* request, Message* dest) {
+  // How busy each worker had been the last time anybody asked, so that what's
+  // shown is how busy they've been since then. Only the router runs commands
+  static long long* last_busy = NULL;
+  static long long last_asked = 0;
+  static unsigned long last_archived = 0;
+
+  unsigned int i;
+  long long now = now_us();
+  long long busy, elapsed;
+
+  if (last_busy == NULL) {
+    last_busy = calloc(config.workers, sizeof(long long));
+    if (last_busy == NULL) return -1;
+    last_asked = workers[0].started;
+  }
 
-  j = 0; // Secondary counter; the number of used threads run into so far
-  for (i = 0; i < CONN_LIMIT; i++) {
-    if (threads[i].in_use) {
+  (void)request;
 
-      sizes[j] = strlen(threads[i].user->username);
-      if (j + 1 < count) sizes[j] += 2; // include room for ", " on not-last
+  elapsed = now - last_asked;
+  if (elapsed <= 0) elapsed = 1;
 
-      chunks[j] = malloc(sizes[j]);
+  start_response(dest, SRV_RESPONSE);
 
-      if (j + 1 < count) sprintf(chunks[j], "%s, ", threads[i].user->username);
-      else sprintf(chunks[j], "%s", threads[i].user->username);
+  // >> One line for the slow users, and one for each worker
+  if (add_text(dest,
+    "Slow users: %lu broadcasts dropped, %lu users disconnected, "
+    "%lu senders paused",
+    __atomic_load_n(&slow_counts.shed, __ATOMIC_RELAXED),
+    __atomic_load_n(&slow_counts.kicked, __ATOMIC_RELAXED),
+    __atomic_load_n(&slow_counts.paused, __ATOMIC_RELAXED)) != 0) return -1;
 
-      j += 1;
+  for (i = 0; i < config.workers; i++) {
+    busy = __atomic_load_n(&workers[i].busy, __ATOMIC_RELAXED);
+
+    if (add_text(dest,
+      "\nWorker %u: %lld%% busy, %u users", i,
+      (busy - last_busy[i]) * 100 / elapsed,
+      __atomic_load_n(&workers[i].online, __ATOMIC_RELAXED)) != 0) return -1;
+
+    last_busy[i] = busy;
+  }
+
+  // >> And how fast the archive is keeping up, if there is one
+  if (config.archive != NULL) {
+    unsigned long records =
+      __atomic_load_n(&archive_counts.records, __ATOMIC_RELAXED);
+    unsigned long syncs =
+      __atomic_load_n(&archive_counts.syncs, __ATOMIC_RELAXED);
+    long long sync_us =
+      __atomic_load_n(&archive_counts.sync_us, __ATOMIC_RELAXED);
+
+    if (add_text(dest,
+      "\nArchive: %lu messages (%lu KiB), %lld a second lately, %lu lost; "
+      "%lu syncs, %lld us each on average, %lld us at most",
+      records,
+      __atomic_load_n(&archive_counts.bytes, __ATOMIC_RELAXED) / 1024,
+      (long long)(records - last_archived) * 1000000 / elapsed,
+      __atomic_load_n(&archive_counts.lost, __ATOMIC_RELAXED),
+      syncs, syncs > 0 ? sync_us / (long long)syncs : 0,
+      __atomic_load_n(&archive_counts.slowest_us, __ATOMIC_RELAXED)) != 0)
+      return -1;
+
+    last_archived = records;
+  }
+
+  // >> And how much mail is waiting for people
+  if (add_text(dest,
+    "\nMail: %u whispers (%lu KiB) waiting for %u users; %lu delivered, "
+    "%lu expired, %lu refused", mail_counts.waiting,
+    (unsigned long)(mail_counts.bytes / 1024), mail_counts.mailboxes,
+    mail_counts.delivered, mail_counts.expired, mail_counts.refused) != 0)
+    return -1;
+
+  last_asked = now;
+
+  return 0;
+}
+
+
+int command_history(const Message* request, Message* dest) {
+  const char* room = request->body + strcspn(request->body, " ");
+  History* history = &lobby_history;
+  unsigned int i, count;
+  int joined = 0;
+
+  while (*room == ' ') room++;
+
+  // >> Anything older than what's kept in memory comes out of the archive
+  if (strncmp(room, "since", 5) == 0 && (room[5] == ' ' || room[5] == '\0'))
+    return history_since(room + 5, request, dest);
+
+  User* user = get_user_by_username(request->sender_name);
+  if (user == NULL) return -1;
+
+  start_response(dest, SRV_RESPONSE);
+
+  if (*room != '\0') {
+    // >> Only people in a room get to see what was said in it
+    const Snapshot* members = enter_room(room, ROUTER_READER);
+
+    if (members != NULL) {
+      for (i = 0; i < members->count && !joined; i++) {
+        if (members->users[i] == user) joined = 1;
+      }
+
+      leave_snapshot(ROUTER_READER);
     }
+
+    if (!joined) {
+      release_user(user);
+
+      dest->type = USR_ERROR;
+      return add_text(dest, "You need to join that room first.");
+    }
+
+    history = room_history(room);
   }
 
-  pthread_mutex_unlock(&ut_lock);
+  // >> Everything that's been kept, even what they were around for; it goes
+  //    out ahead of this response
+  count = replay_history(history, user, ULONG_MAX);
+  release_user(user);
+
+  if (count == 0) {
+    return add_text(dest, "Nothing has been said %s%.*s lately.",
+      *room != '\0' ? "in " : "", USERNAME_MAX - 1, room);
+  }
+
+  return add_text(dest, "That was the last %u message%s%s%.*s.", count,
+    count == 1 ? "" : "s", *room != '\0' ? " in " : "", USERNAME_MAX - 1,
+    room);
+}
 
-  // >> Count final message size
-  size_t total_size = 0;
-  for (j = 0; j < count; j++) total_size += sizes[j];
 
-  size_t offset = strlen(pre); // amount copied so far
+int command_last(const Message* request, Message* dest) {
+  const char* name = request->body + strcspn(request->body, " ");
+  char sender[USERNAME_MAX];
+  unsigned long count = 20;
+  size_t length;
+  char* end;
 
-  // >> Allocate final chunk, copy prefix in
-  dest->body = calloc(total_size + offset, 1);
-  memcpy(dest->body, pre, offset);
+  start_response(dest, SRV_RESPONSE);
 
-  for (j = 0; j < count; j++) {
-    memcpy(dest->body + offset, chunks[j], sizes[j]);
-    offset += sizes[j];
+  // >> "last <name> [count]"
+  while (*name == ' ') name++;
+  length = strcspn(name, " ");
+
+  if (length != 0 && length < USERNAME_MAX) {
+    memset(sender, 0, USERNAME_MAX);
+    memcpy(sender, name, length);
+
+    if (name[length] != '\0') {
+      count = strtoul(name + length, &end, 10);
+      while (*end == ' ') end++;
+      if (*end != '\0' || count == 0) length = 0;
+    }
+  } else {
+    length = 0;
   }
 
-  // >> Set the rest of the metadata for the message
-  dest->type = SRV_RESPONSE;
-  dest->size = strlen(dest->body);
-  memset(dest->sender_name, 0, USERNAME_MAX);
-  memset(dest->receiver_name, 0, USERNAME_MAX);
+  if (length == 0) {
+    dest->type = USR_ERROR;
+    return add_text(dest, "Ask for /last <name> [how many], up to %d at once.",
+      QUERY_LIMIT);
+  }
 
-  // >> Free up used buffers
-  for (j = 0; j < count; j++) free(chunks[j]);
-  free(chunks);
-  free(sizes);
+  if (config.archive == NULL)
+    return add_text(dest, "Nothing's being archived, so there's nothing to "
+      "show.");
 
-  return 0;
+  User* user = get_user_by_username(request->sender_name);
+  if (user == NULL) return -1;
+
+  // >> They go out ahead of this response
+  count = send_last(user, sender, (unsigned int)count);
+  release_user(user);
+
+  if (count == 0)
+    return add_text(dest, "There's nothing from %s that you can see.", sender);
+
+  return add_text(dest, "That was the last %lu message%s from %s that you can "
+    "see.", count, count == 1 ? "" : "s", sender);
+}
+
+
+
+int command_presence(const Message* request, Message* dest) {
+  const char* text = request->body + strcspn(request->body, " ");
+  unsigned long since;
+  char* end;
+  int sent = -1;
+
+  while (*text == ' ') text++;
+
+  User* user = get_user_by_username(request->sender_name);
+  if (user == NULL) return COMMAND_ANSWERED;
+
+  // >> Just what they missed, if it's still around...
+  if (*text != '\0') {
+    since = strtoul(text, &end, 10);
+    if (*end == '\0' && *text != '-') sent = replay_presence(user, since);
+  }
+
+  if (sent >= 0) {
+    release_user(user);
+
+    start_response(dest, SRV_RESPONSE);
+    return add_text(dest, "Caught up to version %lu, with %d change%s.",
+      roster_version(), sent, sent == 1 ? "" : "s");
+  }
+
+  // >> ...or everybody
+  SharedMessage* everybody = presence_message();
+
+  if (everybody == NULL) {
+    release_user(user);
+    return -1;
+  }
+
+  deliver(user, everybody);
+  release_user(user);
+
+  return COMMAND_ANSWERED;
+}
+
+/**
+ * Works out a time given to a command: "HH:MM" or "HH:MM:SS" for the last time
+ * it was that o'clock, a number followed by "s", "m", "h", or "d" for that
+ * long ago, or "@" followed by seconds since the epoch.
+ * @param text The time
+ * @param when Where to put it, in microseconds since the epoch
+ * @return 0 on success, -1 if it isn't a time
+ */
+static int parse_time(const char text[], int64_t* when) {
+  struct timespec now;
+  struct tm local;
+  time_t then;
+  unsigned int hours, minutes, seconds = 0;
+  unsigned long long whole, fraction = 0;
+  double value;
+  char unit, extra;
+  int n, digits;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  if (text[0] == '@') {
+    // >> Read as whole numbers, so a time handed out by /history since comes
+    //    back to exactly the same microsecond
+    if (sscanf(text + 1, "%llu%n", &whole, &n) != 1 || text[1] == '-')
+      return -1;
+    text += 1 + n;
+
+    if (*text == '.') {
+      if (sscanf(text + 1, "%llu%n", &fraction, &n) != 1 || text[1] == '-' ||
+          text[1] == '+') return -1;
+      text += 1 + n;
+
+      // >> Only down to the microsecond
+      for (digits = n; digits < 6; digits++) fraction *= 10;
+      for (; digits > 6; digits--) fraction /= 10;
+    }
+
+    if (*text != '\0' || whole > INT64_MAX / 1000000 - 1) return -1;
+
+    *when = (int64_t)whole * 1000000 + (int64_t)fraction;
+    return 0;
+  }
+
+  if (sscanf(text, "%u:%u%n", &hours, &minutes, &n) == 2) {
+    if (text[n] == ':' && sscanf(text + n, ":%u%c", &seconds, &extra) != 1)
+      return -1;
+    if (text[n] != ':' && text[n] != '\0') return -1;
+    if (hours > 23 || minutes > 59 || seconds > 59) return -1;
+
+    // >> Today, unless that's still to come
+    then = now.tv_sec;
+    localtime_r(&then, &local);
+
+    local.tm_hour = hours;
+    local.tm_min = minutes;
+    local.tm_sec = seconds;
+    local.tm_isdst = -1;
+
+    then = mktime(&local);
+    if (then > now.tv_sec) then -= 24 * 60 * 60;
+
+    *when = (int64_t)then * 1000000;
+    return 0;
+  }
+
+  if (sscanf(text, "%lf%c%c", &value, &unit, &extra) == 2 && isfinite(value) &&
+      value >= 0) {
+    switch (unit) {
+      case 'd': value *= 24;  // Fall through
+      case 'h': value *= 60;  // Fall through
+      case 'm': value *= 60;  // Fall through
+      case 's': break;
+      default: return -1;
+    }
+
+    // >> Nothing's older than 1970, and further back than that wouldn't fit
+    if (value > now.tv_sec) value = now.tv_sec;
+
+    *when = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000 -
+      (int64_t)(value * 1000000);
+    return 0;
+  }
+
+  return -1;
+}
+
+
+/**
+ * Runs "/history since <time>": sends what's in the archive from then on, a
+ * page at a time.
+ * @param text What came after "since"
+ * @param request The message the command came in.
+ * @param dest The message to place the response in.
+ * @return A status code.
+ */
+static int history_since(const char text[], const Message* request,
+    Message* dest) {
+  int64_t since, next;
+  unsigned int count;
+
+  start_response(dest, SRV_RESPONSE);
+
+  while (*text == ' ') text++;
+
+  if (parse_time(text, &since) != 0) {
+    dest->type = USR_ERROR;
+    return add_text(dest, "Ask for /history since HH:MM[:SS], since a time "
+      "ago like 10m, 2h, or 1d, or since @<seconds since 1970>.");
+  }
+
+  if (config.archive == NULL)
+    return add_text(dest, "Nothing's being archived, so there's nothing to "
+      "show.");
+
+  User* user = get_user_by_username(request->sender_name);
+  if (user == NULL) return -1;
+
+  count = send_since(user, since, &next);
+  release_user(user);
+
+  // >> Say where to pick up from, if that wasn't everything
+  if (next != 0) {
+    return add_text(dest, "That was %u message%s. For more, ask for "
+      "/history since @%lld.%06lld", count, count == 1 ? "" : "s",
+      (long long)(next / 1000000), (long long)(next % 1000000));
+  }
+
+  if (count > 0) {
+    return add_text(dest, "That's everything you can see since then: %u "
+      "message%s.", count, count == 1 ? "" : "s");
+  }
+
+  return add_text(dest, "Nothing you can see was said since then.");
 }
\ No newline at end of file
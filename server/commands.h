@@ -4,20 +4,67 @@
 #include "../shared/messaging.h"
 
 // Function pointer definition for command functions
-typedef int (*command_ptr)(Message*);
+typedef int (*command_ptr)(const Message*, Message*);
+
+// What a command returns when it's already sent its own response, and `dest`
+// is left untouched
+#define COMMAND_ANSWERED 1
 
 /**
- * Returns the function to be used for the command string passed.
+ * Returns the function to be used for the command string passed. Only its
+ * first word has to match; the rest is for the command.
  * @param string The string to check for a matching command to
  * @return A pointer to the function to call
  */
 command_ptr find_command(const char string[]);
 
 /**
- * COMMAND: Lists all users on the server.
+ * COMMAND: Lists all users on the server. The list is sent straight from the
+ * roster, so this always returns COMMAND_ANSWERED.
+ * @param request The message the command came in.
+ * @param dest The message to place the response in.
+ * @return A status code.
+ */
+int command_who(const Message* request, Message* dest);
+
+/**
+ * COMMAND: Shows how often the server has had to deal with slow users, how
+ * busy each worker has been since the last time it was asked, how the
+ * archive is keeping up, and how much mail is waiting.
+ * @param request The message the command came in.
+ * @param dest The message to place the response in.
+ * @return A status code.
+ */
+int command_stats(const Message* request, Message* dest);
+
+/**
+ * COMMAND: Sends the last few broadcasts again, or the last few messages in a
+ * room the user is in, if one is named after the command. With "since" and a
+ * time, sends what's in the archive from then on instead.
+ * @param request The message the command came in.
+ * @param dest The message to place the response in.
+ * @return A status code.
+ */
+int command_history(const Message* request, Message* dest);
+
+/**
+ * COMMAND: Sends the last few archived messages from a user, that the user
+ * asking can see.
+ * @param request The message the command came in.
  * @param dest The message to place the response in.
  * @return A status code.
  */
-int command_who(Message* dest);
+int command_last(const Message* request, Message* dest);
+
+/**
+ * COMMAND: Sends who's here as a PRESENCE_ALL message, with the roster's
+ * version. Everybody is sent each coming and going after that as it happens;
+ * given a version, this sends only what's changed since it instead, as long as
+ * that's still kept.
+ * @param request The message the command came in.
+ * @param dest The message to place the response in.
+ * @return A status code, or COMMAND_ANSWERED if everybody was sent.
+ */
+int command_presence(const Message* request, Message* dest);
 
 #endif
\ No newline at end of file
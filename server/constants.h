@@ -19,41 +19,174 @@
 #include <sys/socket.h>
 
 #include "../shared/constants.h"
+#include "../shared/messaging.h"
 
-#define CONN_LIMIT 8     // The maximum connected users at a time
+#include "./queue.h"
+#include "./outbox.h"
+#include "./uring.h"
+
+#define DEFAULT_CONN_LIMIT 16384  // Most users at a time, unless given with -c
+#define WORKER_EVENTS 256         // Most epoll events a worker handles at once
+#define ROUTER_QUEUE 16384        // Most messages waiting for the router at once
+#define DEFAULT_FANOUT 1024       // Audience size the workers take broadcasts over
+#define DEFAULT_OUT_MESSAGES 1024 // Most messages waiting for one user, unless -m
+#define DEFAULT_OUT_KIB 4096      // Most KiB waiting for one user, unless -b
+#define DEFAULT_GRACE 10          // Seconds over those before a kick, unless -g
+#define WORKER_TICK 100           // Milliseconds between checks on slow users
+#define ACCEPT_BATCH 64           // Most clients accepted at once by a worker
+#define LOGIN_DEADLINE 10         // Seconds a client gets to finish logging in
+#define DEFAULT_STACK_KIB 256     // KiB of stack for each worker, unless -s
+#define ROOM_LIMIT 4096           // Most rooms there can be at once; empty
+                                  // ones are freed to make room
+#define USER_ROOMS 16             // Most rooms one user can be in
+#define HISTORY_LENGTH 32         // Most recent messages kept for each room,
+#define HISTORY_KIB 32            // and the lobby, and most KiB of them
+#define DEFAULT_SYNC_MS 10        // Most ms before archiving syncs, unless -d
+#define DEFAULT_MAIL_MESSAGES 64  // Most whispers kept for somebody, unless -o
+#define DEFAULT_MAIL_TTL 86400    // Seconds they're kept for, unless -t
+#define MAILBOX_KIB 256           // Most KiB of them kept for somebody
+#define MAILBOX_LIMIT 16384       // Most people whispers can be kept for at once
+#define MAIL_MIB 64               // Most MiB of them kept for everybody together
+#define PRESENCE_LENGTH 1024      // Most recent comings and goings kept to resync
+
+// What to do about a user who isn't reading fast enough to keep their backlog
+// under the limits. Whatever the policy, nobody gets to have twice as much
+#define SLOW_DROP 0  // Drop the oldest broadcasts waiting for them
+#define SLOW_KICK 1  // Disconnect them if they stay over for the grace period
+#define SLOW_PUSH 2  // Pause reading from whoever keeps sending to them
+
+// How the workers wait on their sockets
+#define IO_EPOLL 0   // epoll, and a system call for every read
+#define IO_URING 1   // io_uring, which keeps accepting and reading on its own
+
+// What a worker tells the router when somebody logs out. Like MSG_LOGIN, it
+// only ever comes from a worker; clients who send it are ignored
+#define MSG_LOGOUT ((unsigned short)(0x1007))
 
 // -- Global utility structs
 
 /**
- * Internal representation of a user; all it needs to store is the socket
- * they're connected to and the name.
+ * Internal representation of a user: the connection they're using and their
+ * name, plus what's needed to share the struct between the router and the
+ * worker that owns the connection. It is only freed once nobody holds it.
  */
 typedef struct user {
-  int socket_fd;                // The FD of the user's socket
+  Connection conn;              // The user's socket and transfer settings
   char username[USERNAME_MAX];  // The user's username
+
+  struct worker* worker;  // The worker whose event loop the connection is on
+  unsigned int refs;      // How many holders there are; see hold_user
+  unsigned char closed;   // Set once the connection has been closed
+  unsigned char writing;  // Whether epoll is watching for room to write
+  unsigned char paused;   // Whether epoll has stopped watching for reads
+  unsigned char armed;    // What's in flight on their socket, with IO_URING
+
+  // For while they're logging in; see continue_login
+  unsigned char logging_in;    // Set until they've joined everyone else
+  unsigned char named;         // Set once their name is in the directory
+  unsigned char rejected;      // Set if they're being turned away
+  unsigned long login_ticket;  // Ticket for the answer to their login
+  long long deadline;          // When they're given up on, if still logging in
+
+  // For when they aren't keeping up, or are sending to someone who isn't
+  long long stalled_since;    // When their backlog went over; 0 if it isn't
+  unsigned char congested;    // Set while over, with SLOW_PUSH; read anywhere
+  unsigned char pushed_back;  // Set when they sent to a congested user
+
+  Outbox outbox;            // Messages from the router waiting to be queued
+  unsigned char notified;   // Set while the user is on their worker's ready list
+  struct user* ready_next;  // Next user on the ready list
+
+  unsigned int member_index;  // Where they are in the membership snapshot
+  unsigned long joined;       // Epoch the first snapshot with them was
+                              // published in
+  struct room* rooms[USER_ROOMS]; // Rooms they're in; `ut_lock` must be held
+  struct user* local_prev;    // Neighbours on their worker's list of users,
+                              // or of clients logging in
+  struct user* local_next;
+  struct user* hash_next;     // Next user in the same directory bucket
+  struct user* next;          // Next user on their worker's dropped list
 } User;
 
 /**
- * Struct for metadata about each thread.
+ * A broadcast the router has handed to a worker, for it to deliver to all of
+ * its own users. Large audiences are split up this way so that the router
+ * doesn't spend its time on one message while others wait behind it.
+ */
+typedef struct fanout {
+  SharedMessage* message;  // What to send; the fan-out holds it
+  User* source;            // Who not to send it to; held
+  unsigned long index;     // How many fan-outs the router started before it
+  unsigned long published; // Epoch of the snapshot it was sent to
+  struct fanout* next;     // Next one for the same worker
+} Fanout;
+
+/**
+ * Struct for metadata about each worker: one event loop, which accepts and
+ * logs in its own share of the users and then handles their connections.
  */
-typedef struct server_thread {
-  unsigned char in_use;  // 0/1 value for if the thread is currently being used
+typedef struct worker {
+  int index;             // Which worker this is, for messages
   pthread_t id;          // PThread identifier for library functions
-  int pipe_fd[2];        // The FD this pipe uses to receive data from main
-  User* user;            // Pointer to the user this thread is responsible for
-} Thread;
+  int epoll_fd;          // Watches the listener, the doorbell, and every user
+  Ring ring;             // Does the same instead, with IO_URING
+  int listen_sock;       // This worker's own listener on the shared port
+  int doorbell;          // eventfd the router wakes the worker up with
+  User* ready;           // Users with something new in their outbox
+  Fanout* fanouts;       // Broadcasts waiting to be delivered, newest first
+  User* users;           // Every user logged in through this worker
+  User* pending;         // Clients still logging in, held by the worker
+  User* dropped;         // Users disconnected during this round of events
+  unsigned int slow;     // Users stalled, paused, or logging in, as of the
+                         // last check
+  long long checked;     // When the last check on them was
+
+  // How loaded it is, for /stats; read anywhere
+  long long started;     // When its thread was started, in microseconds
+  long long busy;        // Microseconds spent handling events since then
+  unsigned int online;   // Users logged in through it
+} Worker;
+
+/**
+ * Settings given on the command line.
+ */
+typedef struct config {
+  unsigned int workers;     // How many event loops to run
+  unsigned int conn_limit;  // The most users that may be logged in at once
+  unsigned int fanout;      // Audience size broadcasts are split up from
+  unsigned int out_messages;  // Most messages waiting to go out to one user
+  unsigned int out_kib;       // Most KiB of them
+  unsigned int policy;        // SLOW_ policy for users over either
+  unsigned int grace;         // Seconds they get to catch up, with SLOW_KICK
+  unsigned int log_level;     // LOG_ level of the least important lines to log
+  unsigned int stack_kib;     // KiB of stack for each worker thread
+  unsigned int io;            // IO_ backend the workers use
+  const char* archive;        // Directory to keep messages in; NULL for none
+  unsigned int sync_ms;       // Most ms kept messages wait to be synced
+  unsigned int mail_messages; // Most whispers kept for somebody logged out
+  unsigned int mail_ttl;      // Seconds they're kept for
+} Config;
+
+/**
+ * How many times the slow-user policies have had to step in, for /stats.
+ * Workers add to them as they go.
+ */
+typedef struct slow_counts {
+  unsigned long shed;     // Broadcasts dropped from somebody's backlog
+  unsigned long kicked;   // Users disconnected for falling too far behind
+  unsigned long paused;   // Times a sender was paused for a congested user
+} SlowCounts;
 
 // -- Global variable *declarations*
 
-extern User users[CONN_LIMIT];         // Holds all users' metadata
-extern Thread threads[CONN_LIMIT];     // Holds all client thread metadata
+extern Config config;                  // Settings from the command line
+
+extern Worker* workers;                // All `config.workers` workers
 
-extern pthread_mutex_t ut_lock;       // Locks access to 'users' and 'threads'
+extern SlowCounts slow_counts;         // How often users were slowed down
 
-extern int master_sock;                // Bound listener socket
-extern struct sockaddr_in master_addr; // Address of the bound socket
-extern socklen_t master_addr_size;     // Used for bind
+extern pthread_mutex_t ut_lock;        // Serializes logging in and out
 
-extern int master_pipe[2];  // Pipe for threads to message back to main thread
+extern MessageQueue router_queue;  // Where workers hand messages to the router
 
 #endif
\ No newline at end of file
@@ -0,0 +1,123 @@
+/**
+ * COIS-4310H: Chat App
+ *
+ * @name:         Chat App -- Username directory
+ *
+ * @author:       Matthew Brown, #0648289
+ * @date:         March 1st to March 9th, 2021
+ *
+ * @purpose:      This file holds the hash table used to find users by name.
+ *                Every message the router handles needs at least one lookup,
+ *                so these don't go through `ut_lock`; instead, the buckets are
+ *                split between a set of reader-writer locks, and lookups only
+ *                ever share them. Logging in and out are the only writers.
+ *
+ */
+
+
+// pthread_rwlock_t isn't part of C99
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "../shared/constants.h"
+
+#include "./constants.h"
+#include "./utility.h"
+#include "./directory.h"
+
+
+#define DIRECTORY_STRIPES 256  // How many locks the buckets are shared between
+#define DIRECTORY_MIN 1024     // Fewest buckets to have, however few users
+
+
+static User** buckets;         // Chains of users, linked through `hash_next`
+static size_t bucket_mask;     // Bucket count minus one; it's a power of two
+static pthread_rwlock_t stripes[DIRECTORY_STRIPES];
+
+
+int init_directory(unsigned int capacity) {
+  size_t count = DIRECTORY_MIN;
+  int i;
+
+  // >> Enough buckets for one user each at the limit
+  while (count < capacity) count <<= 1;
+
+  buckets = calloc(count, sizeof(User*));
+  if (buckets == NULL) return -1;
+
+  bucket_mask = count - 1;
+
+  for (i = 0; i < DIRECTORY_STRIPES; i++) {
+    pthread_rwlock_init(&stripes[i], NULL);
+  }
+
+  return 0;
+}
+
+
+User* get_user_by_username(const char username[]) {
+  size_t bucket = hash_name(username, bucket_mask);
+  pthread_rwlock_t* lock = &stripes[bucket % DIRECTORY_STRIPES];
+  User* user;
+
+  pthread_rwlock_rdlock(lock);
+
+  for (user = buckets[bucket]; user != NULL; user = user->hash_next) {
+    if (strncmp(user->username, username, USERNAME_MAX - 1) == 0) {
+      // >> Found!! Hold it before letting go, so it can't be freed under us
+      hold_user(user);
+      break;
+    }
+  }
+
+  pthread_rwlock_unlock(lock);
+  return user;
+}
+
+
+int add_to_directory(User* user) {
+  size_t bucket = hash_name(user->username, bucket_mask);
+  pthread_rwlock_t* lock = &stripes[bucket % DIRECTORY_STRIPES];
+  User* other;
+
+  pthread_rwlock_wrlock(lock);
+
+  // >> Names are checked here, under the same lock, so two users logging in
+  //    with the same name at once can't both get it
+  for (other = buckets[bucket]; other != NULL; other = other->hash_next) {
+    if (strncmp(other->username, user->username, USERNAME_MAX - 1) == 0) {
+      pthread_rwlock_unlock(lock);
+      return -1;
+    }
+  }
+
+  user->hash_next = buckets[bucket];
+  buckets[bucket] = user;
+
+  pthread_rwlock_unlock(lock);
+  return 0;
+}
+
+
+void remove_from_directory(User* user) {
+  size_t bucket = hash_name(user->username, bucket_mask);
+  pthread_rwlock_t* lock = &stripes[bucket % DIRECTORY_STRIPES];
+  User** link;
+
+  pthread_rwlock_wrlock(lock);
+
+  for (link = &buckets[bucket]; *link != NULL; link = &(*link)->hash_next) {
+    if (*link == user) {
+      *link = user->hash_next;
+      break;
+    }
+  }
+
+  user->hash_next = NULL;
+  pthread_rwlock_unlock(lock);
+}
\ No newline at end of file
@@ -0,0 +1,37 @@
+#ifndef __SERVER_DIRECTORY__
+#define __SERVER_DIRECTORY__
+
+#include "./constants.h"
+
+/**
+ * Sets up the username directory; must be called before any worker starts.
+ * @param capacity How many users it should expect to hold at most; it still
+ * works past that, just with longer chains
+ * @return 0 on success, -1 if it couldn't be allocated
+ */
+int init_directory(unsigned int capacity);
+
+/**
+ * Looks up a logged-in user by their username. Doesn't need `ut_lock`. The
+ * user is held before being returned, so it can't be freed while the caller is
+ * using it; release it with release_user when done.
+ * @param username The username to search for
+ * @return The held user, or NULL if nobody has that name
+ */
+User* get_user_by_username(const char username[]);
+
+/**
+ * Adds a user to the directory under their username.
+ * @param user The user to add
+ * @return 0 on success, -1 if somebody already has that username
+ */
+int add_to_directory(User* user);
+
+/**
+ * Takes a user out of the directory. Must be done before the directory's
+ * holder (the membership) releases them.
+ * @param user The user to remove
+ */
+void remove_from_directory(User* user);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,94 @@
+/**
+ * COIS-4310H: Chat App
+ *
+ * @name:         Chat App -- Recent history
+ *
+ * @author:       Matthew Brown, #0648289
+ * @date:         March 1st to March 9th, 2021
+ *
+ * @purpose:      This file keeps the last few messages sent to everybody, and
+ *                to each room, so that whoever logs in or joins later can see
+ *                what they walked in on. Each history is a fixed ring of the
+ *                shared messages that were sent, and replaying one just
+ *                delivers them again: nothing is copied or re-encoded.
+ *
+ */
+
+
+#include <stdlib.h>
+
+#include "../shared/constants.h"
+#include "../shared/messaging.h"
+
+#include "./constants.h"
+#include "./worker.h"
+#include "./history.h"
+
+
+History lobby_history;
+
+
+void record_history(History* history, SharedMessage* message, size_t size,
+    unsigned long published) {
+  unsigned int slot;
+
+  if (size > HISTORY_KIB * 1024) return;
+
+  // >> Forget the oldest until there's room for it
+  while (
+    history->count == HISTORY_LENGTH ||
+    history->bytes + size > HISTORY_KIB * 1024
+  ) {
+    slot = history->start;
+
+    release_shared(history->messages[slot]);
+    history->bytes -= history->sizes[slot];
+    history->messages[slot] = NULL;
+
+    history->start = (slot + 1) % HISTORY_LENGTH;
+    history->count -= 1;
+  }
+
+  slot = (history->start + history->count) % HISTORY_LENGTH;
+
+  hold_shared(message);
+  history->messages[slot] = message;
+  history->sizes[slot] = size;
+  history->published[slot] = published;
+
+  history->count += 1;
+  history->bytes += size;
+}
+
+
+void clear_history(History* history) {
+  while (history->count > 0) {
+    release_shared(history->messages[history->start]);
+    history->messages[history->start] = NULL;
+
+    history->start = (history->start + 1) % HISTORY_LENGTH;
+    history->count -= 1;
+  }
+
+  history->bytes = 0;
+}
+
+
+unsigned int replay_history(const History* history, User* user,
+    unsigned long before) {
+  unsigned int i, sent = 0;
+
+  // >> Everything goes into their outbox at once, so their worker is only
+  //    woken up for the first one and sends them all together
+  for (i = 0; i < history->count; i++) {
+    unsigned int slot = (history->start + i) % HISTORY_LENGTH;
+
+    if (history->published[slot] >= before) continue;
+
+    hold_shared(history->messages[slot]);
+    deliver(user, history->messages[slot]);
+    sent += 1;
+  }
+
+  return sent;
+}
\ No newline at end of file
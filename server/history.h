@@ -0,0 +1,54 @@
+#ifndef __SERVER_HISTORY__
+#define __SERVER_HISTORY__
+
+#include "../shared/messaging.h"
+
+#include "./constants.h"
+
+/**
+ * The last few messages sent somewhere, for anybody who shows up later. They're
+ * kept as the shared messages that went out, so their packets are only ever
+ * encoded once for each set of connection settings, however many times they're
+ * replayed. Only the router uses histories.
+ */
+typedef struct history {
+  SharedMessage* messages[HISTORY_LENGTH];  // Held; the oldest is at `start`
+  size_t sizes[HISTORY_LENGTH];             // How big each one's body is
+  unsigned long published[HISTORY_LENGTH];  // Epoch of the snapshot each one
+                                            // was sent to
+  unsigned int start;  // Where the oldest one is
+  unsigned int count;  // How many there are
+  size_t bytes;        // How big their bodies are, all together
+} History;
+
+extern History lobby_history;  // Broadcasts to everybody
+
+/**
+ * Keeps a message that was just sent, making room for it by forgetting the
+ * oldest ones. Messages bigger than HISTORY_KIB aren't kept at all.
+ * @param history The history to keep it in
+ * @param message The message; it's held for as long as it's kept
+ * @param size How big its body is
+ * @param published The `published` epoch of the snapshot it was sent to
+ */
+void record_history(History* history, SharedMessage* message, size_t size,
+  unsigned long published);
+
+/**
+ * Forgets everything in a history, letting go of every message in it.
+ * @param history The history to empty
+ */
+void clear_history(History* history);
+
+/**
+ * Delivers what's in a history to one user, oldest first.
+ * @param history The history to replay
+ * @param user Who to send it to; they must be held
+ * @param before Only messages sent to snapshots published before this epoch are
+ * replayed, since the rest already went to them
+ * @return How many messages were delivered
+ */
+unsigned int replay_history(const History* history, User* user,
+  unsigned long before);
+
+#endif
\ No newline at end of file
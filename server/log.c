@@ -0,0 +1,186 @@
+/**
+ * COIS-4310H: Chat App
+ *
+ * @name:         Chat App -- Server log
+ *
+ * @author:       Matthew Brown, #0648289
+ * @date:         March 1st to March 9th, 2021
+ *
+ * @purpose:      This file holds the server's logging. Every thread that logs
+ *                gets its own ring of lines, which only it writes to, and one
+ *                background thread empties all of them out to stdout and
+ *                stderr. Nobody handling clients ever waits on a terminal, a
+ *                lock, or for the time to be formatted.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "../shared/constants.h"
+#include "../shared/utility.h"
+
+#include "./queue.h"
+#include "./log.h"
+
+
+/**
+ * One logged line, as it waits to be written.
+ */
+typedef struct log_record {
+  int level;
+  time_t when;
+  char text[LOG_LINE];
+} LogRecord;
+
+/**
+ * The lines one thread has logged. Only that thread adds to it, and only the
+ * writer takes from it.
+ */
+typedef struct log_ring {
+  struct log_ring* next;  // The next thread's ring
+
+  char pad0[CACHE_LINE];
+  unsigned long tail;     // How many lines have been logged; owner only
+  unsigned long dropped;  // How many didn't fit since the writer last looked
+  char pad1[CACHE_LINE];
+  unsigned long head;     // How many have been written; writer only
+  char pad2[CACHE_LINE];
+
+  LogRecord records[LOG_RING];
+} LogRing;
+
+
+int log_level = LOG_INFO;
+
+static LogRing* rings = NULL;           // Every thread's ring
+static __thread LogRing* own_ring = NULL; // The calling thread's ring
+
+static int log_event = -1;              // eventfd the writer waits on
+static unsigned char signalled = 0;     // Set once log_event has been written
+
+
+static void* log_writer(void* arg);
+static void write_ring(LogRing* ring);
+
+
+int start_log(int level) {
+  pthread_t id;
+
+  log_level = level;
+
+  log_event = eventfd(0, 0);
+  if (log_event == -1) return -1;
+
+  if (pthread_create(&id, NULL, log_writer, NULL)) return -1;
+  pthread_detach(id);
+
+  return 0;
+}
+
+
+void log_line(int level, const char* format, ...) {
+  LogRing* ring = own_ring;
+  LogRing* head;
+  va_list args;
+  uint64_t one = 1;
+
+  if (ring == NULL) {
+    // >> First line from this thread; give it a ring of its own. They live
+    //    as long as the server does
+    ring = calloc(1, sizeof(LogRing));
+    if (ring == NULL) return;
+
+    head = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+
+    do {
+      ring->next = head;
+    } while (!__atomic_compare_exchange_n(&rings, &head, ring, 1,
+      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    own_ring = ring;
+  }
+
+  // >> Never wait for room; a thread that logs faster than lines can be
+  //    written just loses some
+  if (ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LOG_RING) {
+    __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  LogRecord* record = ring->records + ring->tail % LOG_RING;
+  record->level = level;
+  record->when = time(NULL);
+
+  va_start(args, format);
+  vsnprintf(record->text, LOG_LINE, format, args);
+  va_end(args);
+
+  __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+
+  // >> Only the first line since the writer last woke up has to wake it
+  if (!__atomic_exchange_n(&signalled, 1, __ATOMIC_SEQ_CST))
+    write(log_event, &one, sizeof(one));
+}
+
+
+/**
+ * Runs the writer thread, which empties every ring whenever it's woken up.
+ * @param arg Unused
+ */
+static void* log_writer(void* arg) {
+  LogRing* ring;
+  uint64_t count;
+
+  (void)arg;
+
+  while (1) {
+    if (read(log_event, &count, sizeof(count)) == -1) continue;
+
+    // >> Anything logged after this wakes it up again
+    __atomic_store_n(&signalled, 0, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+
+    for (; ring != NULL; ring = ring->next) write_ring(ring);
+
+    fflush(stdout);
+    fflush(stderr);
+  }
+
+  return NULL;
+}
+
+
+/**
+ * Writes out every line waiting in one ring.
+ * @param ring The ring to empty
+ */
+static void write_ring(LogRing* ring) {
+  unsigned long head = ring->head;
+  unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  unsigned long dropped;
+
+  for (; head != tail; head++) {
+    LogRecord* record = ring->records + head % LOG_RING;
+
+    fprintf(record->level >= LOG_WARN ? stderr : stdout, "%s %s\n",
+      timestamp_at(record->when), record->text);
+  }
+
+  __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+  dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+  if (dropped > 0) {
+    fprintf(stderr, "%s %lu lines were dropped; they came too quickly\n",
+      timestamp(), dropped);
+  }
+}
\ No newline at end of file
@@ -0,0 +1,76 @@
+#ifndef __SERVER_LOG__
+#define __SERVER_LOG__
+
+#define LOG_DEBUG 0  // Per-message detail, like body dumps
+#define LOG_INFO  1  // Logins, logouts, and what's being routed
+#define LOG_WARN  2  // Something went wrong, but the server carries on
+#define LOG_ERROR 3  // Something went wrong that somebody should look at
+
+// Anything below this isn't even compiled in
+#ifndef LOG_FLOOR
+#ifdef __DEBUG__
+#define LOG_FLOOR LOG_DEBUG
+#else
+#define LOG_FLOOR LOG_INFO
+#endif
+#endif
+
+// How many of each hot-path line are skipped for every one that's logged
+#ifndef LOG_SAMPLE
+#ifdef __DEBUG__
+#define LOG_SAMPLE 1
+#else
+#define LOG_SAMPLE 64
+#endif
+#endif
+
+#define LOG_LINE 232  // Most characters in one line, not counting the time
+#define LOG_RING 1024 // Most lines one thread can have waiting to be written
+
+/**
+ * Logs a line, if its level is logged at all. Lines are written in the
+ * background, each with the time it was logged at; this never waits on the
+ * terminal or a file. Takes printf arguments, without the newline.
+ */
+#define log_at(level, ...) do {                                 \
+  if ((level) >= LOG_FLOOR && (level) >= log_level)             \
+    log_line((level), __VA_ARGS__);                             \
+} while (0)
+
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_INFO, __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+
+/**
+ * Logs only one in every LOG_SAMPLE lines from the same spot, for lines that
+ * come up for every message.
+ */
+#define log_sampled(level, ...) do {                                         \
+  static unsigned long log_seen_;                                            \
+  if ((level) >= LOG_FLOOR && (level) >= log_level &&                        \
+      __atomic_fetch_add(&log_seen_, 1, __ATOMIC_RELAXED) % LOG_SAMPLE == 0) \
+    log_line((level), __VA_ARGS__);                                          \
+} while (0)
+
+extern int log_level;  // The lowest level being logged; set by start_log
+
+/**
+ * Starts the thread that writes logged lines out: warnings and errors to
+ * stderr, the rest to stdout.
+ * @param level The lowest level to log
+ * @return 0 on success, -1 if the thread couldn't be started
+ */
+int start_log(int level);
+
+/**
+ * Logs a line; use the macros instead, so lines that won't be logged don't
+ * cost anything. If the calling thread has too many lines waiting already,
+ * the line is dropped, and how many were is logged later.
+ * @param level The line's LOG_ level
+ * @param format printf format for the line
+ */
+void log_line(int level, const char* format, ...)
+  __attribute__((format(printf, 2, 3)));
+
+#endif
\ No newline at end of file
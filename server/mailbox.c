@@ -0,0 +1,256 @@
+/**
+ * COIS-4310H: Chat App
+ *
+ * @name:         Chat App -- Mailboxes
+ *
+ * @author:       Matthew Brown, #0648289
+ * @date:         March 1st to March 9th, 2021
+ *
+ * @purpose:      This file keeps whispers to people who aren't logged in, so
+ *                they get them when they next are, all at once. Each mailbox
+ *                is a short list of the shared messages that were whispered,
+ *                and every letter in every mailbox is also on one list in the
+ *                order they'll expire in, so throwing out old mail never
+ *                means looking through everyone's.
+ *
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../shared/constants.h"
+#include "../shared/messaging.h"
+
+#include "./constants.h"
+#include "./utility.h"
+#include "./worker.h"
+#include "./mailbox.h"
+
+
+/**
+ * One whisper waiting in a mailbox.
+ */
+typedef struct letter {
+  SharedMessage* message;  // The whisper; held
+  size_t size;             // How big its body is
+  long long expires;       // When it's thrown out, on the monotonic clock
+  struct mailbox* mailbox; // The mailbox it's in
+  struct letter* next;     // Next one in the same mailbox
+  struct letter* later;    // Next one to expire, in any mailbox
+  struct letter* sooner;   // Last one to expire before it
+} Letter;
+
+/**
+ * Everything waiting for one name, oldest first. Mailboxes only exist while
+ * they have something in them.
+ */
+typedef struct mailbox {
+  char name[USERNAME_MAX];
+  Letter* first;
+  Letter* last;
+  unsigned int count;    // How many letters there are
+  size_t bytes;          // How big their bodies are, all together
+  struct mailbox* next;  // Next mailbox in the same bucket
+} Mailbox;
+
+
+MailCounts mail_counts;
+
+static Mailbox* buckets[MAILBOX_BUCKETS];  // Chains of mailboxes
+static Letter* soonest = NULL;             // Every letter, by when it expires;
+static Letter* latest = NULL;              // everyone's wait the same time, so
+                                           // that's the order they came in
+
+
+/**
+ * Finds somebody's mailbox, and where it's linked from in its chain.
+ */
+static Mailbox** find_mailbox(const char name[]) {
+  Mailbox** link = &buckets[hash_name(name, MAILBOX_BUCKETS - 1)];
+
+  for (; *link != NULL; link = &(*link)->next) {
+    if (strncmp((*link)->name, name, USERNAME_MAX - 1) == 0) return link;
+  }
+
+  return link;
+}
+
+
+/**
+ * Takes the oldest letter out of its mailbox, and off the list of when letters
+ * expire, and frees the mailbox if that was the last thing in it. The letter
+ * is left for the caller to deal with.
+ */
+static void take_first(Mailbox* mailbox) {
+  Letter* letter = mailbox->first;
+
+  mailbox->first = letter->next;
+  if (mailbox->first == NULL) mailbox->last = NULL;
+
+  mailbox->count -= 1;
+  mailbox->bytes -= letter->size;
+
+  if (letter->sooner != NULL) letter->sooner->later = letter->later;
+  else soonest = letter->later;
+
+  if (letter->later != NULL) letter->later->sooner = letter->sooner;
+  else latest = letter->sooner;
+
+  mail_counts.waiting -= 1;
+  mail_counts.bytes -= letter->size;
+
+  if (mailbox->count == 0) {
+    *find_mailbox(mailbox->name) = mailbox->next;
+    free(mailbox);
+    mail_counts.mailboxes -= 1;
+  }
+}
+
+
+/**
+ * Throws out every letter that's been waiting too long. Since they all wait
+ * just as long, the oldest letter in the whole list is always also the oldest
+ * in its own mailbox.
+ */
+static void expire_mail() {
+  long long now = now_us();
+
+  while (soonest != NULL && soonest->expires <= now) {
+    Letter* letter = soonest;
+
+    take_first(letter->mailbox);
+    release_shared(letter->message);
+    free(letter);
+
+    mail_counts.expired += 1;
+  }
+}
+
+
+int has_mail(const char username[]) {
+  expire_mail();
+
+  return *find_mailbox(username) != NULL;
+}
+
+
+int post_mail(Message message, int online) {
+  Mailbox** link;
+  Mailbox* mailbox;
+  Letter* letter;
+
+  expire_mail();
+
+  // >> Rooms, and nobody at all, can't log in to collect it
+  if (
+    message.receiver_name[0] == '\0' ||
+    message.receiver_name[0] == ROOM_MARK
+  ) {
+    if (message.body != NULL) free(message.body);
+    return MAIL_NOBODY;
+  }
+
+  link = find_mailbox(message.receiver_name);
+  mailbox = *link;
+
+  // >> Nobody gets more than their share, however long they've been away,
+  //    and there's only so much for everybody. Somebody who's back gets
+  //    everything in a moment anyway
+  if (!online && (
+    mail_counts.bytes + message.size > (size_t)MAIL_MIB * 1024 * 1024 ||
+    (mailbox == NULL && mail_counts.mailboxes >= MAILBOX_LIMIT) ||
+    (mailbox != NULL && (
+      mailbox->count >= config.mail_messages ||
+      mailbox->bytes + message.size > MAILBOX_KIB * 1024
+    )) ||
+    message.size > MAILBOX_KIB * 1024
+  )) {
+    if (message.body != NULL) free(message.body);
+    mail_counts.refused += 1;
+    return MAIL_FULL;
+  }
+
+  letter = calloc(1, sizeof(Letter));
+  if (letter == NULL) {
+    if (message.body != NULL) free(message.body);
+    return MAIL_ERROR;
+  }
+
+  if (mailbox == NULL) {
+    mailbox = calloc(1, sizeof(Mailbox));
+    if (mailbox == NULL) {
+      if (message.body != NULL) free(message.body);
+      free(letter);
+      return MAIL_ERROR;
+    }
+
+    strncpy(mailbox->name, message.receiver_name, USERNAME_MAX - 1);
+    *link = mailbox;
+    mail_counts.mailboxes += 1;
+  }
+
+  letter->size = message.size;
+  letter->message = share_message(message);
+
+  if (letter->message == NULL) {
+    free(letter);
+
+    // >> Don't leave an empty mailbox behind
+    if (mailbox->count == 0) {
+      *find_mailbox(mailbox->name) = mailbox->next;
+      free(mailbox);
+      mail_counts.mailboxes -= 1;
+    }
+
+    return MAIL_ERROR;
+  }
+
+  letter->expires = now_us() + (long long)config.mail_ttl * 1000000;
+  letter->mailbox = mailbox;
+
+  // >> Last in its mailbox, and last to expire
+  if (mailbox->last != NULL) mailbox->last->next = letter;
+  else mailbox->first = letter;
+  mailbox->last = letter;
+
+  mailbox->count += 1;
+  mailbox->bytes += letter->size;
+
+  letter->sooner = latest;
+  if (latest != NULL) latest->later = letter;
+  else soonest = letter;
+  latest = letter;
+
+  mail_counts.waiting += 1;
+  mail_counts.bytes += letter->size;
+  return MAIL_KEPT;
+}
+
+
+unsigned int deliver_mail(User* user) {
+  Mailbox* mailbox;
+  unsigned int sent = 0;
+
+  expire_mail();
+
+  mailbox = *find_mailbox(user->username);
+  if (mailbox == NULL) return 0;
+
+  // >> Everything goes into their outbox at once, so their worker sends it all
+  //    together. The mailbox is freed along with its last letter
+  while (1) {
+    Letter* letter = mailbox->first;
+    int last = mailbox->count == 1;
+
+    take_first(mailbox);
+    deliver(user, letter->message);
+    free(letter);
+
+    sent += 1;
+    if (last) break;
+  }
+
+  mail_counts.delivered += sent;
+  return sent;
+}
\ No newline at end of file
@@ -0,0 +1,61 @@
+#ifndef __SERVER_MAILBOX__
+#define __SERVER_MAILBOX__
+
+#include "../shared/messaging.h"
+
+#include "./constants.h"
+
+#define MAILBOX_BUCKETS 1024  // Buckets in the table of mailboxes; a power of two
+
+// What posting a whisper to somebody's mailbox did
+#define MAIL_KEPT 0    // It's waiting for them
+#define MAIL_FULL 1    // Their mailbox is full, or there are MAILBOX_LIMIT, or
+                       // MAIL_MIB is kept already
+#define MAIL_NOBODY 2  // It's for a name nobody could log in with
+#define MAIL_ERROR -1  // There was no memory for it
+
+/**
+ * How much mail there is, and what's happened to it, for /stats. Only the
+ * router uses mailboxes, so only it touches these.
+ */
+typedef struct mail_counts {
+  unsigned int waiting;     // Whispers in mailboxes right now
+  unsigned int mailboxes;   // Mailboxes with anything in them
+  size_t bytes;             // How big the whispers waiting are, all together
+  unsigned long delivered;  // Whispers given to people as they logged in
+  unsigned long expired;    // Whispers thrown out for waiting too long
+  unsigned long refused;    // Whispers that didn't fit in a mailbox
+} MailCounts;
+
+extern MailCounts mail_counts;
+
+/**
+ * Checks whether there's mail waiting for somebody. Only the router may call
+ * this.
+ * @param username Who it'd be for
+ * @return 1 if there is, 0 if not
+ */
+int has_mail(const char username[]);
+
+/**
+ * Keeps a whisper for somebody who isn't logged in, until they are, or until
+ * it's been waiting for `config.mail_ttl` seconds. Only the router may call
+ * this.
+ * @param message The whisper; its body now belongs to the mailbox, and is
+ * freed if it can't be kept
+ * @param online Whether they've logged in already, and it's only waiting
+ * behind the mail they haven't been given yet; then it's kept however full
+ * their mailbox is
+ * @return A MAIL_ result
+ */
+int post_mail(Message message, int online);
+
+/**
+ * Delivers everything waiting for somebody who just logged in, oldest first,
+ * and empties their mailbox. Only the router may call this.
+ * @param user Who to deliver it to; they must be held
+ * @return How many whispers were delivered
+ */
+unsigned int deliver_mail(User* user);
+
+#endif
\ No newline at end of file
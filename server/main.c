@@ -11,6 +11,57 @@
  *                that accepts clients and allows them to exchange messages
  *                between one another.
  *
+ * @usage:        ./server.o [-w workers] [-c limit] [-f fanout] [-m messages]
+ *                           [-b kib] [-p policy] [-g grace] [-l level]
+ *                           [-s stack] [-i backend] [-a directory]
+ *                           [-d window] [-o mail] [-t ttl]
+ *
+ * @parameters:   - workers :: optional; how many event loops to handle clients
+ *                          with. Defaults to one per core.  
+ *                - limit :: optional; the most users that may be logged in at
+ *                          once. Defaults to 16384.
+ *                - fanout :: optional; how many users need to be logged in for
+ *                          broadcasts to be split up between the workers.
+ *                          Defaults to 1024.
+ *                - messages, kib :: optional; how much may be waiting to be
+ *                          sent to one user, in messages and KiB. Default to
+ *                          1024 and 4096.
+ *                - policy :: optional; what to do about users with more than
+ *                          that waiting. `drop` drops their oldest broadcasts,
+ *                          `kick` disconnects them if they don't catch up in
+ *                          time, and `push` pauses whoever is sending to them.
+ *                          Defaults to `drop`. Users with twice as much as
+ *                          allowed are always disconnected.
+ *                - grace :: optional; how many seconds users get to catch up
+ *                          with `kick`. Defaults to 10.
+ *                - level :: optional; the least important lines to log, out of
+ *                          `debug`, `info`, `warn`, and `error`. Defaults to
+ *                          `info`. Lines about single messages are only logged
+ *                          one in every 64 times, except in the debug build.
+ *                - stack :: optional; how many KiB of stack each worker gets.
+ *                          Defaults to 256.
+ *                - backend :: optional; what the workers wait on their sockets
+ *                          with, `epoll` or `uring`. Defaults to `epoll`; with
+ *                          `uring`, epoll is still used if io_uring isn't
+ *                          available.
+ *                - directory :: optional; where to keep every message users
+ *                          send, in numbered segment files. Nothing is kept
+ *                          if not given.
+ *                - window :: optional; most milliseconds a kept message waits
+ *                          to be synced to disk, along with everything else
+ *                          sent meanwhile. Defaults to 10.
+ *                - mail :: optional; how many whispers are kept for somebody
+ *                          who isn't logged in, until they are. Defaults to 64.
+ *                - ttl :: optional; how many seconds those are kept for.
+ *                          Defaults to 86400, a day.
+ *
+ * @example:      ./server.o
+ *                ./server.o -w 4 -c 50000 -f 4096
+ *                ./server.o -m 256 -b 1024 -p kick -g 5 -l warn
+ *                ./server.o -s 128 -i uring
+ *                ./server.o -a archive -d 50
+ *                ./server.o -o 16 -t 3600
+ *
  * ===========================================================================
  *
  * Aside from this `main.c`, all other files in this directory have their
@@ -26,11 +77,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <limits.h>
 
 #include <pthread.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
+#include <sys/resource.h>
 
 #include <arpa/inet.h>
 #include <sys/socket.h>
@@ -45,63 +99,117 @@
 
 #include "./constants.h"
 #include "./utility.h"
-#include "./thread.h"
+#include "./worker.h"
+#include "./directory.h"
+#include "./membership.h"
+#include "./rooms.h"
+#include "./history.h"
+#include "./archive.h"
+#include "./mailbox.h"
+#include "./roster.h"
 #include "./commands.h"
+#include "./log.h"
 
 
 // -- Global variable *definitions*
 
-User users[CONN_LIMIT];
-Thread threads[CONN_LIMIT];
+Config config;
 
-pthread_mutex_t ut_lock;
+Worker* workers;
 
-int master_sock;
-struct sockaddr_in master_addr;
-socklen_t master_addr_size = sizeof(master_addr);
+SlowCounts slow_counts;
 
-int master_pipe[2];
+pthread_mutex_t ut_lock;
+
+MessageQueue router_queue;
 
 
 // -- Function definitions for this file
 
-static int spawn_thread();
-static void setup_listen_socket(int* socket_fd);
+static void parse_args(int argc, char* argv[]);
+static void raise_file_limit();
 
 static void whisper(Message message);
 static void broadcast(Message message);
+static void room_message(Message message);
+static void join_or_part(Message message);
+static void come_or_go(Message message);
+static void catch_up(Message message);
 static void run_command(Message message);
+static void respond(const char username[], unsigned short type,
+  const char text[]);
+
+#ifdef __DEBUG__
+static const char* hex_body(const Message* message, char* out, size_t room);
+#endif
+
+
+// Names for the SLOW_ policies, for -p, the LOG_ levels, for -l, and the IO_
+// backends, for -i
+static const char* const policy_names[] = { "drop", "kick", "push", NULL };
+static const char* const level_names[] = {
+  "debug", "info", "warn", "error", NULL
+};
+static const char* const io_names[] = { "epoll", "uring", NULL };
 
 
 /**
  * Server's main funciton.
+ * @param argc Count of arguments; from command line
+ * @param argv Argument values; from command line
  * @return A status code; 0 on success
  */
-int main() {
-  int i, n;  // counter for loops
+int main(int argc, char* argv[]) {
+  int n;     // counter for loops
   int rc;    // re-useable return-code variable
 
   int epoll_fd;                                 // File descriptor for epoll
   int num_events;                               // Returned number of events
   struct epoll_event events[MAX_EPOLL_EVENTS];  // Returned events by epoll
 
-  // >> Initialize main lists to NULL/"not in use" values
-  memset(threads, 0, sizeof(Thread) * CONN_LIMIT);
-  memset(users, 0, sizeof(User) * CONN_LIMIT);
+  // >> Read settings, and make sure there are enough file descriptors to go
+  //    around for them
+  parse_args(argc, argv);
+
+  if (start_log((int)config.log_level) != 0) {
+    perror("start_log");
+    exit(1);
+  }
+
+  raise_file_limit();
 
-  for (i = 0; i < CONN_LIMIT; i++) {
-    users[i].socket_fd = -1;
-    threads[i].in_use = 0;
+  // >> Open the archive before anything can be said that needs to go in it
+  if (config.archive != NULL &&
+      start_archive(config.archive, config.sync_ms) != 0) {
+    perror("start_archive");
+    exit(1);
   }
 
-  // >> Initialize mutexes
+  // >> Initialize mutexes and the username directory
   pthread_mutex_init(&ut_lock, NULL);
 
-  // >> Create main pipe
-  rc = pipe(master_pipe);
+  if (init_directory(config.conn_limit) != 0) {
+    perror("init_directory");
+    exit(1);
+  }
+
+  // >> The router keeps the roster for /who, as users come and go
+  if (init_roster(config.conn_limit) != 0) {
+    perror("init_roster");
+    exit(1);
+  }
+
+  // >> The router and every worker each get a slot for reading snapshots
+  if (init_membership(config.workers + 1) != 0) {
+    perror("init_membership");
+    exit(1);
+  }
+
+  // >> Create the queue workers send messages up through
+  rc = init_queue(&router_queue, ROUTER_QUEUE);
 
   if (rc) {
-    perror("pipe");
+    perror("init_queue");
     exit(1);
   }
 
@@ -110,50 +218,48 @@ int main() {
   srand(time(NULL));
 #endif
 
-  // >> Run socket setup steps
-  setup_listen_socket(&master_sock);
-
-  printf("%s Server listening on port %i (socket FD of %i)\n",
-    timestamp(), PORT, master_sock);
-
-  // >> Run epoll setup steps
-  rc = setup_epoll(&epoll_fd, (int[]){ master_sock, master_pipe[PR] }, 2);
+  // >> Run epoll setup steps. Only the queue is watched here; the workers do
+  //    the accepting
+  rc = setup_epoll(&epoll_fd, (int[]){ router_queue.event_fd }, 1);
 
   if (rc != 0) {
     switch (rc) {
       case -1: perror("epoll_create1"); break;
-      case 1: perror("epoll_add master_sock"); break;
-      case 2: perror("epoll_add master_pipe"); break;
+      case 1: perror("epoll_add router_queue"); break;
     }
     exit(1);
   }
 
+  // >> Start the workers, which each set up their own listener
+  if (start_workers() != 0) exit(1);
+
+  log_info("Server listening on port %i with %u workers (%s), for up to %u "
+    "users", PORT, config.workers, io_names[config.io], config.conn_limit);
+
   while (1) {
     // >> Wait for epoll events
 
     num_events = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
 
     if (num_events == -1) {
+      if (errno == EINTR) continue;
       perror("epoll wait");
-      close(master_sock);
       exit(1);
     }
 
     for (n = 0; n < num_events; n++) {
 
-      if (events[n].data.fd == master_sock) {
-        // >> There is a new connection
-        spawn_thread();
+      if (events[n].data.fd != router_queue.event_fd) continue;
 
-      } else if (events[n].data.fd == master_pipe[PR]) {
+      // >> Workers have pushed messages; handle every one of them before
+      //    waiting again
+      Message from_thread;
+      clear_queue_signal(&router_queue);
 
-        // >> There is a thread ping
-        Message from_thread;
-        read(master_pipe[PR], &from_thread, sizeof(Message));
+      while (pop_message(&router_queue, &from_thread)) {
 
         // >> Redirect message accordingly
         switch (from_thread.type) {
-          case SRV_ANNOUNCE:   // A thread is trying to announce something
           case MSG_BROADCAST:  // A user is attempting to broadcast to others
           case (MSG_BROADCAST | MSG_IS_ENC):
             broadcast(from_thread);
@@ -164,26 +270,39 @@ int main() {
             whisper(from_thread);
             break;
 
+          case MSG_ROOM:       // A user is talking in a room
+          case (MSG_ROOM | MSG_IS_ENC):
+            room_message(from_thread);
+            break;
+
+          case MSG_JOIN:       // A user is joining or leaving a room
+          case (MSG_JOIN | MSG_IS_ENC):
+          case MSG_PART:
+          case (MSG_PART | MSG_IS_ENC):
+            join_or_part(from_thread);
+            break;
+
+          case MSG_LOGIN:      // A worker has just logged somebody in
+          case MSG_LOGOUT:     // or out
+            come_or_go(from_thread);
+            break;
+
           case MSG_COMMAND:    // A user is running a command
             run_command(from_thread);
             break;
 
           default:             // Unknown/inappropriate message type
-            fprintf(stderr,
-              "%s Received invalid message type.\n", timestamp()
-            );
+            log_warn("Received invalid message type.");
 
             Message response;
             const char error[] = "Invalid message type.";
 
-            pthread_mutex_lock(&ut_lock);
-            Thread* culprit = get_thread_by_username(from_thread.sender_name);
-            pthread_mutex_unlock(&ut_lock);
+            if (from_thread.body != NULL) free(from_thread.body);
+
+            User* culprit = get_user_by_username(from_thread.sender_name);
 
             if (culprit == NULL) {
-              fprintf(stderr,
-                "%s Its sending thread couldn't be found.\n", timestamp()
-              );
+              log_warn("Its sending user couldn't be found.");
               break;
             }
 
@@ -195,8 +314,9 @@ int main() {
             memset(response.sender_name, 0, USERNAME_MAX);
             memset(response.receiver_name, 0, USERNAME_MAX);
 
-            // >> Send back down to thread
-            write(culprit->pipe_fd[PW], &response, sizeof(Message));
+            // >> Send back down to their worker
+            deliver(culprit, share_message(response));
+            release_user(culprit);
 
             break;
         }
@@ -216,44 +336,76 @@ int main() {
  * @param message The message to send
  */
 static void whisper(Message message) {
-  pthread_mutex_lock(&ut_lock);
-  Thread* destination = get_thread_by_username(message.receiver_name);
-  pthread_mutex_unlock(&ut_lock);
+  User* destination = get_user_by_username(message.receiver_name);
+  int online = destination != NULL;
+
+  // >> Somebody who just logged in, and hasn't been given their mail yet, gets
+  //    this after it
+  if (online && has_mail(message.receiver_name)) {
+    release_user(destination);
+    destination = NULL;
+  }
 
   if (destination != NULL) {
 #ifdef __DEBUG__
-    int i;
-    printf("%s User \"%s\" is whispering to \"%s\" :: ",
-      timestamp(), message.sender_name, message.receiver_name);
-    for (i = 0; i < (signed)(message.size); i++)
-      printf("%02x ", message.body[i] & 0xff);
-    printf("\n");
+    char hex[LOG_LINE];
+    log_debug("User \"%s\" is whispering to \"%s\" :: %s",
+      message.sender_name, message.receiver_name,
+      hex_body(&message, hex, sizeof(hex)));
 #else
-    printf("%s User \"%s\" is whispering to \"%s\"\n",
-      timestamp(), message.sender_name, message.receiver_name);
+    log_sampled(LOG_INFO, "User \"%s\" is whispering to \"%s\"",
+      message.sender_name, message.receiver_name);
 #endif
 
-    write(destination->pipe_fd[PW], &message, sizeof(Message));
-  } else {
-    printf("%s User \"%s\" tried to whisper, but couldn't find target\n",
-      timestamp(), message.sender_name);
-
-    // >> Uh oh! Couldn't find user
-    Message response;
-    const char error[] = "Could not find a user with that name.";
-    pthread_mutex_lock(&ut_lock);
-    Thread* culprit = get_thread_by_username(message.sender_name);
-    pthread_mutex_unlock(&ut_lock);
+    // >> If they can't keep up, slow down whoever is sending to them
+    if (__atomic_load_n(&destination->congested, __ATOMIC_RELAXED)) {
+      User* source = get_user_by_username(message.sender_name);
 
-    response.type = USR_ERROR;
-    response.size = strlen(error) + 1;
-    response.body = calloc(response.size, 1);
-    strcpy(response.body, error);
+      if (source != NULL) {
+        __atomic_store_n(&source->pushed_back, 1, __ATOMIC_RELAXED);
+        release_user(source);
+      }
+    }
 
-    memset(response.sender_name, 0, USERNAME_MAX);
-    memset(response.receiver_name, 0, USERNAME_MAX);
+    archive_message(&message);
 
-    write(culprit->pipe_fd[PW], &response, sizeof(Message));
+    deliver(destination, share_message(message));
+    release_user(destination);
+  } else {
+    char reply[64 + USERNAME_MAX];
+
+    log_sampled(LOG_INFO, "User \"%s\" is whispering to \"%s\", who %s",
+      message.sender_name, message.receiver_name,
+      online ? "has mail waiting" : "isn't here");
+
+    // >> Keep it for when they log in, or for right after their mail if they
+    //    have; they're here as far as the sender knows
+    archive_message(&message);
+
+    switch (post_mail(message, online)) {
+      case MAIL_KEPT:
+        if (online) break;
+
+        sprintf(reply, "%s isn't here; they'll get that when they log in.",
+          message.receiver_name);
+        respond(message.sender_name, SRV_RESPONSE, reply);
+        break;
+
+      case MAIL_FULL:
+        sprintf(reply, "%s isn't here, and there's no room to keep that for "
+          "them.", message.receiver_name);
+        respond(message.sender_name, USR_ERROR, reply);
+        break;
+
+      case MAIL_NOBODY:
+        respond(message.sender_name, USR_ERROR,
+          "Nobody could have that name.");
+        break;
+
+      default:
+        respond(message.sender_name, SRV_ERROR, "Something went wrong");
+        break;
+    }
   }
 }
 
@@ -263,292 +415,565 @@ static void whisper(Message message) {
  * @param message The message to send
  */
 static void broadcast(Message message) {
-  int i;
+  unsigned int n;
+  int congested = 0;
 
   // If it's a MSG_ message
   if ((message.type & MASK_TYPE) == MSG_IS_MSG) {
 #ifdef __DEBUG__
-    int i;
-    printf("%s User \"%s\" is broadcasting :: ",
-      timestamp(), message.sender_name);
-    for (i = 0; i < (signed)(message.size); i++)
-      printf("%02x ", message.body[i] & 0xff);
-    printf("\n");
+    char hex[LOG_LINE];
+    log_debug("User \"%s\" is broadcasting :: %s",
+      message.sender_name, hex_body(&message, hex, sizeof(hex)));
 #else
-    printf(
-      "%s User \"%s\" is broadcasting\n",
-      timestamp(), message.sender_name
-    );
+    log_sampled(LOG_INFO, "User \"%s\" is broadcasting", message.sender_name);
 #endif
   } else {
-    printf("%s Server is broadcasting\n", timestamp());
+    log_sampled(LOG_INFO, "Server is broadcasting");
   }
 
-  pthread_mutex_lock(&ut_lock);
+  // >> Keep what users say; announcements can be worked out from the rest
+  if ((message.type & MASK_TYPE) == MSG_IS_MSG) archive_message(&message);
+
+  // >> Get source so as to not re-send to source user. Announcements come from
+  //    nobody, so they go to everyone
+  User* source = message.sender_name[0] != '\0'
+    ? get_user_by_username(message.sender_name)
+    : NULL;
+
+  // >> Wrap the message up once; every user gets the same copy, which is
+  //    freed when the last of them is done sending it
+  SharedMessage* shared = share_message(message);
 
-  // >> Get source so as to not re-send to source user
-  Thread* source = get_thread_by_username(message.sender_name);
+  if (shared == NULL) {
+    if (source != NULL) release_user(source);
+    return;
+  }
+
+  // >> Hand it to all the users' workers. Nobody logging in or out has to
+  //    wait for this; they publish a new snapshot instead
+  const Snapshot* members = enter_snapshot(ROUTER_READER);
+  unsigned long published = members->published;
 
+  // >> Whoever logs in later is sent what users broadcast, but not what the
+  //    server announced
+  if ((message.type & ~MSG_IS_ENC) == MSG_BROADCAST)
+    record_history(&lobby_history, shared, message.size, published);
 
-  // >> Send all the messages to their threads
-  for (i = 0; i < CONN_LIMIT; i++) {
-    if (threads[i].in_use && threads + i != source) {
-      // Make a new copy of the message, since each thread will free up its
-      // version after sending
-      Message copy;
+  if (members->count >= config.fanout) {
+    // >> Too many to go through here without holding up everything behind
+    //    it; each worker goes through its own users instead
+    leave_snapshot(ROUTER_READER);
+    fan_out(shared, source, published);
+
+    if (source != NULL) release_user(source);
+    return;
+  }
 
-      // >> Copy whole struct
-      memcpy(&copy, &message, sizeof(Message));
+  for (n = 0; n < members->count; n++) {
+    User* user = members->users[n];
 
-      // >> Copy message into new memory location (since .body is just a
-      //    pointer)
-      copy.body = calloc(copy.size, 1);
-      memcpy(copy.body, message.body, copy.size);
+    if (user != source) {
+      if (__atomic_load_n(&user->congested, __ATOMIC_RELAXED)) congested = 1;
 
-      // >> Actually send to pipe
-      write(threads[i].pipe_fd[PW], &copy, sizeof(Message));
+      hold_shared(shared);
+      deliver(user, shared);
     }
   }
 
-  pthread_mutex_unlock(&ut_lock);
+  leave_snapshot(ROUTER_READER);
+
+  // >> Anybody who can't keep up slows the sender down
+  if (congested && source != NULL)
+    __atomic_store_n(&source->pushed_back, 1, __ATOMIC_RELAXED);
+
+  if (source != NULL) release_user(source);
+  release_shared(shared);
 }
 
 
 /**
- * Runs a command from the client and sends the response back.
- * @param message The message of which the body contains a command string.
+ * Sends a message to everybody in the room named in its receiver_name, except
+ * whoever sent it. Only people in the room may send to it.
+ * @param message The message to send
  */
-static void run_command(Message message) {
-  Message response;
+static void room_message(Message message) {
+  unsigned int n;
+  int congested = 0, joined = 0;
 
-  printf("%s User \"%s\" is running a command\n",
-    timestamp(), message.sender_name);
+  User* source = get_user_by_username(message.sender_name);
 
-  // >> Find command
-  command_ptr command = find_command(message.body);
-  if (command == NULL) {
-    response.type = USR_ERROR;
-    response.size = 32 + strlen(message.body); // size needed
-    response.body = calloc(response.size, 1);
-    sprintf(response.body, "Could not find the command \"%s\".", message.body);
-    goto error;
+  if (source == NULL) {
+    if (message.body != NULL) free(message.body);
+    return;
   }
 
-  printf("%s Found command \"%s\"\n", timestamp(), message.body);
+  // >> Only the room's own members get it; nobody joining or leaving any room
+  //    has to wait for this, since they publish a new snapshot instead
+  const Snapshot* members = enter_room(message.receiver_name, ROUTER_READER);
 
-  // >> Run command and get return code
-  int rc = (*command)(&response);
-  if (rc) {
-    response.type = SRV_ERROR;
-    response.size = 48;
-    response.body = calloc(response.size, 1);
-    sprintf(response.body, "Something went wrong running the command.");
-    goto error;
+  if (members != NULL) {
+    for (n = 0; n < members->count && !joined; n++) {
+      if (members->users[n] == source) joined = 1;
+    }
   }
 
-  printf("%s Command succeeded\n", timestamp());
+  if (!joined) {
+    if (members != NULL) leave_snapshot(ROUTER_READER);
+    release_user(source);
 
-  goto send_response; // Skip over creating error packet if error not hit
+    log_sampled(LOG_INFO, "User \"%s\" tried to talk in \"%.*s\" without "
+      "joining it", message.sender_name, USERNAME_MAX - 1, message.receiver_name);
 
-error:;
-  memset(response.sender_name, 0, USERNAME_MAX);
-  memset(response.receiver_name, 0, USERNAME_MAX);
-  printf("%s Command failed\n", timestamp());
+    if (message.body != NULL) free(message.body);
+    respond(message.sender_name, USR_ERROR, "You need to join that room first.");
+    return;
+  }
 
-send_response:;
-  pthread_mutex_lock(&ut_lock);
-  Thread* reply_to = get_thread_by_username(message.sender_name);
-  pthread_mutex_unlock(&ut_lock);
+  log_sampled(LOG_INFO, "User \"%s\" is talking in \"%.*s\"",
+    message.sender_name, USERNAME_MAX - 1, message.receiver_name);
 
-  write(reply_to->pipe_fd[PW], &response, sizeof(Message));
+  archive_message(&message);
 
-  // Hmmm... maybe I am getting too comfortable with goto statements. Oh well, I
-  // like them. Maybe I should write more Assembly, lol.
+  // >> Wrap the message up once for everybody in the room, and for whoever
+  //    joins it later
+  SharedMessage* shared = share_message(message);
+
+  if (shared == NULL) {
+    leave_snapshot(ROUTER_READER);
+    release_user(source);
+    return;
+  }
+
+  record_history(room_history(message.receiver_name), shared, message.size,
+    members->published);
+
+  for (n = 0; n < members->count; n++) {
+    User* user = members->users[n];
+
+    if (user != source) {
+      if (__atomic_load_n(&user->congested, __ATOMIC_RELAXED)) congested = 1;
+
+      hold_shared(shared);
+      deliver(user, shared);
+    }
+  }
+
+  leave_snapshot(ROUTER_READER);
+
+  // >> Anybody who can't keep up slows the sender down
+  if (congested) __atomic_store_n(&source->pushed_back, 1, __ATOMIC_RELAXED);
+
+  release_user(source);
+  release_shared(shared);
 }
 
 
 /**
- * Does socket setup. Extracted here to keep main() tidy.
+ * Adds a user to, or takes them out of, the room named in the message's
+ * receiver_name, and tells them how it went. Whatever's in the body is
+ * ignored.
+ * @param message The MSG_JOIN or MSG_PART message
  */
-static void setup_listen_socket(int* socket_fd) {
-  int rc;
+static void join_or_part(Message message) {
+  char room[USERNAME_MAX];
+  char reply[48 + USERNAME_MAX];
+  int joining = (message.type & ~MSG_IS_ENC) == MSG_JOIN;
+  int rc = ROOM_ERROR;
 
-  // >> Create master socket
-  *socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (message.body != NULL) free(message.body);
 
-  if (*socket_fd < 0) {
-    perror("socket creation");
-    exit(1);
+  memcpy(room, message.receiver_name, USERNAME_MAX);
+  room[USERNAME_MAX - 1] = '\0';
+
+  if (room[0] != ROOM_MARK || room[1] == '\0') {
+    respond(message.sender_name, USR_ERROR,
+      "Room names start with '#', like #general.");
+    return;
   }
 
-  // >> Set properties for socket address
-  master_addr.sin_family = AF_INET;
-  master_addr.sin_port = htons(PORT);
-  master_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  User* user = get_user_by_username(message.sender_name);
+  if (user == NULL) return;
 
-  // >> Bind the socket
-  rc = bind(*socket_fd, (struct sockaddr*)&master_addr, master_addr_size);
+  // >> Rooms change like the membership does; anybody already delivering to
+  //    one keeps going with the snapshot they have
+  pthread_mutex_lock(&ut_lock);
 
-  if (rc) {
-    perror("socket bind");
-    exit(1);
+  // Somebody logging out is taken out of their rooms for good, so they can't
+  // be let back into one on the way
+  if (is_member(user)) {
+    rc = joining ? join_room(user, room) : part_room(user, room);
   }
 
-  // >> Start listening on the socket
-  rc = listen(*socket_fd, CONN_LIMIT);
+  pthread_mutex_unlock(&ut_lock);
 
-  if (rc) {
-    perror("socket listen");
-    exit(1);
+  log_info("User \"%s\" %s \"%s\"", message.sender_name,
+    joining ? "is joining" : "is leaving", room);
+
+  switch (rc) {
+    case ROOM_DONE:
+      sprintf(reply, joining ? "You joined %s." : "You left %s.", room);
+      respond(message.sender_name, SRV_RESPONSE, reply);
+
+      // >> Then show them what they walked in on. Only the router sends to
+      //    rooms, so none of it has gone to them yet
+      if (joining) replay_history(room_history(room), user, ULONG_MAX);
+      break;
+
+    case ROOM_ALREADY:
+      sprintf(reply, joining ? "You're already in %s." : "You aren't in %s.",
+        room);
+      respond(message.sender_name, USR_ERROR, reply);
+      break;
+
+    case ROOM_FULL:
+      respond(message.sender_name, USR_ERROR,
+        "You're in too many rooms, or there are too many rooms.");
+      break;
+
+    default:
+      respond(message.sender_name, SRV_ERROR, "Something went wrong");
+      break;
   }
+
+  release_user(user);
 }
 
 
 /**
- * Logs the user in and creates a thread for them.
- * @return A return code; 0 on success, 1 otherwise
+ * Updates the roster for somebody logging in or out, and tells everyone. Even
+ * whoever just logged in is told, since the extra feedback is nice for them.
+ * @param message The MSG_LOGIN or MSG_LOGOUT from their worker
  */
-static int spawn_thread() {
-  int i, rc;
-  char res_msg[48];
-  Message request, response;
+static void come_or_go(Message message) {
+  Message delta;
+  int rc;
 
-  int client_sock = accept(
-    master_sock, (struct sockaddr*)&master_addr, &master_addr_size
-  );
+  rc = message.type == MSG_LOGIN
+    ? add_to_roster(message.sender_name, &delta)
+    : remove_from_roster(message.sender_name, &delta);
 
-  if (client_sock == -1) {
-    perror("accept new client");
-    return -1;
+  if (rc < 0) {
+    log_error("Couldn't add \"%s\" to the roster", message.sender_name);
   }
 
-  // >> Receive login request containing username
-  request = recv_message(client_sock);
+  // >> Just like any announcement, so big audiences are split up the same way
+  if (rc == 1) broadcast(delta);
 
-  printf("%s Received login request\n", timestamp());
+  if (message.type == MSG_LOGIN) catch_up(message);
+  else if (message.body != NULL) free(message.body);
+}
 
-  // Free memory if it was set, just in case
-  if (request.body != NULL) free(request.body);
 
-  // Check that they are actually logging in
-  if (request.type != MSG_LOGIN) {
-    response.type = USR_ERROR;
-    strcpy(res_msg, "Need to login before anything else");
-    goto send_response;
-  }
+/**
+ * Sends somebody who just logged in what was broadcast before they got here,
+ * and then whatever was whispered to them while they were away. Anything
+ * broadcast since their worker added them to the membership already went to
+ * them, so it isn't sent again; a few of those may get to them ahead of what's
+ * replayed here.
+ * @param message The MSG_LOGIN from their worker
+ */
+static void catch_up(Message message) {
+  char reply[64];
+  unsigned int count;
 
-  // >> Find the first empty spot in the Users array to put this new connection
+  if (message.body != NULL) free(message.body);
 
-  pthread_mutex_lock(&ut_lock);
+  User* user = get_user_by_username(message.sender_name);
+  if (user == NULL) return;
 
-  for (i = 0; i <= CONN_LIMIT; i++) {
-    if (i == CONN_LIMIT) { // Didn't find any free spots
-      fprintf(stderr, "Max connections reached, rejecting connection\n");
+  count = replay_history(&lobby_history, user, user->joined);
 
-      pthread_mutex_unlock(&ut_lock);
+  if (count > 0) {
+    sprintf(reply, "That was the last %u message%s before you got here.",
+      count, count == 1 ? "" : "s");
+    respond(message.sender_name, SRV_RESPONSE, reply);
+  }
 
-      response.type = SRV_ERROR;
-      strcpy(res_msg, "Server is full");
-      goto send_response;
-    } else if (users[i].socket_fd == -1) break; // i is a free spot
+  count = deliver_mail(user);
+
+  if (count > 0) {
+    sprintf(reply, "That was %u whisper%s from while you were away.",
+      count, count == 1 ? "" : "s");
+    respond(message.sender_name, SRV_RESPONSE, reply);
   }
 
-  // >> Check if there's anybody else with that name
+  release_user(user);
+}
 
-  if (get_thread_by_username(request.sender_name)) {
-    pthread_mutex_unlock(&ut_lock);
 
-    response.type = USR_ERROR;
-    strcpy(res_msg, "There is already a user with that username");
-    goto send_response;
-  }
+/**
+ * Sends a short reply from the server to one user, if they're still here.
+ * @param username Who to send it to
+ * @param type The SRV_ or _ERROR type to send it as
+ * @param text What to say
+ */
+static void respond(const char username[], unsigned short type,
+    const char text[]) {
+  Message response;
+  User* user = get_user_by_username(username);
 
-  // >> Store user information and release users array
+  if (user == NULL) return;
 
-  users[i].socket_fd = client_sock;
-  strncpy(users[i].username, request.sender_name, USERNAME_MAX);
-  User* new_user = users + i; // keep track of user pointer
+  response.type = type;
+  response.size = strlen(text) + 1;
+  response.body = calloc(response.size, 1);
+  if (response.body != NULL) strcpy(response.body, text);
 
-  // >> Find the first empty spot in the Threads array to put this new user in
+  memset(response.sender_name, 0, USERNAME_MAX);
+  memset(response.receiver_name, 0, USERNAME_MAX);
 
-  for (i = 0; i <= CONN_LIMIT; i++) {
-    if (i == CONN_LIMIT) {
-      fprintf(stderr, "Max threads reached, rejecting connection\n");
+  deliver(user, share_message(response));
+  release_user(user);
+}
 
-      users[i].socket_fd = -1;
-      memset(users[i].username, 0, USERNAME_MAX);
 
-      pthread_mutex_unlock(&ut_lock);
+/**
+ * Runs a command from the client and sends the response back.
+ * @param message The message of which the body contains a command string.
+ */
+static void run_command(Message message) {
+  Message response;
 
-      response.type = SRV_ERROR;
-      strcpy(res_msg, "Server is full");
-      goto send_response;
-    } else if (!threads[i].in_use) break; // i is a free spot
+  log_info("User \"%s\" is running a command", message.sender_name);
+
+  // >> Find command
+  command_ptr command = find_command(message.body);
+  if (command == NULL) {
+    response.type = USR_ERROR;
+    response.size = 32 + strlen(message.body); // size needed
+    response.body = calloc(response.size, 1);
+    sprintf(response.body, "Could not find the command \"%s\".", message.body);
+    goto error;
   }
 
-  // >> Initialize thread
+  log_debug("Found command \"%s\"", message.body);
 
-  rc = pipe(threads[i].pipe_fd);
-  if (rc) {
-    perror("thread pipe creation");
+  // >> Run command and get return code
+  int rc = (*command)(&message, &response);
+
+  if (rc == COMMAND_ANSWERED) {
+    log_debug("Command succeeded");
+    free(message.body);
+    return;
+  }
 
+  if (rc) {
     response.type = SRV_ERROR;
-    strcpy(res_msg, "Something went wrong");
-    goto send_response;
+    response.size = 48;
+    response.body = calloc(response.size, 1);
+    sprintf(response.body, "Something went wrong running the command.");
+    goto error;
   }
 
-  threads[i].in_use = 1;
-  threads[i].user = new_user;
+  log_debug("Command succeeded");
 
-  // >> Create thread and release threads array
-  pthread_create(&threads[i].id, NULL, client_thread, (void*)&threads[i]);
+  goto send_response; // Skip over creating error packet if error not hit
 
-  pthread_mutex_unlock(&ut_lock);
+error:;
+  memset(response.sender_name, 0, USERNAME_MAX);
+  memset(response.receiver_name, 0, USERNAME_MAX);
+  log_info("Command failed");
 
-  // >> Respond to client
-  response.type = SRV_RESPONSE;
-  memset(res_msg, 0, sizeof(res_msg));
+send_response:;
+  if (message.body != NULL) free(message.body);
 
-  // Jump here to send response to client
-send_response:
-  response.size = strlen(res_msg) + 1;
+  User* reply_to = get_user_by_username(message.sender_name);
 
-  if (response.size > 0) {
-    response.body = calloc(response.size, 1);
-    strcpy(response.body, res_msg);
+  if (reply_to != NULL) {
+    deliver(reply_to, share_message(response));
+    release_user(reply_to);
+  } else if (response.body != NULL) {
+    free(response.body);
   }
 
-  memset(response.sender_name, 0, USERNAME_MAX);
-  memset(response.receiver_name, 0, USERNAME_MAX);
+  // Hmmm... maybe I am getting too comfortable with goto statements. Oh well, I
+  // like them. Maybe I should write more Assembly, lol.
+}
 
-  send_message(client_sock, response);
-  if (response.size > 0) free(response.body);
 
-  if (response.type != SRV_RESPONSE) {
-    printf("%s User could not log in.\n", timestamp());
-    close(client_sock);
-    return 1;
-  } else {
-    printf("%s User \"%s\" has logged in\n", timestamp(), new_user->username);
+/**
+ * Reads the settings from the command line into `config`, with defaults for
+ * anything not given.
+ * @param argc Pass-through of argc from main
+ * @param argv Pass-through of argv from main
+ */
+static void parse_args(int argc, char* argv[]) {
+  int i;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  FILE* f; // which file to print to (stdout/err) when jumping to print usage
+
+  config.workers = cores > 0 ? (unsigned int)cores : 1;
+  config.conn_limit = DEFAULT_CONN_LIMIT;
+  config.fanout = DEFAULT_FANOUT;
+  config.out_messages = DEFAULT_OUT_MESSAGES;
+  config.out_kib = DEFAULT_OUT_KIB;
+  config.policy = SLOW_DROP;
+  config.grace = DEFAULT_GRACE;
+  config.log_level = LOG_FLOOR;
+  config.stack_kib = DEFAULT_STACK_KIB;
+  config.io = IO_EPOLL;
+  config.archive = NULL;
+  config.sync_ms = DEFAULT_SYNC_MS;
+  config.mail_messages = DEFAULT_MAIL_MESSAGES;
+  config.mail_ttl = DEFAULT_MAIL_TTL;
+
+  for (i = 1; i < argc; i++) {
+    unsigned int* setting = NULL;
+    char* end;
+
+    if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+      f = stdout;
+      goto print_usage;
+    }
 
-    // >> Broadcast to all users that the new client is here (even the new
-    //    client, since the extra feedback is nice for them)
+    // >> The archive's directory is the only setting that's a path
+    if (strcmp(argv[i], "-a") == 0) {
+      if (i + 1 == argc) {
+        fprintf(stderr, "Missing a value for \"%s\".\n", argv[i]);
+        f = stderr;
+        goto print_usage;
+      }
 
-    Message announce;
-    announce.type = SRV_ANNOUNCE;
+      config.archive = argv[++i];
+      continue;
+    }
 
-    memset(announce.sender_name, 0, USERNAME_MAX);
-    memset(announce.receiver_name, 0, USERNAME_MAX);
+    if (strcmp(argv[i], "-w") == 0) setting = &config.workers;
+    else if (strcmp(argv[i], "-c") == 0) setting = &config.conn_limit;
+    else if (strcmp(argv[i], "-f") == 0) setting = &config.fanout;
+    else if (strcmp(argv[i], "-m") == 0) setting = &config.out_messages;
+    else if (strcmp(argv[i], "-b") == 0) setting = &config.out_kib;
+    else if (strcmp(argv[i], "-p") == 0) setting = &config.policy;
+    else if (strcmp(argv[i], "-g") == 0) setting = &config.grace;
+    else if (strcmp(argv[i], "-l") == 0) setting = &config.log_level;
+    else if (strcmp(argv[i], "-s") == 0) setting = &config.stack_kib;
+    else if (strcmp(argv[i], "-i") == 0) setting = &config.io;
+    else if (strcmp(argv[i], "-d") == 0) setting = &config.sync_ms;
+    else if (strcmp(argv[i], "-o") == 0) setting = &config.mail_messages;
+    else if (strcmp(argv[i], "-t") == 0) setting = &config.mail_ttl;
+
+    if (setting == NULL) {
+      fprintf(stderr, "Unknown option \"%s\".\n", argv[i]);
+      f = stderr;
+      goto print_usage;
+    }
 
-    char body[12 + USERNAME_MAX];
-    sprintf(body, "%s has joined!", new_user->username);
+    if (i + 1 == argc) {
+      fprintf(stderr, "Missing a value for \"%s\".\n", argv[i]);
+      f = stderr;
+      goto print_usage;
+    }
+
+    // >> The policy, the log level, and the backend are given by name;
+    //    everything else is a number
+    const char* const* names = setting == &config.policy ? policy_names
+      : setting == &config.log_level ? level_names
+      : setting == &config.io ? io_names
+      : NULL;
+
+    if (names != NULL) {
+      unsigned int n;
+      i++;
 
-    announce.size = strlen(body) + 1;
-    announce.body = calloc(announce.size, 1);
-    strcpy(announce.body, body);
+      for (n = 0; names[n] != NULL; n++) {
+        if (strcmp(names[n], argv[i]) == 0) break;
+      }
 
-    broadcast(announce);
+      if (names[n] == NULL) {
+        fprintf(stderr, "Invalid value \"%s\" for \"%s\".\n",
+          argv[i], argv[i - 1]);
+        f = stderr;
+        goto print_usage;
+      }
 
-    return 0;
+      *setting = n;
+      continue;
+    }
+
+    unsigned long value = strtoul(argv[++i], &end, 10);
+    if (*end != '\0' || value == 0 || value > 1000000) {
+      fprintf(stderr, "Invalid value \"%s\" for \"%s\".\n", argv[i], argv[i - 1]);
+      f = stderr;
+      goto print_usage;
+    }
+
+    *setting = (unsigned int)value;
   }
-}
\ No newline at end of file
+
+  return;
+
+print_usage:
+  fprintf(f,
+    "Usage:\n\n"
+    " >> %s [-w workers] [-c limit] [-f fanout] [-m messages] [-b kib]\n"
+    "          [-p drop|kick|push] [-g grace] [-l debug|info|warn|error]\n"
+    "          [-s stack] [-i epoll|uring] [-a directory] [-d window]\n"
+    "          [-o mail] [-t ttl]\n\n"
+    "where 'workers' is how many event loops handle clients (one per core if\n"
+    "not given), 'limit' is the most users that may be logged in at once\n"
+    "(%i if not given), and 'fanout' is how many need to be logged in for\n"
+    "the workers to split broadcasts up between them (%i if not given).\n\n"
+    "'messages' and 'kib' are how much may wait to be sent to one user (%i\n"
+    "and %i if not given). Past that, the policy either drops their oldest\n"
+    "broadcasts, disconnects them after 'grace' seconds (%i if not given), or\n"
+    "pauses whoever sends to them; 'drop' if not given. Twice that, and they\n"
+    "are disconnected no matter what.\n\n"
+    "'level' is the least important kind of line to log; 'info' if not given\n"
+    "('debug' in the debug build), and 'stack' is how many KiB of stack each\n"
+    "worker gets (%i if not given).\n\n"
+    "The workers wait on their sockets with epoll, unless 'uring' is given;\n"
+    "then they use io_uring, or epoll anyway if it isn't available.\n\n"
+    "Given a 'directory', every message users send is kept there on disk.\n"
+    "They're synced at most 'window' milliseconds after being sent (%i if\n"
+    "not given), all at once.\n\n"
+    "Whispers to somebody who isn't logged in are kept until they are, up to\n"
+    "'mail' of them (%i if not given), for 'ttl' seconds (%i if not given).\n",
+    argv[0], DEFAULT_CONN_LIMIT, DEFAULT_FANOUT, DEFAULT_OUT_MESSAGES,
+    DEFAULT_OUT_KIB, DEFAULT_GRACE, DEFAULT_STACK_KIB, DEFAULT_SYNC_MS,
+    DEFAULT_MAIL_MESSAGES, DEFAULT_MAIL_TTL
+  );
+
+  exit(2);
+}
+
+
+/**
+ * Raises the limit on open files as far as it will go, since every user needs
+ * a socket. Warns if it still isn't enough for the connection limit.
+ */
+static void raise_file_limit() {
+  struct rlimit limit;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) return;
+
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  getrlimit(RLIMIT_NOFILE, &limit);
+
+  // A few extra for the listeners, pipes, and epolls
+  if (limit.rlim_cur < (rlim_t)config.conn_limit + 4 * config.workers + 16) {
+    log_warn("Only %lu files can be open, which isn't enough for %u users",
+      (unsigned long)limit.rlim_cur, config.conn_limit);
+  }
+}
+
+
+#ifdef __DEBUG__
+/**
+ * Writes out as much of a message's body in hex as fits, for debug logging.
+ * @param message The message to write out
+ * @param out Where to write it
+ * @param room How big `out` is
+ * @return `out`
+ */
+static const char* hex_body(const Message* message, char* out, size_t room) {
+  size_t i;
+
+  out[0] = '\0';
+
+  for (i = 0; i < message->size && (i + 1) * 3 < room; i++)
+    sprintf(out + i * 3, "%02x ", message->body[i] & 0xff);
+
+  return out;
+}
+#endif
\ No newline at end of file
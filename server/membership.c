@@ -0,0 +1,226 @@
+/**
+ * COIS-4310H: Chat App
+ *
+ * @name:         Chat App -- Membership snapshots
+ *
+ * @author:       Matthew Brown, #0648289
+ * @date:         March 1st to March 9th, 2021
+ *
+ * @purpose:      This file keeps track of who's logged in, for everything that
+ *                needs to go through all of them (broadcasts, /who). The set
+ *                is published as a read-only snapshot: readers pin it and loop
+ *                over it without any locks, and logins and logouts copy it,
+ *                change the copy, and swap it in under `ut_lock`. Other sets
+ *                of users, like rooms, are published the same way.
+ *
+ *                Replaced snapshots are freed with epoch-based reclamation.
+ *                Each reader says which epoch it saw when it pinned, and a
+ *                snapshot replaced in some epoch is only freed once no reader
+ *                is still pinned from that epoch or earlier. Users who left are
+ *                released along with the last snapshot that had them in it.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "../shared/constants.h"
+
+#include "./constants.h"
+#include "./utility.h"
+#include "./membership.h"
+#include "./log.h"
+
+
+/**
+ * What one reader has pinned, on its own cache line so readers don't slow
+ * each other down.
+ */
+typedef struct reader {
+  unsigned long epoch;  // The epoch it pinned in; 0 when not reading
+  char pad[CACHE_LINE - sizeof(unsigned long)];
+} Reader;
+
+
+static Snapshot* current;       // The published snapshot
+static unsigned long epoch = 1; // Bumped every time a snapshot is replaced
+static Reader* readers;
+static unsigned int reader_count;
+static Snapshot* retired;       // Replaced snapshots, newest first
+
+
+int init_membership(unsigned int count) {
+  readers = calloc(count, sizeof(Reader));
+  current = calloc(1, sizeof(Snapshot));
+
+  if (readers == NULL || current == NULL) return -1;
+
+  reader_count = count;
+  return 0;
+}
+
+
+const Snapshot* enter_snapshot(int reader) {
+  return enter_set(&current, reader);
+}
+
+
+const Snapshot* enter_set(Snapshot* const* set, int reader) {
+  // A writer that doesn't see this pin yet must have already published the
+  // snapshot about to be loaded, since all of these are sequentially
+  // consistent; so it never frees what this reader ends up with
+  unsigned long seen = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&readers[reader].epoch, seen, __ATOMIC_SEQ_CST);
+
+  return __atomic_load_n(set, __ATOMIC_SEQ_CST);
+}
+
+
+void leave_snapshot(int reader) {
+  __atomic_store_n(&readers[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+unsigned int member_count() {
+  return current->count;
+}
+
+
+int is_member(const User* user) {
+  return user->member_index < current->count &&
+    current->users[user->member_index] == user;
+}
+
+
+/**
+ * Frees every retired snapshot that no reader can still be using, and
+ * releases the users who left with them. `ut_lock` must be held.
+ */
+static void reclaim() {
+  unsigned long oldest = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+  Snapshot** link;
+  unsigned int i;
+
+  // >> Find the earliest epoch anybody is still pinned in
+  for (i = 0; i < reader_count; i++) {
+    unsigned long pinned = __atomic_load_n(&readers[i].epoch, __ATOMIC_SEQ_CST);
+    if (pinned != 0 && pinned < oldest) oldest = pinned;
+  }
+
+  // >> Snapshots replaced before then can't be seen by anybody
+  link = &retired;
+
+  while (*link != NULL) {
+    Snapshot* snapshot = *link;
+
+    if (snapshot->retired < oldest) {
+      *link = snapshot->next;
+      if (snapshot->departed != NULL) release_user(snapshot->departed);
+      free(snapshot);
+    } else {
+      link = &snapshot->next;
+    }
+  }
+}
+
+
+/**
+ * Swaps in a new snapshot, and retires the old one.
+ * @param set Where the snapshot is published
+ * @param replacement The new snapshot
+ * @param departed Who left in this change, if anybody, to be released
+ */
+static void publish(Snapshot** set, Snapshot* replacement, User* departed) {
+  Snapshot* old = *set;
+
+  replacement->published = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST) + 1;
+  __atomic_store_n(set, replacement, __ATOMIC_SEQ_CST);
+
+  // >> Readers who pinned before the bump may still have the old one
+  old->retired = __atomic_fetch_add(&epoch, 1, __ATOMIC_SEQ_CST);
+  old->departed = departed;
+  old->next = retired;
+  retired = old;
+
+  reclaim();
+}
+
+
+int add_member(User* user) {
+  unsigned int count = current->count;
+  Snapshot* replacement = malloc(sizeof(Snapshot) + sizeof(User*) * (count + 1));
+
+  if (replacement == NULL) return -1;
+
+  memcpy(replacement->users, current->users, sizeof(User*) * count);
+  replacement->users[count] = user;
+  replacement->count = count + 1;
+
+  user->member_index = count;
+
+  publish(&current, replacement, NULL);
+
+  // Anything sent to a snapshot from before this missed them
+  user->joined = replacement->published;
+  return 0;
+}
+
+
+void remove_member(User* user) {
+  unsigned int count = current->count;
+  unsigned int index = user->member_index;
+  Snapshot* replacement = malloc(sizeof(Snapshot) + sizeof(User*) * count);
+
+  if (replacement == NULL) {
+    // They stay in, closed; their worker drops anything delivered to them
+    log_error("Couldn't allocate a snapshot to remove a user from");
+    return;
+  }
+
+  // >> Move the last user into the leaving user's spot
+  memcpy(replacement->users, current->users, sizeof(User*) * count);
+  replacement->users[index] = replacement->users[count - 1];
+  replacement->users[index]->member_index = index;
+  replacement->count = count - 1;
+
+  publish(&current, replacement, user);
+}
+
+
+int add_to_set(Snapshot** set, User* user) {
+  unsigned int count = (*set)->count;
+  Snapshot* replacement = malloc(sizeof(Snapshot) + sizeof(User*) * (count + 1));
+
+  if (replacement == NULL) return -1;
+
+  memcpy(replacement->users, (*set)->users, sizeof(User*) * count);
+  replacement->users[count] = user;
+  replacement->count = count + 1;
+
+  publish(set, replacement, NULL);
+  return 0;
+}
+
+
+int remove_from_set(Snapshot** set, User* user) {
+  unsigned int count = (*set)->count;
+  unsigned int i, kept = 0;
+  Snapshot* replacement = malloc(sizeof(Snapshot) + sizeof(User*) * count);
+
+  if (replacement == NULL) return -1;
+
+  // >> Sets don't keep track of where everyone is; keep everybody else, in
+  //    the same order
+  for (i = 0; i < count; i++) {
+    if ((*set)->users[i] != user) replacement->users[kept++] = (*set)->users[i];
+  }
+
+  replacement->count = kept;
+
+  publish(set, replacement, NULL);
+  return 0;
+}
\ No newline at end of file
@@ -0,0 +1,108 @@
+#ifndef __SERVER_MEMBERSHIP__
+#define __SERVER_MEMBERSHIP__
+
+#include "./constants.h"
+
+#define ROUTER_READER 0                  // The router's reader slot
+#define WORKER_READER(index) ((index) + 1)  // Each worker's reader slot
+
+/**
+ * Every logged-in user at one point in time. Snapshots are never changed once
+ * they're published; joining and leaving publish a new one instead, and old
+ * ones are freed once nobody can be reading them anymore.
+ */
+typedef struct snapshot {
+  unsigned int count;        // How many users there are
+  unsigned long published;   // The epoch it was published in; later
+                             // snapshots of the same set have later ones
+
+  // Used to retire the snapshot once it's been replaced; writers only
+  unsigned long retired;     // The epoch it was replaced in
+  User* departed;            // The user who left in that change, if any
+  struct snapshot* next;     // Next snapshot waiting to be freed
+
+  User* users[];
+} Snapshot;
+
+/**
+ * Sets up an empty membership; must be called before any worker starts.
+ * @param readers How many threads will read snapshots; each one gets its own
+ * slot, from 0 up
+ * @return 0 on success, -1 if it couldn't be allocated
+ */
+int init_membership(unsigned int readers);
+
+/**
+ * Pins the current snapshot for reading, without taking any locks. Every user
+ * in it stays allocated until leave_snapshot, even if they log out meanwhile.
+ * Each reader may only have one snapshot pinned at a time.
+ * @param reader The calling thread's reader slot
+ * @return The snapshot
+ */
+const Snapshot* enter_snapshot(int reader);
+
+/**
+ * Pins the current snapshot of some other set of users for reading, just like
+ * enter_snapshot. Unpin it with leave_snapshot.
+ * @param set Where the set's snapshots are published
+ * @param reader The calling thread's reader slot
+ * @return The snapshot
+ */
+const Snapshot* enter_set(Snapshot* const* set, int reader);
+
+/**
+ * Unpins the snapshot the reader was using.
+ * @param reader The calling thread's reader slot
+ */
+void leave_snapshot(int reader);
+
+/**
+ * Counts the users in the current snapshot. `ut_lock` must be held.
+ * @return The number of logged-in users
+ */
+unsigned int member_count();
+
+/**
+ * Checks whether a user is still logged in. `ut_lock` must be held.
+ * @param user The user to check
+ * @return 1 if they're in the current snapshot, 0 if not
+ */
+int is_member(const User* user);
+
+/**
+ * Publishes a new snapshot with a user added, and sets when they `joined`.
+ * `ut_lock` must be held.
+ * @param user The user who joined; the membership takes over one hold on them
+ * @return 0 on success, -1 if there was no memory for it
+ */
+int add_member(User* user);
+
+/**
+ * Publishes a new snapshot with a user taken out. `ut_lock` must be held. The
+ * membership's hold on them is released once no reader can still see them.
+ * @param user The user who left
+ */
+void remove_member(User* user);
+
+/**
+ * Publishes a new snapshot of some other set of users, with a user added. Old
+ * ones are reclaimed along with the membership's. `ut_lock` must be held. Sets
+ * don't hold their users; everybody in one has to be a member too, and taken
+ * out of the set before they're taken out of the membership.
+ * @param set Where the set's snapshots are published; starts out as an empty
+ * snapshot
+ * @param user The user to add
+ * @return 0 on success, -1 if there was no memory for it
+ */
+int add_to_set(Snapshot** set, User* user);
+
+/**
+ * Publishes a new snapshot of some other set of users, with a user taken out.
+ * `ut_lock` must be held.
+ * @param set Where the set's snapshots are published
+ * @param user The user to take out
+ * @return 0 on success, -1 if there was no memory for it
+ */
+int remove_from_set(Snapshot** set, User* user);
+
+#endif
\ No newline at end of file
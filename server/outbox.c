@@ -0,0 +1,95 @@
+/**
+ * COIS-4310H: Chat App
+ *
+ * @name:         Chat App -- User outboxes
+ *
+ * @author:       Matthew Brown, #0648289
+ * @date:         March 1st to March 9th, 2021
+ *
+ * @purpose:      This file holds the queues the router leaves messages for
+ *                each user in. Every outbox has only one producer and one
+ *                consumer, so a pair of counters per block is all that needs
+ *                sharing between them. When a block fills up, the producer
+ *                chains on a new one instead of waiting, so the router is
+ *                never held up by a busy worker.
+ *
+ */
+
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../shared/constants.h"
+
+#include "./outbox.h"
+
+
+int init_outbox(Outbox* outbox) {
+  outbox->write = calloc(1, sizeof(OutboxSegment));
+  outbox->read = outbox->write;
+
+  return outbox->write == NULL ? -1 : 0;
+}
+
+
+int push_outbox(Outbox* outbox, SharedMessage* message, unsigned long stamp) {
+  OutboxSegment* segment = outbox->write;
+  unsigned long tail = segment->tail; // Only this thread ever changes it
+
+  if (tail == OUTBOX_SEGMENT) {
+    // >> This block is full; chain on a new one. The consumer frees the old
+    //    one once it has followed `next` off of it
+    OutboxSegment* fresh = calloc(1, sizeof(OutboxSegment));
+    if (fresh == NULL) return -1;
+
+    __atomic_store_n(&segment->next, fresh, __ATOMIC_RELEASE);
+    outbox->write = segment = fresh;
+    tail = 0;
+  }
+
+  // >> Fill the slot, then publish it
+  segment->slots[tail].message = message;
+  segment->slots[tail].stamp = stamp;
+  __atomic_store_n(&segment->tail, tail + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+
+int pop_outbox(Outbox* outbox, SharedMessage** message, unsigned long until) {
+  OutboxSegment* segment = outbox->read;
+
+  while (1) {
+    if (segment->head < __atomic_load_n(&segment->tail, __ATOMIC_ACQUIRE)) {
+      if (segment->slots[segment->head].stamp > until) return 0;
+
+      *message = segment->slots[segment->head].message;
+      segment->head += 1;
+      return 1;
+    }
+
+    // >> Only move on once the producer has finished with this block
+    OutboxSegment* next = NULL;
+    if (segment->head == OUTBOX_SEGMENT)
+      next = __atomic_load_n(&segment->next, __ATOMIC_ACQUIRE);
+
+    if (next == NULL) return 0;
+
+    outbox->read = next;
+    free(segment);
+    segment = next;
+  }
+}
+
+
+void free_outbox(Outbox* outbox) {
+  SharedMessage* message;
+
+  if (outbox->read == NULL) return;
+
+  while (pop_outbox(outbox, &message, ULONG_MAX)) release_shared(message);
+
+  free(outbox->read);
+  outbox->read = outbox->write = NULL;
+}
\ No newline at end of file
@@ -0,0 +1,67 @@
+#ifndef __SERVER_OUTBOX__
+#define __SERVER_OUTBOX__
+
+#include "../shared/messaging.h"
+
+#define OUTBOX_SEGMENT 64  // Messages per block of an outbox
+
+/**
+ * One fixed-size block of an outbox. Blocks are chained together as the
+ * outbox fills up, and freed once they've been emptied.
+ */
+typedef struct outbox_segment {
+  unsigned long tail;                   // How many slots the producer has filled
+  unsigned long head;                   // How many the consumer has taken out
+  struct outbox_segment* next;          // Block the producer moved on to, if any
+
+  struct outbox_slot {
+    SharedMessage* message;
+    unsigned long stamp;                // Given by the producer; see push_outbox
+  } slots[OUTBOX_SEGMENT];
+} OutboxSegment;
+
+/**
+ * A queue of messages waiting to be sent to one user, for exactly one thread
+ * to push onto (the router) and one thread to pop from (the user's worker).
+ * Neither side ever waits on the other.
+ */
+typedef struct outbox {
+  OutboxSegment* write;  // Block the producer is filling; producer only
+  OutboxSegment* read;   // Block the consumer is emptying; consumer only
+} Outbox;
+
+/**
+ * Sets up an empty outbox.
+ * @param outbox The outbox to set up
+ * @return 0 on success, -1 if it couldn't be allocated
+ */
+int init_outbox(Outbox* outbox);
+
+/**
+ * Adds a message to the end of an outbox. Only one thread may ever push.
+ * @param outbox The outbox to add to
+ * @param message The message; whoever pops it takes over the caller's hold
+ * @param stamp Marks where the message falls among things sent some other way;
+ * stamps must never go down
+ * @return 0 on success, -1 if there was no memory for it
+ */
+int push_outbox(Outbox* outbox, SharedMessage* message, unsigned long stamp);
+
+/**
+ * Takes the oldest message out of an outbox. Only one thread may ever pop.
+ * @param outbox The outbox to take from
+ * @param message Where to put the message, which the caller now holds
+ * @param until The highest stamp to take; anything after it is left in
+ * @return 1 if there was a message, 0 if the outbox is empty or the next
+ * message is stamped after `until`
+ */
+int pop_outbox(Outbox* outbox, SharedMessage** message, unsigned long until);
+
+/**
+ * Frees an outbox, releasing any messages still in it. Nobody
+ * else may be using it anymore.
+ * @param outbox The outbox to free
+ */
+void free_outbox(Outbox* outbox);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,136 @@
+/**
+ * COIS-4310H: Chat App
+ *
+ * @name:         Chat App -- Lock-free message queue
+ *
+ * @author:       Matthew Brown, #0648289
+ * @date:         March 1st to March 9th, 2021
+ *
+ * @purpose:      This file holds the queue workers hand messages up to the
+ *                router with. Producers claim a slot by bumping `tail` with a
+ *                compare-and-swap, and hand it over by bumping the slot's
+ *                sequence number, so nobody ever waits on a lock or makes a
+ *                syscall per message. The router is woken through an eventfd,
+ *                which only the first push after it last checked writes to.
+ *
+ */
+
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sched.h>
+#include <sys/eventfd.h>
+
+#include "../shared/constants.h"
+
+#include "./queue.h"
+
+
+int init_queue(MessageQueue* queue, unsigned long capacity) {
+  unsigned long count = 2, i;
+
+  while (count < capacity) count <<= 1;
+
+  queue->slots = calloc(count, sizeof(QueueSlot));
+  if (queue->slots == NULL) return -1;
+
+  // >> Each slot starts out free for the first producer to reach it
+  for (i = 0; i < count; i++) queue->slots[i].sequence = i;
+
+  queue->mask = count - 1;
+  queue->head = 0;
+  queue->tail = 0;
+  queue->signalled = 0;
+
+  queue->event_fd = eventfd(0, EFD_NONBLOCK);
+  if (queue->event_fd == -1) {
+    free(queue->slots);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Writes to a queue's eventfd, unless that's already been done since the
+ * consumer last cleared it.
+ */
+static void signal_queue(MessageQueue* queue) {
+  uint64_t one = 1;
+
+  if (__atomic_exchange_n(&queue->signalled, 1, __ATOMIC_SEQ_CST) == 0) {
+    write(queue->event_fd, &one, sizeof(one));
+  }
+}
+
+
+void push_message(MessageQueue* queue, Message message) {
+  unsigned long position = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+  QueueSlot* slot;
+
+  while (1) {
+    slot = &queue->slots[position & queue->mask];
+    long difference = (long)(
+      __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position
+    );
+
+    if (difference == 0) {
+      // >> The slot is free; try to claim it. On failure, `position` is
+      //    updated to where the other producer left the tail
+      if (__atomic_compare_exchange_n(&queue->tail, &position, position + 1,
+          1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+
+    } else if (difference < 0) {
+      // >> Queue is full; make sure the consumer is awake to empty it, and
+      //    give it a chance to
+      signal_queue(queue);
+      sched_yield();
+      position = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+
+    } else {
+      // >> Another producer got this one first
+      position = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    }
+  }
+
+  // >> Fill the slot and hand it over to the consumer
+  slot->message = message;
+  __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+
+  signal_queue(queue);
+}
+
+
+void clear_queue_signal(MessageQueue* queue) {
+  uint64_t count;
+
+  read(queue->event_fd, &count, sizeof(count));
+
+  // Anything pushed after this point will signal again, and anything pushed
+  // before it will be found by the pops that follow
+  __atomic_store_n(&queue->signalled, 0, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+int pop_message(MessageQueue* queue, Message* message) {
+  QueueSlot* slot = &queue->slots[queue->head & queue->mask];
+
+  if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != queue->head + 1) {
+    return 0;
+  }
+
+  *message = slot->message;
+
+  // >> Free the slot up for the producer that comes back around to it
+  __atomic_store_n(&slot->sequence, queue->head + queue->mask + 1,
+    __ATOMIC_RELEASE);
+  queue->head += 1;
+
+  return 1;
+}
\ No newline at end of file
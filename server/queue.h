@@ -0,0 +1,70 @@
+#ifndef __SERVER_QUEUE__
+#define __SERVER_QUEUE__
+
+#include "../shared/messaging.h"
+
+#define CACHE_LINE 64  // Size to pad apart data written by different threads
+
+/**
+ * One place in a queue. `sequence` says whose turn the slot is: it equals the
+ * position a producer may claim it at, or one past that once the message in
+ * it is ready for the consumer.
+ */
+typedef struct queue_slot {
+  unsigned long sequence;
+  Message message;
+} QueueSlot;
+
+/**
+ * A bounded, lock-free queue of messages which any number of threads can push
+ * onto but only one thread pops from. The consumer watches `event_fd`, which
+ * is signalled once per batch of pushes rather than once per message.
+ */
+typedef struct message_queue {
+  QueueSlot* slots;     // `capacity` slots, a power of two
+  unsigned long mask;   // `capacity` minus one
+  int event_fd;         // eventfd the consumer is woken up through
+
+  // Producers and the consumer each get their own cache line, so they don't
+  // slow each other down writing to them
+  char pad0[CACHE_LINE];
+  unsigned long tail;       // Next position for a producer to claim
+  unsigned char signalled;  // Set once event_fd has been written to
+  char pad1[CACHE_LINE];
+  unsigned long head;       // Next position for the consumer to pop
+  char pad2[CACHE_LINE];
+} MessageQueue;
+
+/**
+ * Sets up a queue.
+ * @param queue The queue to set up
+ * @param capacity How many messages it holds; rounded up to a power of two
+ * @return 0 on success, -1 on error (with errno set)
+ */
+int init_queue(MessageQueue* queue, unsigned long capacity);
+
+/**
+ * Pushes a message onto a queue, and wakes the consumer up if nobody has
+ * since it last went to check. If the queue is full, this waits for room.
+ * @param queue The queue to push onto
+ * @param message The message; the consumer takes over freeing its body
+ */
+void push_message(MessageQueue* queue, Message message);
+
+/**
+ * Gets ready to drain a queue after being woken up through its event_fd. Only
+ * the consumer may call this, and it must then pop until the queue is empty,
+ * or later pushes might not wake it up again.
+ * @param queue The queue that was signalled
+ */
+void clear_queue_signal(MessageQueue* queue);
+
+/**
+ * Pops the oldest message off of a queue. Only the consumer may call this.
+ * @param queue The queue to pop from
+ * @param message Where to put the message
+ * @return 1 if there was a message, 0 if the queue is empty
+ */
+int pop_message(MessageQueue* queue, Message* message);
+
+#endif
\ No newline at end of file
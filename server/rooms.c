@@ -0,0 +1,183 @@
+/**
+ * COIS-4310H: Chat App
+ *
+ * @name:         Chat App -- Rooms
+ *
+ * @author:       Matthew Brown, #0648289
+ * @date:         March 1st to March 9th, 2021
+ *
+ * @purpose:      This file holds the index of rooms and who's in them, so a
+ *                message to a room only goes to the people in it. Each room's
+ *                members are published as snapshots, just like the
+ *                membership: the router delivers to a room without taking
+ *                any locks, and joining or leaving one never holds up a
+ *                delivery to any room, even that one.
+ *
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "../shared/constants.h"
+
+#include "./constants.h"
+#include "./utility.h"
+#include "./membership.h"
+#include "./rooms.h"
+#include "./log.h"
+
+
+static Room* buckets[ROOM_BUCKETS];  // Chains of rooms, linked through `next`
+static unsigned int room_count = 0;  // How many rooms there are
+
+
+/**
+ * Finds a room by name. Rooms are only ever added to the front of a chain, and
+ * only the router takes them out, so the router doesn't need any locks to look
+ * for one; anybody else needs `ut_lock`.
+ */
+static Room* find_room(const char name[]) {
+  size_t bucket = hash_name(name, ROOM_BUCKETS - 1);
+  Room* room = __atomic_load_n(&buckets[bucket], __ATOMIC_ACQUIRE);
+
+  for (; room != NULL; room = room->next) {
+    if (strncmp(room->name, name, USERNAME_MAX - 1) == 0) return room;
+  }
+
+  return NULL;
+}
+
+
+/**
+ * Frees every room nobody's in, and what was said in it. The router is the
+ * only one that looks rooms up without `ut_lock`, and it's the one calling
+ * this, so none of them can still be in use; nor can their snapshots, since
+ * only the router reads those. `ut_lock` must be held.
+ */
+static void clear_empty_rooms() {
+  Room** link;
+  int i;
+
+  for (i = 0; i < ROOM_BUCKETS; i++) {
+    link = &buckets[i];
+
+    while (*link != NULL) {
+      Room* room = *link;
+
+      if (room->members->count > 0) {
+        link = &room->next;
+        continue;
+      }
+
+      __atomic_store_n(link, room->next, __ATOMIC_RELEASE);
+
+      clear_history(&room->history);
+      free(room->members);
+      free(room);
+
+      room_count -= 1;
+    }
+  }
+}
+
+
+int join_room(User* user, const char name[]) {
+  Room* room = find_room(name);
+  int i, slot = -1;
+
+  // >> Find somewhere to keep track of it, unless they're already in it
+  for (i = 0; i < USER_ROOMS; i++) {
+    if (user->rooms[i] == NULL) {
+      if (slot == -1) slot = i;
+    } else if (user->rooms[i] == room) {
+      return ROOM_ALREADY;
+    }
+  }
+
+  if (slot == -1) return ROOM_FULL;
+
+  if (room == NULL) {
+    if (room_count >= ROOM_LIMIT) clear_empty_rooms();
+    if (room_count >= ROOM_LIMIT) return ROOM_FULL;
+
+    // >> Make the room, empty, then publish it at the front of its chain
+    room = calloc(1, sizeof(Room));
+    if (room == NULL) return ROOM_ERROR;
+
+    room->members = calloc(1, sizeof(Snapshot));
+    if (room->members == NULL) {
+      free(room);
+      return ROOM_ERROR;
+    }
+
+    strncpy(room->name, name, USERNAME_MAX - 1);
+
+    size_t bucket = hash_name(name, ROOM_BUCKETS - 1);
+    room->next = buckets[bucket];
+    __atomic_store_n(&buckets[bucket], room, __ATOMIC_RELEASE);
+
+    room_count += 1;
+  }
+
+  if (add_to_set(&room->members, user) != 0) return ROOM_ERROR;
+
+  user->rooms[slot] = room;
+  return ROOM_DONE;
+}
+
+
+int part_room(User* user, const char name[]) {
+  Room* room = find_room(name);
+  int i;
+
+  if (room == NULL) return ROOM_ALREADY;
+
+  for (i = 0; i < USER_ROOMS; i++) {
+    if (user->rooms[i] == room) {
+      if (remove_from_set(&room->members, user) != 0) return ROOM_ERROR;
+
+      user->rooms[i] = NULL;
+      return ROOM_DONE;
+    }
+  }
+
+  return ROOM_ALREADY;
+}
+
+
+void part_all_rooms(User* user) {
+  int i;
+
+  for (i = 0; i < USER_ROOMS; i++) {
+    Room* room = user->rooms[i];
+    if (room == NULL) continue;
+
+    // >> Leaving them in it would leave the room pointing to them once
+    //    they're freed, so there's nothing to do but keep trying
+    while (remove_from_set(&room->members, user) != 0) {
+      log_error("Couldn't allocate a snapshot to leave \"%s\" with",
+        room->name);
+    }
+
+    user->rooms[i] = NULL;
+  }
+}
+
+
+const Snapshot* enter_room(const char name[], int reader) {
+  Room* room = find_room(name);
+
+  if (room == NULL) return NULL;
+
+  return enter_set(&room->members, reader);
+}
+
+
+History* room_history(const char name[]) {
+  Room* room = find_room(name);
+
+  return room != NULL ? &room->history : NULL;
+}
\ No newline at end of file
@@ -0,0 +1,71 @@
+#ifndef __SERVER_ROOMS__
+#define __SERVER_ROOMS__
+
+#include "./constants.h"
+#include "./membership.h"
+#include "./history.h"
+
+#define ROOM_BUCKETS 1024  // Buckets in the room table; a power of two
+
+// What joining or leaving a room did
+#define ROOM_DONE 0     // It worked
+#define ROOM_ALREADY 1  // They were already in it, or weren't in it to leave
+#define ROOM_FULL 2     // They're in USER_ROOMS rooms, or there are ROOM_LIMIT
+#define ROOM_ERROR -1   // There was no memory for it
+
+/**
+ * A room: a name, and everyone in it, published as snapshots like the
+ * membership is. An empty room is kept, history and all, for the next person
+ * to join it, until there are ROOM_LIMIT rooms; then every empty one is freed
+ * to make room for new ones.
+ */
+typedef struct room {
+  char name[USERNAME_MAX];  // Starts with ROOM_MARK
+  Snapshot* members;        // Everybody in it; see enter_set
+  History history;          // What was said in it lately; router only
+  struct room* next;        // Next room in the same bucket
+} Room;
+
+/**
+ * Adds a user to a room, making the room if it doesn't exist yet. Only the
+ * router may call this, since it may free empty rooms, and `ut_lock` must be
+ * held. The user must be logged in.
+ * @param user The user joining
+ * @param name The room's name
+ * @return A ROOM_ result
+ */
+int join_room(User* user, const char name[]);
+
+/**
+ * Takes a user out of a room. `ut_lock` must be held.
+ * @param user The user leaving
+ * @param name The room's name
+ * @return A ROOM_ result
+ */
+int part_room(User* user, const char name[]);
+
+/**
+ * Takes a user out of every room they're in, before they're taken out of the
+ * membership. `ut_lock` must be held.
+ * @param user The user leaving
+ */
+void part_all_rooms(User* user);
+
+/**
+ * Pins everyone in a room for reading, without taking any locks. Unpin them
+ * with leave_snapshot.
+ * @param name The room's name
+ * @param reader The calling thread's reader slot
+ * @return The room's members, or NULL (with nothing pinned) if there's no
+ * such room
+ */
+const Snapshot* enter_room(const char name[], int reader);
+
+/**
+ * Finds what was said in a room lately. Only the router may call this.
+ * @param name The room's name
+ * @return The room's history, or NULL if there's no such room
+ */
+History* room_history(const char name[]);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,327 @@
+/**
+ * COIS-4310H: Chat App
+ *
+ * @name:         Chat App -- Roster
+ *
+ * @author:       Matthew Brown, #0648289
+ * @date:         March 1st to March 9th, 2021
+ *
+ * @purpose:      This file keeps the list of who's logged in, for /who and
+ *                /presence. The router changes it one name at a time as
+ *                people log in and out, and keeps the responses it last put
+ *                together along with the version of the roster they were made
+ *                from; until something changes, every request just gets
+ *                another hold on the same message, already encoded. Each
+ *                change is also kept for a while, so that whoever missed some
+ *                can catch up on just those.
+ *
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../shared/constants.h"
+#include "../shared/messaging.h"
+
+#include "./constants.h"
+#include "./utility.h"
+#include "./worker.h"
+#include "./roster.h"
+
+
+#define ROSTER_PREFIX "All users: "
+
+// Which response is which, in `cached`
+#define CACHED_WHO 0
+#define CACHED_PRESENCE 1
+
+
+/**
+ * One name in the roster.
+ */
+typedef struct roster_entry {
+  char name[USERNAME_MAX];
+  unsigned int length;  // strlen of the name
+  unsigned int count;   // How many times it's been added without being removed
+  unsigned int next;    // Next entry in the same bucket, plus one; 0 for none
+} RosterEntry;
+
+/**
+ * One coming or going, for catching up on later.
+ */
+typedef struct roster_change {
+  char op;                  // PRESENCE_JOINED or PRESENCE_LEFT
+  char name[USERNAME_MAX];
+} RosterChange;
+
+
+static RosterEntry* entries = NULL;  // Everybody, in no particular order
+static unsigned int entry_count = 0;
+static unsigned int entry_space = 0;
+
+static unsigned int* buckets = NULL; // First entry in each bucket, plus one
+static size_t bucket_mask;           // Bucket count minus one
+
+static size_t name_bytes = 0;        // How long all the names are together
+static unsigned long version = 0;    // Bumped whenever the roster changes
+
+static SharedMessage* cached[2];     // The last responses; held
+static unsigned long cached_version[2]; // The versions they were made from
+
+static RosterChange changes[PRESENCE_LENGTH]; // The one that made each version
+                                              // is at version % PRESENCE_LENGTH
+
+
+/**
+ * Finds a name, and the link to it in its bucket. If it isn't there, the link
+ * at the end of the bucket is returned, pointing to nothing.
+ */
+static unsigned int* find_entry(const char name[]) {
+  unsigned int* link = &buckets[hash_name(name, bucket_mask)];
+
+  for (; *link != 0; link = &entries[*link - 1].next) {
+    if (strncmp(entries[*link - 1].name, name, USERNAME_MAX - 1) == 0)
+      return link;
+  }
+
+  return link;
+}
+
+
+int init_roster(unsigned int capacity) {
+  size_t count = 1024;
+
+  while (count < capacity) count <<= 1;
+
+  buckets = calloc(count, sizeof(unsigned int));
+  if (buckets == NULL) return -1;
+
+  bucket_mask = count - 1;
+  return 0;
+}
+
+
+/**
+ * Makes the message for one coming or going: "+ 12\0name\0".
+ * @return 0 on success, -1 if there was no memory for it
+ */
+static int make_delta(const RosterChange* change, unsigned long made,
+    Message* delta) {
+  char head[32];
+  size_t length = sprintf(head, "%c %lu", change->op, made) + 1;
+
+  delta->type = SRV_PRESENCE;
+  memset(delta->sender_name, 0, USERNAME_MAX);
+  memset(delta->receiver_name, 0, USERNAME_MAX);
+
+  delta->size = length + strlen(change->name) + 1;
+  delta->body = malloc(delta->size);
+  if (delta->body == NULL) return -1;
+
+  memcpy(delta->body, head, length);
+  memcpy(delta->body + length, change->name, strlen(change->name) + 1);
+
+  return 0;
+}
+
+
+/**
+ * Writes down the change that just made the current version, and makes the
+ * message that tells everybody about it.
+ * @return 1 if `delta` was filled in, 0 if there was no memory for it; anybody
+ * keeping track will find the gap in the versions and catch up
+ */
+static int note_change(char op, const char name[], Message* delta) {
+  RosterChange* change = changes + version % PRESENCE_LENGTH;
+
+  change->op = op;
+  strncpy(change->name, name, USERNAME_MAX - 1);
+  change->name[USERNAME_MAX - 1] = '\0';
+
+  return make_delta(change, version, delta) == 0;
+}
+
+
+int add_to_roster(const char username[], Message* delta) {
+  unsigned int* link = find_entry(username);
+
+  if (*link != 0) {
+    entries[*link - 1].count += 1;
+    return 0;
+  }
+
+  if (entry_count == entry_space) {
+    unsigned int space = entry_space == 0 ? 1024 : entry_space * 2;
+    RosterEntry* grown = realloc(entries, space * sizeof(RosterEntry));
+
+    if (grown == NULL) return -1;
+
+    entries = grown;
+    entry_space = space;
+  }
+
+  // >> Goes on the end of the list, and the end of its bucket
+  RosterEntry* entry = entries + entry_count;
+  memset(entry, 0, sizeof(RosterEntry));
+
+  strncpy(entry->name, username, USERNAME_MAX - 1);
+  entry->length = strlen(entry->name);
+  entry->count = 1;
+
+  entry_count += 1;
+  *link = entry_count;
+
+  name_bytes += entry->length;
+  version += 1;
+
+  return note_change(PRESENCE_JOINED, entry->name, delta);
+}
+
+
+int remove_from_roster(const char username[], Message* delta) {
+  unsigned int* link = find_entry(username);
+  unsigned int index;
+
+  if (*link == 0) return 0;
+
+  index = *link - 1;
+  if (--entries[index].count > 0) return 0;
+
+  name_bytes -= entries[index].length;
+  *link = entries[index].next;
+
+  // >> The last entry takes its place, so the list doesn't have any holes
+  entry_count -= 1;
+
+  if (index != entry_count) {
+    link = find_entry(entries[entry_count].name);
+
+    entries[index] = entries[entry_count];
+    *link = index + 1;
+  }
+
+  version += 1;
+
+  // >> The name's still in the entry it was in, if nothing was moved into it
+  return note_change(PRESENCE_LEFT, username, delta);
+}
+
+
+/**
+ * Puts the whole roster together as one of the responses, for `cached`: a /who
+ * response with the names between commas, or a PRESENCE_ALL message with each
+ * name ending in '\0'.
+ */
+static int make_response(int which, Message* message) {
+  char head[32];
+  size_t head_length;
+  unsigned int i;
+  char* out;
+
+  memset(message->sender_name, 0, USERNAME_MAX);
+  memset(message->receiver_name, 0, USERNAME_MAX);
+
+  if (which == CACHED_WHO) {
+    message->type = SRV_RESPONSE;
+    head_length = strlen(ROSTER_PREFIX);
+    memcpy(head, ROSTER_PREFIX, head_length);
+
+    // >> Every name, and ", " between each of them
+    message->size = head_length + name_bytes + 1;
+    if (entry_count > 1) message->size += 2 * (entry_count - 1);
+  } else {
+    message->type = SRV_PRESENCE;
+    head_length = sprintf(head, "%c %lu", PRESENCE_ALL, version) + 1;
+
+    // >> Every name, each with a '\0' after it
+    message->size = head_length + name_bytes + entry_count;
+  }
+
+  message->body = malloc(message->size);
+  if (message->body == NULL) return -1;
+
+  out = message->body;
+  memcpy(out, head, head_length);
+  out += head_length;
+
+  for (i = 0; i < entry_count; i++) {
+    if (which == CACHED_WHO && i > 0) {
+      memcpy(out, ", ", 2);
+      out += 2;
+    }
+
+    memcpy(out, entries[i].name, entries[i].length);
+    out += entries[i].length;
+
+    if (which == CACHED_PRESENCE) *out++ = '\0';
+  }
+
+  if (which == CACHED_WHO) *out = '\0';
+
+  return 0;
+}
+
+
+/**
+ * Gets one of the responses, putting it together again only if the roster has
+ * changed since it last was.
+ */
+static SharedMessage* get_response(int which) {
+  Message message;
+
+  if (cached[which] != NULL && cached_version[which] == version) {
+    hold_shared(cached[which]);
+    return cached[which];
+  }
+
+  // >> It's changed; anybody still sending the old one keeps their hold on it
+  if (cached[which] != NULL) release_shared(cached[which]);
+  cached[which] = NULL;
+
+  if (make_response(which, &message) != 0) return NULL;
+
+  cached[which] = share_message(message);
+  if (cached[which] == NULL) return NULL;
+
+  cached_version[which] = version;
+
+  hold_shared(cached[which]);
+  return cached[which];
+}
+
+
+SharedMessage* roster_message() {
+  return get_response(CACHED_WHO);
+}
+
+
+SharedMessage* presence_message() {
+  return get_response(CACHED_PRESENCE);
+}
+
+
+int replay_presence(User* user, unsigned long since) {
+  Message delta;
+  unsigned long next;
+  int sent = 0;
+
+  // >> Anything older than this has been written over
+  if (since > version || version - since > PRESENCE_LENGTH) return -1;
+
+  for (next = since + 1; next <= version; next++) {
+    if (make_delta(changes + next % PRESENCE_LENGTH, next, &delta) != 0)
+      return -1;
+
+    deliver(user, share_message(delta));
+    sent += 1;
+  }
+
+  return sent;
+}
+
+
+unsigned long roster_version() {
+  return version;
+}
\ No newline at end of file
@@ -0,0 +1,80 @@
+#ifndef __SERVER_ROSTER__
+#define __SERVER_ROSTER__
+
+#include <stddef.h>
+
+#include "../shared/messaging.h"
+
+#include "./constants.h"
+
+// What a SRV_PRESENCE message says. Its body is the op, a space, and the
+// roster's version in decimal, then each name it's about; all of them end
+// with a '\0'. Versions go up by one with each coming and going
+#define PRESENCE_ALL '='     // Everybody who's here, as of the version
+#define PRESENCE_JOINED '+'  // Somebody came, making it that version
+#define PRESENCE_LEFT '-'    // Somebody left, making it that version
+
+/**
+ * Sets up the roster: the names of everybody logged in, kept by the router as
+ * workers tell it about logins and logouts.
+ * @param capacity About how many names it'll hold at once
+ * @return 0 on success, -1 if there was no memory for it
+ */
+int init_roster(unsigned int capacity);
+
+/**
+ * Adds a name to the roster. A name that's added twice, by somebody logging in
+ * with it before the router hears that the last person to have it left, has to
+ * be removed twice too. Only the router may call this.
+ * @param username Who logged in
+ * @param delta Where to put the PRESENCE_JOINED message for everyone, if the
+ * name is new
+ * @return 1 if the name is new and `delta` was filled in, 0 if not, -1 if
+ * there was no memory to add it
+ */
+int add_to_roster(const char username[], Message* delta);
+
+/**
+ * Takes a name out of the roster. Only the router may call this.
+ * @param username Who logged out
+ * @param delta Where to put the PRESENCE_LEFT message for everyone, if the
+ * name is gone
+ * @return 1 if the name is gone and `delta` was filled in, 0 if not
+ */
+int remove_from_roster(const char username[], Message* delta);
+
+/**
+ * Gets the roster as a /who response. It's only put together again when it's
+ * changed since the last time, and then handed out as is, so asking for it
+ * over and over costs next to nothing. Only the router may call this.
+ * @return The response, held for the caller, or NULL if there was no memory
+ * for it
+ */
+SharedMessage* roster_message();
+
+/**
+ * Gets the roster as a PRESENCE_ALL message, kept and handed out the same way
+ * as roster_message. Only the router may call this.
+ * @return The message, held for the caller, or NULL if there was no memory for
+ * it
+ */
+SharedMessage* presence_message();
+
+/**
+ * Sends somebody every coming and going since a version of the roster, just
+ * as everyone got them at the time. Only the last PRESENCE_LENGTH are
+ * kept. Only the router may call this.
+ * @param user Who to send them to; they must be held
+ * @param since The version they last saw
+ * @return How many were sent, or -1 if that version is too old (or too new)
+ * to catch up from
+ */
+int replay_presence(User* user, unsigned long since);
+
+/**
+ * Says which version of the roster the router is on.
+ * @return The version
+ */
+unsigned long roster_version();
+
+#endif
\ No newline at end of file
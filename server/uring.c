@@ -0,0 +1,287 @@
+/**
+ * COIS-4310H: Chat App
+ *
+ * @name:         Chat App -- io_uring rings
+ *
+ * @author:       Matthew Brown, #0648289
+ * @date:         March 1st to March 9th, 2021
+ *
+ * @purpose:      This file holds a small wrapper around io_uring, made straight
+ *                from system calls, for workers that use it instead of epoll.
+ *                Listeners and sockets are set up once to keep accepting and
+ *                receiving, so there's no system call per connection or per
+ *                read; what's received lands in buffers the ring was given
+ *                ahead of time.
+ *
+ */
+
+
+// mmap's MAP_ANONYMOUS isn't part of POSIX
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "./uring.h"
+
+
+/**
+ * Gets a free submission slot, submitting what's already there if there are
+ * none left.
+ */
+static struct io_uring_sqe* get_sqe(Ring* ring) {
+  unsigned tail = *ring->sq_tail;
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  if (tail - head > ring->sq_mask) {
+    syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, 0, 0, NULL, 0);
+    ring->unsubmitted = 0;
+  }
+
+  struct io_uring_sqe* sqe = ring->sqes + (tail & ring->sq_mask);
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
+}
+
+
+/**
+ * Makes the last slot from get_sqe visible to the kernel.
+ */
+static void put_sqe(Ring* ring) {
+  unsigned tail = *ring->sq_tail;
+
+  ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->unsubmitted += 1;
+}
+
+
+int setup_ring(Ring* ring) {
+  struct io_uring_params params;
+  struct io_uring_buf_reg reg;
+  unsigned i;
+  int saved;
+
+  memset(ring, 0, sizeof(Ring));
+  memset(&params, 0, sizeof(params));
+
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = RING_ENTRIES * 4;
+
+  ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+  if (ring->fd == -1) return -1;
+
+  // >> Everything here relies on both queues being in one mapping, and on
+  //    being able to wait with a timeout
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(params.features & IORING_FEAT_EXT_ARG)) {
+    close(ring->fd);
+    ring->fd = -1;
+    errno = ENOSYS;
+    return -1;
+  }
+
+  // >> Map the queues in
+  ring->rings_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  if (cq_size > ring->rings_size) ring->rings_size = cq_size;
+
+  ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->rings == MAP_FAILED) goto fail;
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) goto fail;
+
+  char* base = ring->rings;
+  ring->sq_head = (unsigned*)(base + params.sq_off.head);
+  ring->sq_tail = (unsigned*)(base + params.sq_off.tail);
+  ring->sq_mask = *(unsigned*)(base + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(base + params.sq_off.array);
+  ring->cq_head = (unsigned*)(base + params.cq_off.head);
+  ring->cq_tail = (unsigned*)(base + params.cq_off.tail);
+  ring->cq_mask = *(unsigned*)(base + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+
+  // >> Give the kernel the buffers to receive into. The buffer ring needs to
+  //    be page-aligned, which mmap takes care of
+  ring->buffer_ring = mmap(NULL, RING_BUFFERS * sizeof(struct io_uring_buf),
+    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring->buffer_ring == MAP_FAILED) goto fail;
+
+  ring->buffers = mmap(NULL, RING_BUFFERS * RING_BUFFER_SIZE,
+    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring->buffers == MAP_FAILED) goto fail;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring->buffer_ring;
+  reg.ring_entries = RING_BUFFERS;
+  reg.bgid = RING_GROUP;
+
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+      &reg, 1) != 0) goto fail;
+
+  for (i = 0; i < RING_BUFFERS; i++) {
+    struct io_uring_buf* buffer = ring->buffer_ring->bufs + i;
+
+    buffer->addr = (uint64_t)(uintptr_t)(ring->buffers + i * RING_BUFFER_SIZE);
+    buffer->len = RING_BUFFER_SIZE;
+    buffer->bid = (unsigned short)i;
+  }
+
+  ring->buffer_tail = RING_BUFFERS;
+  __atomic_store_n(&ring->buffer_ring->tail, ring->buffer_tail,
+    __ATOMIC_RELEASE);
+
+  return 0;
+
+fail:
+  saved = errno;
+  free_ring(ring);
+  errno = saved;
+  return -1;
+}
+
+
+void free_ring(Ring* ring) {
+  if (ring->fd != -1) close(ring->fd);
+
+  if (ring->rings != NULL && ring->rings != MAP_FAILED)
+    munmap(ring->rings, ring->rings_size);
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->buffer_ring != NULL && ring->buffer_ring != MAP_FAILED)
+    munmap(ring->buffer_ring, RING_BUFFERS * sizeof(struct io_uring_buf));
+  if (ring->buffers != NULL && ring->buffers != MAP_FAILED)
+    munmap(ring->buffers, RING_BUFFERS * RING_BUFFER_SIZE);
+
+  memset(ring, 0, sizeof(Ring));
+  ring->fd = -1;
+}
+
+
+void ring_accept(Ring* ring, int fd, uint64_t data) {
+  struct io_uring_sqe* sqe = get_sqe(ring);
+
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = data;
+
+  put_sqe(ring);
+}
+
+
+void ring_recv(Ring* ring, int fd, uint64_t data) {
+  struct io_uring_sqe* sqe = get_sqe(ring);
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = RING_GROUP;
+  sqe->user_data = data;
+
+  put_sqe(ring);
+}
+
+
+void ring_poll(Ring* ring, int fd, unsigned events, int multishot,
+    uint64_t data) {
+  struct io_uring_sqe* sqe = get_sqe(ring);
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+  sqe->user_data = data;
+
+  put_sqe(ring);
+}
+
+
+void ring_cancel(Ring* ring, uint64_t target, uint64_t data) {
+  struct io_uring_sqe* sqe = get_sqe(ring);
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = data;
+
+  put_sqe(ring);
+}
+
+
+int wait_ring(Ring* ring, int timeout) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  long rc;
+
+  memset(&arg, 0, sizeof(arg));
+
+  if (timeout >= 0) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+  }
+
+  rc = syscall(__NR_io_uring_enter, ring->fd, ring->unsubmitted, 1,
+    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+  // >> Whatever was submitted stays submitted, even if the wait is cut short
+  if (rc >= 0) ring->unsubmitted = 0;
+  else if (errno == ETIME || errno == EINTR) rc = 0;
+
+  return rc < 0 ? -1 : 0;
+}
+
+
+int next_completion(Ring* ring, struct io_uring_cqe* cqe) {
+  unsigned head = *ring->cq_head;
+
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+
+  *cqe = ring->cqes[head & ring->cq_mask];
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+
+const char* ring_buffer(Ring* ring, const struct io_uring_cqe* cqe) {
+  if (!(cqe->flags & IORING_CQE_F_BUFFER)) return NULL;
+
+  return ring->buffers +
+    (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * RING_BUFFER_SIZE;
+}
+
+
+void recycle_buffer(Ring* ring, const struct io_uring_cqe* cqe) {
+  unsigned short id;
+
+  if (!(cqe->flags & IORING_CQE_F_BUFFER)) return;
+
+  id = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+  struct io_uring_buf* buffer =
+    ring->buffer_ring->bufs + (ring->buffer_tail & (RING_BUFFERS - 1));
+
+  buffer->addr = (uint64_t)(uintptr_t)(ring->buffers + id * RING_BUFFER_SIZE);
+  buffer->len = RING_BUFFER_SIZE;
+  buffer->bid = id;
+
+  ring->buffer_tail += 1;
+  __atomic_store_n(&ring->buffer_ring->tail, ring->buffer_tail,
+    __ATOMIC_RELEASE);
+}
\ No newline at end of file
@@ -0,0 +1,129 @@
+#ifndef __SERVER_URING__
+#define __SERVER_URING__
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#define RING_ENTRIES 1024      // Submissions a ring holds; it has 4x completions
+#define RING_BUFFERS 256       // Receive buffers given to each ring
+#define RING_BUFFER_SIZE 8192  // Bytes in each of them
+#define RING_GROUP 0           // Buffer group the receive buffers are in
+
+/**
+ * One io_uring instance, used by exactly one thread, along with the buffers it
+ * receives into. Only what the server uses is wrapped: multishot accepts,
+ * multishot receives into provided buffers, polls, and cancellations.
+ */
+typedef struct ring {
+  int fd;                         // The ring itself; -1 if not set up
+
+  // Submission queue, shared with the kernel
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_array;
+  unsigned sq_mask;
+  struct io_uring_sqe* sqes;
+  unsigned unsubmitted;           // Added since the kernel was last told
+
+  // Completion queue, shared with the kernel
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+
+  void* rings;                    // Mapping of both queues
+  size_t rings_size;
+  size_t sqes_size;
+
+  // Receive buffers, handed to the kernel through a buffer ring
+  struct io_uring_buf_ring* buffer_ring;
+  char* buffers;
+  unsigned short buffer_tail;     // Buffers given back so far
+} Ring;
+
+/**
+ * Sets up a ring, with its receive buffers. Fails if the kernel doesn't have
+ * everything the server needs from io_uring.
+ * @param ring The ring to set up
+ * @return 0 on success, -1 on error, with errno set
+ */
+int setup_ring(Ring* ring);
+
+/**
+ * Frees a ring and its buffers. Anything still in flight is cancelled.
+ * @param ring The ring to free
+ */
+void free_ring(Ring* ring);
+
+/**
+ * Starts accepting connections on a listener, until cancelled or it fails.
+ * Each one completes with the new (non-blocking) socket.
+ * @param ring The ring to submit to
+ * @param fd The listener
+ * @param data What the completions are tagged with
+ */
+void ring_accept(Ring* ring, int fd, uint64_t data);
+
+/**
+ * Starts receiving on a socket, until cancelled or it fails. Each completion
+ * carries one of the ring's buffers; see ring_buffer.
+ * @param ring The ring to submit to
+ * @param fd The socket
+ * @param data What the completions are tagged with
+ */
+void ring_recv(Ring* ring, int fd, uint64_t data);
+
+/**
+ * Waits for a file descriptor to be ready.
+ * @param ring The ring to submit to
+ * @param fd The file descriptor
+ * @param events poll events to wait for
+ * @param multishot 1 to keep completing every time it's ready, until
+ * cancelled; 0 for only once
+ * @param data What the completions are tagged with
+ */
+void ring_poll(Ring* ring, int fd, unsigned events, int multishot,
+  uint64_t data);
+
+/**
+ * Cancels everything in flight that's tagged with `target`.
+ * @param ring The ring to submit to
+ * @param target The tag of what to cancel
+ * @param data What the cancellation's own completion is tagged with
+ */
+void ring_cancel(Ring* ring, uint64_t target, uint64_t data);
+
+/**
+ * Submits everything added since last time, and waits for something to
+ * complete.
+ * @param ring The ring to wait on
+ * @param timeout Most milliseconds to wait; -1 for no limit
+ * @return 0 once there are completions or the time is up, -1 on error
+ */
+int wait_ring(Ring* ring, int timeout);
+
+/**
+ * Takes the oldest completion off the ring.
+ * @param ring The ring to take from
+ * @param cqe Where to copy the completion
+ * @return 1 if there was one, 0 if not
+ */
+int next_completion(Ring* ring, struct io_uring_cqe* cqe);
+
+/**
+ * Finds the data a receive completed with. It stays valid until the buffer is
+ * given back with recycle_buffer.
+ * @param ring The ring the receive was on
+ * @param cqe The receive's completion
+ * @return The data, or NULL if it didn't come with a buffer
+ */
+const char* ring_buffer(Ring* ring, const struct io_uring_cqe* cqe);
+
+/**
+ * Gives a receive's buffer back to the kernel, if it had one.
+ * @param ring The ring the receive was on
+ * @param cqe The receive's completion
+ */
+void recycle_buffer(Ring* ring, const struct io_uring_cqe* cqe);
+
+#endif
\ No newline at end of file
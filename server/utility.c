@@ -13,11 +13,16 @@
  */
 
 
+// clock_gettime isn't part of C99
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <time.h>
 #include <pthread.h>
 
 #include "../shared/constants.h"
@@ -26,20 +31,36 @@
 #include "./utility.h"
 
 
-Thread* get_thread_by_username(const char username[]) {
+void hold_user(User* user) {
+  __atomic_add_fetch(&user->refs, 1, __ATOMIC_RELAXED);
+}
+
+
+void release_user(User* user) {
+  // The connection was already closed by the worker when it dropped the user;
+  // all that's left is the struct itself, and anything delivered too late
+  if (__atomic_sub_fetch(&user->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free_outbox(&user->outbox);
+    free(user);
+  }
+}
+
+
+long long now_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+size_t hash_name(const char name[], size_t mask) {
+  uint32_t hash = 2166136261u;
   int i;
-  Thread* result = NULL;
-
-  for (i = 0; i <= CONN_LIMIT; i++) {
-    // Didn't get found
-    if (i == CONN_LIMIT) break;
-    if (!threads[i].in_use) continue; // Don't need to check this one
-    if (strncmp(threads[i].user->username, username, USERNAME_MAX) == 0) {
-      // >> Found!!
-      result = threads + i;
-      break;
-    }
+
+  for (i = 0; i < USERNAME_MAX - 1 && name[i] != '\0'; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619u;
   }
 
-  return result;
+  return hash & mask;
 }
\ No newline at end of file
@@ -4,10 +4,32 @@
 #include "./constants.h"
 
 /**
- * Get a pointer to a thread based on a username.
- * @param username The username to search for.
- * @return A pointer to that user's thread or NULL on not finding anything.
+ * Adds a holder to a user, so that it isn't freed while it's being used.
+ * @param user The user to hold
  */
-Thread* get_thread_by_username(const char username[]);
+void hold_user(User* user);
+
+/**
+ * Removes a holder from a user, freeing it if it was the last one.
+ * @param user The user to release
+ */
+void release_user(User* user);
+
+/**
+ * Returns the time in microseconds, for measuring how long things take. Only
+ * differences between its results mean anything.
+ * @return The time on the monotonic clock
+ */
+long long now_us();
+
+/**
+ * Hashes a name with FNV-1a, for finding it in a table. Only as much of it is
+ * hashed as would be kept when it's stored, so lookups and stored names always
+ * agree.
+ * @param name The name to hash
+ * @param mask The table's size minus one; it must be a power of two
+ * @return Which bucket the name goes in
+ */
+size_t hash_name(const char name[], size_t mask);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1371 @@
+/**
+ * COIS-4310H: Chat App
+ *
+ * @name:         Chat App -- Server workers
+ *
+ * @author:       Matthew Brown, #0648289
+ * @date:         February 1st to February 12th, 2021  
+ *                March 1st to March 9th, 2021
+ *
+ * @purpose:      The code defined in this file is the code run in each worker
+ *                thread: one event loop per worker, with as many workers as
+ *                there are cores. Each worker has its own listener on the
+ *                server's port, accepts the clients that connect to it in
+ *                batches, and logs each of them in without waiting on any of
+ *                them; their (non-blocking) connections are handled from then
+ *                on.
+ *                Messages from clients are pushed up to the main thread through
+ *                the router queue, and messages from the main thread come
+ *                down through each user's outbox and are sent on to them.
+ *                Broadcasts to large audiences come down once per worker
+ *                instead, and each worker sends them to its own users. Each
+ *                loop waits on either epoll or, if asked for and available,
+ *                an io_uring ring that keeps accepting and receiving on its
+ *                own.
+ *
+ */
+
+
+// SO_REUSEPORT and accept4 aren't part of POSIX
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "../shared/constants.h"
+#include "../shared/messaging.h"
+#include "../shared/utility.h"
+
+#include "./constants.h"
+#include "./utility.h"
+#include "./directory.h"
+#include "./membership.h"
+#include "./rooms.h"
+#include "./worker.h"
+#include "./uring.h"
+#include "./log.h"
+
+
+// What a ring completion is for, in the low bits of its tag. Users are always
+// aligned to more than that, so the rest of the tag can point to one
+#define TAG_ACCEPT   1  // A new connection from the listener
+#define TAG_DOORBELL 2  // The router rang
+#define TAG_READ     3  // Something was received from a user
+#define TAG_WRITE    4  // A user's socket has room to write
+#define TAG_CANCEL   5  // Something was cancelled
+#define TAG_MASK     7
+
+// What a user has in flight, in `armed`
+#define ARMED_READ  1
+#define ARMED_WRITE 2
+
+
+// -- Function definitions for this file
+
+static void* worker_thread(void* arg);
+static void run_epoll(Worker* this);
+static void run_ring(Worker* this);
+static void handle_completion(Worker* this, const struct io_uring_cqe* cqe);
+static void finish_round(Worker* this, long long woken);
+static int setup_listen_socket(int* socket_fd);
+static int setup_worker_epoll(Worker* this);
+static int setup_rings();
+static void accept_users(Worker* this);
+static void start_login(Worker* this, int client_sock);
+static void continue_login(Worker* this, User* user);
+static void answer_login(Worker* this, User* user, Message request);
+static void finish_login(Worker* this, User* user);
+static void abandon_login(Worker* this, User* user);
+static void read_user(Worker* this, User* user);
+static void receive_user(Worker* this, User* user,
+  const struct io_uring_cqe* cqe);
+static void take_input(Worker* this, User* user);
+static void forward_messages(User* user);
+static void flush_user(Worker* this, User* user);
+static void watch_user(Worker* this, User* user);
+static void arm_user(Worker* this, User* user);
+static void disarm_user(Worker* this, User* user);
+static int check_backlog(Worker* this, User* user);
+static void check_slow_users(Worker* this);
+static void drop_user(Worker* this, User* user);
+static void read_outboxes(Worker* this);
+static void drain_outbox(Worker* this, User* user);
+static int deliver_fanouts(Worker* this);
+
+
+// How many fan-outs the router has started. Only the router changes it;
+// workers read it to know which of them an outbox's messages come after
+static unsigned long fanouts_started = 0;
+
+// How many users have been let in but haven't finished logging in, across
+// every worker; `ut_lock` must be held
+static unsigned int joining = 0;
+
+
+/**
+ * Makes a file descriptor non-blocking.
+ */
+static inline void set_nonblocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+
+/**
+ * Returns the time in milliseconds, for measuring how long things take.
+ */
+static inline long long now_ms() {
+  return now_us() / 1000;
+}
+
+
+/**
+ * Adds a user to the front of one of the worker's lists.
+ */
+static inline void link_user(User** list, User* user) {
+  user->local_prev = NULL;
+  user->local_next = *list;
+  if (*list != NULL) (*list)->local_prev = user;
+  *list = user;
+}
+
+
+/**
+ * Takes a user out of one of the worker's lists.
+ */
+static inline void unlink_user(User** list, User* user) {
+  if (user->local_prev != NULL) user->local_prev->local_next = user->local_next;
+  else *list = user->local_next;
+  if (user->local_next != NULL) user->local_next->local_prev = user->local_prev;
+}
+
+
+/**
+ * Says whether a message is a broadcast, which can be dropped from a slow
+ * user's backlog without them missing anything meant for them alone.
+ */
+static int is_broadcast(const Message* message) {
+  return (message->type & ~MSG_IS_ENC) == MSG_BROADCAST ||
+    (message->type & ~MSG_IS_ENC) == MSG_ROOM ||
+    message->type == SRV_ANNOUNCE || message->type == SRV_PRESENCE;
+}
+
+
+int start_workers() {
+  unsigned int i;
+  size_t stack_size;
+  pthread_attr_t attr;
+
+  workers = calloc(config.workers, sizeof(Worker));
+  if (workers == NULL) {
+    perror("allocate workers");
+    return -1;
+  }
+
+  for (i = 0; i < config.workers; i++) {
+    Worker* worker = workers + i;
+    worker->index = (int)i;
+    worker->epoll_fd = -1;
+    worker->ring.fd = -1;
+
+    // >> Listener and doorbell
+    if (setup_listen_socket(&worker->listen_sock)) return 1;
+
+    worker->doorbell = eventfd(0, EFD_NONBLOCK);
+    if (worker->doorbell == -1) {
+      perror("worker doorbell creation");
+      return 1;
+    }
+  }
+
+  // >> Then whatever watches them
+  if (config.io == IO_URING && setup_rings() != 0) config.io = IO_EPOLL;
+
+  if (config.io == IO_EPOLL) {
+    for (i = 0; i < config.workers; i++) {
+      if (setup_worker_epoll(workers + i)) return 1;
+    }
+  }
+
+  // >> Workers keep almost nothing on their stacks, so they don't need the
+  //    default reservation
+  stack_size = (size_t)config.stack_kib * 1024;
+  if (stack_size < (size_t)PTHREAD_STACK_MIN)
+    stack_size = (size_t)PTHREAD_STACK_MIN;
+
+  pthread_attr_init(&attr);
+  if (pthread_attr_setstacksize(&attr, stack_size)) {
+    perror("worker stack size");
+    return 1;
+  }
+
+  // >> Only start them once they've all been set up, since the router may
+  //    deliver to any of them
+  for (i = 0; i < config.workers; i++) {
+    workers[i].started = now_us();
+
+    if (pthread_create(&workers[i].id, &attr, worker_thread, workers + i)) {
+      perror("pthread_create worker");
+      return 1;
+    }
+  }
+
+  pthread_attr_destroy(&attr);
+  return 0;
+}
+
+
+void deliver(User* user, SharedMessage* message) {
+  Worker* worker = user->worker;
+  User* head;
+  uint64_t one = 1;
+
+  if (message == NULL) return;
+
+  // >> Stamped so the worker knows which fan-outs have to go out before it
+  if (push_outbox(&user->outbox, message, fanouts_started) != 0) {
+    release_shared(message);
+    return;
+  }
+
+  // >> If they're already on the ready list, the worker will find this when it
+  //    gets to them
+  if (__atomic_exchange_n(&user->notified, 1, __ATOMIC_SEQ_CST)) return;
+
+  // >> Otherwise, put them on it. The list holds them until the worker is done
+  hold_user(user);
+  head = __atomic_load_n(&worker->ready, __ATOMIC_RELAXED);
+
+  do {
+    user->ready_next = head;
+  } while (!__atomic_compare_exchange_n(&worker->ready, &head, user, 1,
+    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  // >> Only ring when the list was empty; otherwise the worker has already
+  //    been woken up for it and will take the whole list at once
+  if (head == NULL) write(worker->doorbell, &one, sizeof(one));
+}
+
+
+void fan_out(SharedMessage* message, User* source,
+    unsigned long published) {
+  unsigned int i;
+  uint64_t one = 1;
+
+  for (i = 0; i < config.workers; i++) {
+    Worker* worker = workers + i;
+    Fanout* head;
+    Fanout* fanout = malloc(sizeof(Fanout));
+
+    if (fanout == NULL) {
+      log_warn("Couldn't hand a broadcast to worker %u", i);
+      continue;
+    }
+
+    hold_shared(message);
+    fanout->message = message;
+    fanout->index = fanouts_started;
+    fanout->published = published;
+
+    // >> Every worker needs to know who it's from, to push back on them
+    fanout->source = source;
+    if (source != NULL) hold_user(source);
+
+    head = __atomic_load_n(&worker->fanouts, __ATOMIC_RELAXED);
+
+    do {
+      fanout->next = head;
+    } while (!__atomic_compare_exchange_n(&worker->fanouts, &head, fanout, 1,
+      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (head == NULL) write(worker->doorbell, &one, sizeof(one));
+  }
+
+  // >> Everything delivered from now on comes after this one
+  __atomic_store_n(&fanouts_started, fanouts_started + 1, __ATOMIC_RELEASE);
+
+  release_shared(message);
+}
+
+
+/**
+ * Runs a worker's event loop.
+ * @param arg A void pointer to the worker struct this thread runs
+ */
+static void* worker_thread(void* arg) {
+  Worker* this = (Worker*)arg;
+
+  if (config.io == IO_URING) run_ring(this);
+  else run_epoll(this);
+
+  return NULL;
+}
+
+
+/**
+ * Runs a worker's event loop on epoll.
+ * @param this The worker to run
+ */
+static void run_epoll(Worker* this) {
+  int n, num_events;
+  long long woken;
+  struct epoll_event events[WORKER_EVENTS];
+
+  while (1) {
+    // >> Only wake up on a timer while there are slow users to check on
+    num_events = epoll_wait(this->epoll_fd, events, WORKER_EVENTS,
+      this->slow > 0 ? WORKER_TICK : -1);
+
+    if (num_events == -1) {
+      if (errno == EINTR) continue;
+
+      char error[24];
+      sprintf(error, "worker %i epoll_wait", this->index);
+      perror(error);
+      exit(1);
+    }
+
+    woken = now_us();
+
+    for (n = 0; n < num_events; n++) {
+      void* source = events[n].data.ptr;
+
+      if (source == &this->listen_sock) {
+        // >> There are new connections
+        accept_users(this);
+
+      } else if (source == &this->doorbell) {
+        // >> Messages from main thread to send
+        read_outboxes(this);
+
+      } else {
+        User* user = (User*)source;
+
+        if (user->logging_in) {
+          continue_login(this, user);
+          continue;
+        }
+
+        // >> New data on socket; if it's only writable, the flush takes care
+        //    of it
+        if (events[n].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+          read_user(this, user);
+
+        flush_user(this, user);
+      }
+    }
+
+    finish_round(this, woken);
+  }
+}
+
+
+/**
+ * Runs a worker's event loop on io_uring. The listener keeps accepting and
+ * every user's socket keeps receiving without being asked again, so the only
+ * system call in a round is the one that waits.
+ * @param this The worker to run
+ */
+static void run_ring(Worker* this) {
+  struct io_uring_cqe cqe;
+  long long woken;
+
+  while (1) {
+    // >> Only wake up on a timer while there are slow users to check on
+    if (wait_ring(&this->ring, this->slow > 0 ? WORKER_TICK : -1)) {
+      char error[24];
+      sprintf(error, "worker %i wait_ring", this->index);
+      perror(error);
+      exit(1);
+    }
+
+    woken = now_us();
+
+    while (next_completion(&this->ring, &cqe)) handle_completion(this, &cqe);
+
+    finish_round(this, woken);
+  }
+}
+
+
+/**
+ * Handles one completion from a worker's ring.
+ * @param this The worker whose ring it's from
+ * @param cqe The completion
+ */
+static void handle_completion(Worker* this, const struct io_uring_cqe* cqe) {
+  User* user = (User*)(uintptr_t)(cqe->user_data & ~(uint64_t)TAG_MASK);
+  int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+  switch (cqe->user_data & TAG_MASK) {
+    case TAG_ACCEPT:
+      // >> A new connection, already accepted
+      if (cqe->res >= 0) start_login(this, cqe->res);
+      else log_error("accept new client: %s", strerror(-cqe->res));
+
+      if (!more) ring_accept(&this->ring, this->listen_sock, TAG_ACCEPT);
+      break;
+
+    case TAG_DOORBELL:
+      // >> Messages from main thread to send
+      read_outboxes(this);
+
+      if (!more) ring_poll(&this->ring, this->doorbell, POLLIN, 1, TAG_DOORBELL);
+      break;
+
+    case TAG_READ:
+      receive_user(this, user, cqe);
+
+      // >> Once it stops receiving (it ran out of buffers, or was cancelled
+      //    for a pause), it's started again if it should be
+      if (!more) {
+        user->armed &= ~ARMED_READ;
+        arm_user(this, user);
+        release_user(user);
+      }
+      break;
+
+    case TAG_WRITE:
+      user->armed &= ~ARMED_WRITE;
+
+      if (user->logging_in) continue_login(this, user);
+      else flush_user(this, user);
+
+      release_user(user);
+      break;
+  }
+}
+
+
+/**
+ * Finishes a round of events, however they were waited for: checks on slow
+ * users if it's time, and lets go of everybody dropped during it.
+ * @param this The worker whose round it is
+ * @param woken When the round started, in microseconds
+ */
+static void finish_round(Worker* this, long long woken) {
+  if (this->slow > 0 && now_ms() - this->checked >= WORKER_TICK)
+    check_slow_users(this);
+
+  // >> Now that nothing from this round can still point to them, let go of
+  //    everybody who disconnected
+  while (this->dropped != NULL) {
+    User* user = this->dropped;
+    this->dropped = user->next;
+    release_user(user);
+  }
+
+  // >> Everything but waiting for events counts as busy
+  __atomic_add_fetch(&this->busy, now_us() - woken, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Does socket setup for one worker's listener. Every worker binds its own
+ * socket to the same port, and the kernel balances connections between them.
+ * @param socket_fd Where to put the socket
+ * @return 0 on success, 1 on failure
+ */
+static int setup_listen_socket(int* socket_fd) {
+  int rc, on = 1;
+  struct sockaddr_in addr;
+
+  // >> Create listener socket
+  *socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  if (*socket_fd < 0) {
+    perror("socket creation");
+    return 1;
+  }
+
+  // >> Let every worker bind to the same port
+  rc = setsockopt(*socket_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+  if (rc) {
+    perror("socket SO_REUSEPORT");
+    return 1;
+  }
+
+  // >> Set properties for socket address
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  // >> Bind the socket
+  rc = bind(*socket_fd, (struct sockaddr*)&addr, sizeof(addr));
+
+  if (rc) {
+    perror("socket bind");
+    return 1;
+  }
+
+  // >> Start listening on the socket
+  rc = listen(*socket_fd, SOMAXCONN);
+
+  if (rc) {
+    perror("socket listen");
+    return 1;
+  }
+
+  set_nonblocking(*socket_fd);
+  return 0;
+}
+
+
+/**
+ * Sets up the epoll a worker waits on, watching its listener and its doorbell.
+ * They're told apart from users by their pointers.
+ * @param this The worker to set up
+ * @return 0 on success, 1 on failure
+ */
+static int setup_worker_epoll(Worker* this) {
+  struct epoll_event event;
+
+  this->epoll_fd = epoll_create1(0);
+  if (this->epoll_fd == -1) {
+    perror("epoll_create1 in worker");
+    return 1;
+  }
+
+  event.events = EPOLLIN;
+  event.data.ptr = &this->listen_sock;
+  if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->listen_sock, &event)) {
+    perror("epoll_add worker->listen_sock");
+    return 1;
+  }
+
+  event.events = EPOLLIN;
+  event.data.ptr = &this->doorbell;
+  if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->doorbell, &event)) {
+    perror("epoll_add worker->doorbell");
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Sets up a ring for every worker, and starts each one accepting on its
+ * listener and watching its doorbell. Either every worker gets a ring or none
+ * of them do.
+ * @return 0 on success, -1 if io_uring can't be used
+ */
+static int setup_rings() {
+  unsigned int i;
+
+  for (i = 0; i < config.workers; i++) {
+    Worker* worker = workers + i;
+
+    if (setup_ring(&worker->ring) != 0) {
+      log_warn("io_uring isn't available (%s); using epoll", strerror(errno));
+
+      while (i-- > 0) free_ring(&workers[i].ring);
+      return -1;
+    }
+
+    ring_accept(&worker->ring, worker->listen_sock, TAG_ACCEPT);
+    ring_poll(&worker->ring, worker->doorbell, POLLIN, 1, TAG_DOORBELL);
+  }
+
+  return 0;
+}
+
+
+/**
+ * Accepts every client waiting on the worker's listener, up to ACCEPT_BATCH at
+ * a time, and starts logging each of them in.
+ * @param this The worker accepting the clients
+ */
+static void accept_users(Worker* this) {
+  int i, client_sock;
+
+  for (i = 0; i < ACCEPT_BATCH; i++) {
+    client_sock = accept4(this->listen_sock, NULL, NULL,
+      SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (client_sock == -1) {
+      // Another worker's accept may have taken it first
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        log_error("accept new client: %s", strerror(errno));
+      return;
+    }
+
+    start_login(this, client_sock);
+  }
+}
+
+
+/**
+ * Sets a newly accepted client up to log in. Nothing is waited on; the login
+ * exchange goes on in continue_login, whenever there's something to read.
+ * @param this The worker that accepted the client
+ * @param client_sock The client's socket, already non-blocking
+ */
+static void start_login(Worker* this, int client_sock) {
+  struct epoll_event event;
+  User* new_user = calloc(1, sizeof(User));
+
+  if (new_user == NULL) {
+    log_error("Couldn't allocate a new user");
+    close(client_sock);
+    return;
+  }
+
+  // >> The whole login exchange uses the default settings; they get upgraded
+  //    once it's done
+  init_connection(&new_user->conn, client_sock);
+  new_user->worker = this;
+  new_user->refs = 1; // Held by the worker until they're logged in
+  new_user->logging_in = 1;
+  new_user->deadline = now_ms() + LOGIN_DEADLINE * 1000;
+
+  if (config.io == IO_URING) {
+    arm_user(this, new_user);
+  } else {
+    event.events = EPOLLIN;
+    event.data.ptr = new_user;
+
+    if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, client_sock, &event)) {
+      log_error("epoll_add new user: %s", strerror(errno));
+      close_connection(&new_user->conn);
+      free(new_user);
+      return;
+    }
+  }
+
+  link_user(&this->pending, new_user);
+  this->slow += 1;
+}
+
+
+/**
+ * Moves a client's login along as far as it'll go without waiting: reads their
+ * request, answers it, and finishes once the answer has been acknowledged.
+ * @param this The worker that owns the client
+ * @param user The client logging in
+ */
+static void continue_login(Worker* this, User* user) {
+  Message request;
+  ssize_t b_recv;
+  int rc;
+
+  if (user->closed) return;
+
+  while (1) {
+    // >> Answer as soon as the whole request is in
+    if (user->login_ticket == 0 && next_message(&user->conn, &request)) {
+      answer_login(this, user, request);
+      if (user->closed) return;
+    }
+
+    rc = flush_connection(&user->conn);
+
+    if (rc == -1) {
+      abandon_login(this, user);
+      return;
+    }
+
+    // >> Once the answer has been acknowledged, the exchange is over
+    if (user->login_ticket != 0 &&
+        connection_sent(&user->conn, user->login_ticket)) {
+      if (user->rejected) abandon_login(this, user);
+      else finish_login(this, user);
+      return;
+    }
+
+    if (config.io == IO_URING) {
+      // >> Anything more comes with the ring's next completion
+      b_recv = handle_buffered(&user->conn);
+      if (b_recv == 0) break;
+    } else {
+      b_recv = read_connection(&user->conn);
+      if (b_recv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    }
+
+    if (b_recv <= 0) {
+      abandon_login(this, user);
+      return;
+    }
+  }
+
+  if (rc != user->writing) {
+    user->writing = rc;
+    watch_user(this, user);
+  }
+}
+
+
+/**
+ * Decides whether a client gets to log in, and queues up the answer. If they
+ * do, their name is taken for them right away, and they join everyone else
+ * once they've acknowledged it.
+ * @param this The worker that owns the client
+ * @param user The client logging in
+ * @param request The first message they sent
+ */
+static void answer_login(Worker* this, User* user, Message request) {
+  char res_msg[48];
+  Message response;
+
+  // Free memory if it was set, just in case
+  if (request.body != NULL) free(request.body);
+
+  log_debug("Received login request");
+
+  response.type = SRV_RESPONSE;
+  memset(res_msg, 0, sizeof(res_msg));
+
+  // Check that they are actually logging in
+  if (request.type != MSG_LOGIN) {
+    response.type = USR_ERROR;
+    strcpy(res_msg, "Need to login before anything else");
+    goto send_response;
+  }
+
+  strncpy(user->username, request.sender_name, USERNAME_MAX - 1);
+
+  // >> Names starting with ROOM_MARK are for rooms
+  if (user->username[0] == ROOM_MARK) {
+    response.type = USR_ERROR;
+    strcpy(res_msg, "Usernames can't start with '#'");
+    goto send_response;
+  }
+
+  if (init_outbox(&user->outbox) != 0) {
+    response.type = SRV_ERROR;
+    strcpy(res_msg, "Something went wrong");
+    goto send_response;
+  }
+
+  pthread_mutex_lock(&ut_lock);
+
+  // >> Check that there's room for one more, counting everybody who has been
+  //    let in but hasn't finished logging in yet
+
+  if (member_count() + joining >= config.conn_limit) {
+    pthread_mutex_unlock(&ut_lock);
+    log_warn("Max connections reached, rejecting connection");
+
+    response.type = SRV_ERROR;
+    strcpy(res_msg, "Server is full");
+    goto send_response;
+  }
+
+  // >> Claim their name, if there isn't anybody else with it already
+
+  if (add_to_directory(user) != 0) {
+    pthread_mutex_unlock(&ut_lock);
+
+    response.type = USR_ERROR;
+    strcpy(res_msg, "There is already a user with that username");
+    goto send_response;
+  }
+
+  joining += 1;
+  pthread_mutex_unlock(&ut_lock);
+
+  user->named = 1;
+
+  // Jump here to send response to client
+send_response:
+  response.size = strlen(res_msg) + 1;
+  response.body = calloc(response.size, 1);
+  if (response.body != NULL) strcpy(response.body, res_msg);
+
+  memset(response.sender_name, 0, USERNAME_MAX);
+  memset(response.receiver_name, 0, USERNAME_MAX);
+
+  // >> Turned away; they're let go of once they've seen why
+  if (response.type != SRV_RESPONSE) user->rejected = 1;
+
+  user->login_ticket = queue_message(&user->conn, response, 1);
+
+  if (user->login_ticket == 0) {
+    // Nothing more can be done for them
+    user->rejected = 1;
+    abandon_login(this, user);
+  }
+}
+
+
+/**
+ * Logs a client in for good once their answer has been acknowledged: they join
+ * everyone else, and their connection switches over to the settings agreed to.
+ * @param this The worker that owns the client
+ * @param user The client logging in
+ */
+static void finish_login(Worker* this, User* user) {
+  int rc;
+
+  pthread_mutex_lock(&ut_lock);
+  joining -= 1;
+  rc = add_member(user); // Takes over the worker's hold on them
+  pthread_mutex_unlock(&ut_lock);
+
+  if (rc != 0) {
+    log_error("Couldn't add \"%s\" to the membership", user->username);
+
+    // >> They've already stopped counting as joining, so abandon_login is
+    //    left to free up nothing but their connection
+    remove_from_directory(user);
+    user->named = 0;
+
+    user->rejected = 1;
+    abandon_login(this, user);
+    return;
+  }
+
+  unlink_user(&this->pending, user);
+  link_user(&this->users, user);
+  user->logging_in = 0;
+  __atomic_add_fetch(&this->online, 1, __ATOMIC_RELAXED);
+
+  log_info("User \"%s\" has logged in", user->username);
+
+  // >> Switch to whatever was agreed to
+  negotiate_connection(&user->conn);
+
+  // >> Have the router tell everybody they're here, and catch them up on what
+  //    was said before they got here; it's the only one who knows
+  Message catch_up;
+  memset(&catch_up, 0, sizeof(catch_up));
+
+  catch_up.type = MSG_LOGIN;
+  memcpy(catch_up.sender_name, user->username, USERNAME_MAX);
+
+  push_message(&router_queue, catch_up);
+
+  // >> They may have started sending before the login exchange was even over,
+  //    and epoll won't say anything about what's already been read. Anything
+  //    whispered to them meanwhile has been waiting in their outbox
+  forward_messages(user);
+  drain_outbox(this, user);
+  flush_user(this, user);
+}
+
+
+/**
+ * Gives up on a client who didn't log in: they were turned away, their
+ * connection broke, or they took too long. Their name is freed up if they'd
+ * taken it, and they're let go of at the end of the round.
+ * @param this The worker that owns the client
+ * @param user The client to give up on
+ */
+static void abandon_login(Worker* this, User* user) {
+  if (user->closed) return;
+
+  log_info("User could not log in.");
+
+  if (user->named) {
+    remove_from_directory(user);
+
+    pthread_mutex_lock(&ut_lock);
+    joining -= 1;
+    pthread_mutex_unlock(&ut_lock);
+  }
+
+  unlink_user(&this->pending, user);
+
+  disarm_user(this, user);
+  user->closed = 1;
+  close_connection(&user->conn);
+
+  // >> The worker's hold goes on the dropped list, since something from this
+  //    round may still point to them
+  user->next = this->dropped;
+  this->dropped = user;
+}
+
+
+/**
+ * Reads whatever a user sent and forwards every complete message to the main
+ * thread for routing.
+ * @param this The worker that owns the user
+ * @param user The user to read from
+ */
+static void read_user(Worker* this, User* user) {
+  if (user->closed) return;
+
+  ssize_t b_recv = read_connection(&user->conn);
+
+  if (b_recv == 0 || (b_recv == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+    // >> User logged out
+    drop_user(this, user);
+    return;
+  }
+
+  take_input(this, user);
+}
+
+
+/**
+ * Handles whatever a user's ring received for them, and forwards every
+ * complete message to the main thread for routing, like read_user does.
+ * @param this The worker that owns the user
+ * @param user The user it was received from
+ * @param cqe The receive's completion
+ */
+static void receive_user(Worker* this, User* user,
+    const struct io_uring_cqe* cqe) {
+  const char* data = ring_buffer(&this->ring, cqe);
+  int rc = 0;
+
+  if (!user->closed && data != NULL)
+    rc = feed_connection(&user->conn, data, (size_t)cqe->res);
+
+  recycle_buffer(&this->ring, cqe);
+
+  // >> Out of buffers, or paused; receiving starts again once it's over
+  if (user->closed || cqe->res == -ENOBUFS || cqe->res == -ECANCELED) return;
+
+  if (cqe->res <= 0 || rc != 0) {
+    // >> User logged out
+    if (user->logging_in) abandon_login(this, user);
+    else drop_user(this, user);
+    return;
+  }
+
+  if (user->logging_in) {
+    continue_login(this, user);
+    return;
+  }
+
+  take_input(this, user);
+  flush_user(this, user);
+}
+
+
+/**
+ * Forwards everything a user has finished sending, and pauses them if it went
+ * to somebody who can't keep up.
+ * @param this The worker that owns the user
+ * @param user The user who sent it
+ */
+static void take_input(Worker* this, User* user) {
+  forward_messages(user);
+
+  // >> If what they sent went to somebody who can't keep up, stop reading
+  //    from them for a while; their own socket fills up, and that slows them
+  //    down. Only the one reading for them clears it
+  if (__atomic_exchange_n(&user->pushed_back, 0, __ATOMIC_RELAXED)) {
+    user->paused = 1;
+    watch_user(this, user);
+
+    this->slow += 1;
+    __atomic_add_fetch(&slow_counts.paused, 1, __ATOMIC_RELAXED);
+  }
+}
+
+
+/**
+ * Sends every message a user has finished sending up to the main thread.
+ * @param user The user to pick messages up from
+ */
+static void forward_messages(User* user) {
+  Message new_message;
+
+  // >> Handle every message that's now complete
+  while (next_message(&user->conn, &new_message)) {
+    if (new_message.type == TRANSFER_END) {
+      // >> User had an error
+      log_warn("User \"%s\" had transfer error.", user->username);
+
+      // No need to boot them off. TRANSFER_END happens when *they* leave due
+      // to an error, so no need to respond either; they already know.
+
+    } else if (new_message.type == MSG_LOGIN ||
+        new_message.type == MSG_LOGOUT) {
+      // >> Only workers tell the router about logins and logouts; they're
+      //    already in
+      log_warn("User \"%s\" tried to log in or out out of turn.",
+        user->username);
+      if (new_message.body != NULL) free(new_message.body);
+
+    } else {
+      // >> User sent a message properly, forward to main for routing
+      push_message(&router_queue, new_message);
+    }
+  }
+}
+
+
+/**
+ * Writes whatever can be written to a user, and only watches for room to write
+ * while their socket is full.
+ * @param this The worker that owns the user
+ * @param user The user to write to
+ */
+static void flush_user(Worker* this, User* user) {
+  if (user->closed) return;
+
+  int rc = flush_connection(&user->conn);
+
+  if (rc == -1) {
+    drop_user(this, user);
+    return;
+  }
+
+  if (check_backlog(this, user)) return;
+
+  if (rc != user->writing) {
+    user->writing = rc;
+    watch_user(this, user);
+  }
+}
+
+
+/**
+ * Tells epoll (or the ring) what to watch a user's socket for: reads unless
+ * they've been paused, and writes while the socket is full.
+ * @param this The worker that owns the user
+ * @param user The user to watch
+ */
+static void watch_user(Worker* this, User* user) {
+  struct epoll_event event;
+
+  if (config.io == IO_URING) {
+    arm_user(this, user);
+    return;
+  }
+
+  event.events = (user->paused ? 0 : EPOLLIN) | (user->writing ? EPOLLOUT : 0);
+  event.data.ptr = user;
+
+  epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, user->conn.socket, &event);
+}
+
+
+/**
+ * Starts whatever should be in flight on a user's socket and isn't: receiving
+ * unless they've been paused, and waiting for room while it's full. Receiving
+ * is cancelled if they have been. Everything in flight holds them.
+ * @param this The worker that owns the user
+ * @param user The user to watch
+ */
+static void arm_user(Worker* this, User* user) {
+  uint64_t tag = (uint64_t)(uintptr_t)user;
+
+  if (user->closed) return;
+
+  if (!user->paused && !(user->armed & ARMED_READ)) {
+    hold_user(user);
+    user->armed |= ARMED_READ;
+    ring_recv(&this->ring, user->conn.socket, tag | TAG_READ);
+
+  } else if (user->paused && (user->armed & ARMED_READ)) {
+    ring_cancel(&this->ring, tag | TAG_READ, TAG_CANCEL);
+  }
+
+  if (user->writing && !(user->armed & ARMED_WRITE)) {
+    hold_user(user);
+    user->armed |= ARMED_WRITE;
+    ring_poll(&this->ring, user->conn.socket, POLLOUT, 0, tag | TAG_WRITE);
+  }
+}
+
+
+/**
+ * Cancels everything in flight on a user's socket, before it's closed. Their
+ * holds are let go of as each one completes.
+ * @param this The worker that owns the user
+ * @param user The user being dropped
+ */
+static void disarm_user(Worker* this, User* user) {
+  uint64_t tag = (uint64_t)(uintptr_t)user;
+
+  if (config.io != IO_URING) return;
+
+  if (user->armed & ARMED_READ)
+    ring_cancel(&this->ring, tag | TAG_READ, TAG_CANCEL);
+  if (user->armed & ARMED_WRITE)
+    ring_cancel(&this->ring, tag | TAG_WRITE, TAG_CANCEL);
+}
+
+
+/**
+ * Checks how much is waiting to go out to a user, and applies the slow-user
+ * policy if it's more than they're allowed.
+ * @param this The worker that owns the user
+ * @param user The user to check
+ * @return 1 if they were disconnected for it, 0 otherwise
+ */
+static int check_backlog(Worker* this, User* user) {
+  size_t bytes, max_bytes = (size_t)config.out_kib * 1024;
+  unsigned long count = connection_backlog(&user->conn, &bytes);
+
+  if (count <= config.out_messages && bytes <= max_bytes) {
+    // >> Caught up, or never fell behind
+    user->stalled_since = 0;
+    if (user->congested)
+      __atomic_store_n(&user->congested, 0, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  if (count > 2 * (unsigned long)config.out_messages || bytes > 2 * max_bytes) {
+    log_warn("User \"%s\" fell too far behind.", user->username);
+    __atomic_add_fetch(&slow_counts.kicked, 1, __ATOMIC_RELAXED);
+    drop_user(this, user);
+    return 1;
+  }
+
+  switch (config.policy) {
+    case SLOW_DROP:
+      // >> Broadcasts first; what was sent to them alone is only ever kept
+      while (
+        (count > config.out_messages || bytes > max_bytes) &&
+        drop_queued(&user->conn, is_broadcast)
+      ) {
+        __atomic_add_fetch(&slow_counts.shed, 1, __ATOMIC_RELAXED);
+        count = connection_backlog(&user->conn, &bytes);
+      }
+      break;
+
+    case SLOW_KICK:
+      // >> The clock starts now; check_slow_users ends it
+      if (user->stalled_since == 0) {
+        user->stalled_since = now_ms();
+        this->slow += 1;
+      }
+      break;
+
+    case SLOW_PUSH:
+      // >> Whoever sends to them next gets paused
+      if (!user->congested)
+        __atomic_store_n(&user->congested, 1, __ATOMIC_RELAXED);
+      break;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Lets paused users be read from again, disconnects anybody who has been
+ * behind for longer than the grace period, and gives up on clients who are
+ * taking too long to log in. Runs every WORKER_TICK while there are any.
+ * @param this The worker to check
+ */
+static void check_slow_users(Worker* this) {
+  long long now = now_ms();
+  long long grace = (long long)config.grace * 1000;
+  User* user;
+  User* next;
+
+  this->checked = now;
+  this->slow = 0;
+
+  for (user = this->users; user != NULL; user = next) {
+    next = user->local_next;
+
+    if (user->paused) {
+      user->paused = 0;
+      watch_user(this, user);
+    }
+
+    if (user->stalled_since == 0) continue;
+
+    if (now - user->stalled_since >= grace) {
+      log_warn("User \"%s\" didn't catch up in time.", user->username);
+      __atomic_add_fetch(&slow_counts.kicked, 1, __ATOMIC_RELAXED);
+      drop_user(this, user);
+    } else {
+      this->slow += 1;
+    }
+  }
+
+  for (user = this->pending; user != NULL; user = next) {
+    next = user->local_next;
+
+    if (now >= user->deadline) {
+      log_info("A client didn't log in in time.");
+      abandon_login(this, user);
+    } else {
+      this->slow += 1;
+    }
+  }
+}
+
+
+/**
+ * Disconnects a user: takes them out of the list, closes their connection, and
+ * lets everybody else know. The list's hold on them is let go of at the end of
+ * the worker's current round of events.
+ * @param this The worker that owns the user
+ * @param user The user to drop
+ */
+static void drop_user(Worker* this, User* user) {
+  if (user->closed) return;
+
+  log_info("User \"%s\" disconnecting.", user->username);
+
+  remove_from_directory(user);
+
+  unlink_user(&this->users, user);
+  __atomic_sub_fetch(&this->online, 1, __ATOMIC_RELAXED);
+
+  // >> Hold them for the rest of this round, since the membership's hold goes
+  //    away whenever nobody can see them in a snapshot anymore
+  hold_user(user);
+
+  pthread_mutex_lock(&ut_lock);
+  part_all_rooms(user);
+  remove_member(user);
+  pthread_mutex_unlock(&ut_lock);
+
+  disarm_user(this, user);
+  user->closed = 1;
+  close_connection(&user->conn);
+
+  user->next = this->dropped;
+  this->dropped = user;
+
+  // >> Have the router take them off the roster, and tell everybody else
+  Message logout;
+  memset(&logout, 0, sizeof(logout));
+
+  logout.type = MSG_LOGOUT;
+  memcpy(logout.sender_name, user->username, USERNAME_MAX);
+
+  push_message(&router_queue, logout);
+}
+
+
+/**
+ * Empties the outbox of every user the main thread has delivered to since the
+ * last time, queueing it all up and sending it in one flush per user. Any
+ * fan-outs waiting are delivered along the way, in the order they were sent.
+ * @param this The worker whose doorbell rang
+ */
+static void read_outboxes(Worker* this) {
+  uint64_t count;
+  User* user;
+
+  read(this->doorbell, &count, sizeof(count));
+
+  deliver_fanouts(this);
+
+  // >> Take the whole list at once; anyone delivered to after this starts a
+  //    new one and rings again
+  user = __atomic_exchange_n(&this->ready, NULL, __ATOMIC_ACQUIRE);
+
+  while (user != NULL) {
+    User* next = user->ready_next;
+
+    // >> Take them off the list *before* emptying their outbox, so anything
+    //    delivered from here on puts them back on it
+    __atomic_store_n(&user->notified, 0, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // >> Anybody still logging in gets theirs once they're done
+    if (!user->logging_in) {
+      drain_outbox(this, user);
+      flush_user(this, user);
+    }
+
+    release_user(user);
+    user = next;
+  }
+}
+
+
+/**
+ * Queues up everything in a user's outbox to be sent.
+ * @param this The worker that owns the user
+ * @param user The user whose outbox to empty
+ */
+static void drain_outbox(Worker* this, User* user) {
+  SharedMessage* message;
+  unsigned long started;
+
+  // >> Every fan-out started before a message was delivered is already on
+  //    this worker's list, and goes out first. If more were started while
+  //    emptying the outbox, whatever came after them is still in it
+  do {
+    started = __atomic_load_n(&fanouts_started, __ATOMIC_ACQUIRE);
+    deliver_fanouts(this);
+
+    // >> The connection lets go of each message once it's sent
+    while (pop_outbox(&user->outbox, &message, started)) {
+      if (!user->closed) queue_shared(&user->conn, message);
+      else release_shared(message);
+    }
+  } while (started != __atomic_load_n(&fanouts_started, __ATOMIC_ACQUIRE));
+}
+
+
+/**
+ * Delivers every broadcast the router has fanned out to this worker to each of
+ * its users, oldest first, and right after whatever was delivered to them
+ * before it.
+ * @param this The worker to deliver for
+ * @return 1 if there were any, 0 otherwise
+ */
+static int deliver_fanouts(Worker* this) {
+  Fanout* fanout;
+  Fanout* oldest = NULL;
+  SharedMessage* message;
+  User* user;
+  User* next;
+
+  fanout = __atomic_exchange_n(&this->fanouts, NULL, __ATOMIC_ACQUIRE);
+  if (fanout == NULL) return 0;
+
+  // >> They were pushed on newest first
+  while (fanout != NULL) {
+    Fanout* newer = fanout->next;
+    fanout->next = oldest;
+    oldest = fanout;
+    fanout = newer;
+  }
+
+  while (oldest != NULL) {
+    fanout = oldest;
+    oldest = fanout->next;
+
+    for (user = this->users; user != NULL; user = user->local_next) {
+      // >> Nobody who logged in since it was sent gets it, just like if the
+      //    router had sent it; their history has it instead
+      if (user == fanout->source || user->joined > fanout->published) continue;
+
+      if (fanout->source != NULL &&
+          __atomic_load_n(&user->congested, __ATOMIC_RELAXED))
+        __atomic_store_n(&fanout->source->pushed_back, 1, __ATOMIC_RELAXED);
+
+      while (pop_outbox(&user->outbox, &message, fanout->index))
+        queue_shared(&user->conn, message);
+
+      hold_shared(fanout->message);
+      queue_shared(&user->conn, fanout->message);
+    }
+
+    release_shared(fanout->message);
+    if (fanout->source != NULL) release_user(fanout->source);
+    free(fanout);
+  }
+
+  // >> Then send it all, in one flush per user. Anybody dropped for it is
+  //    taken off the list as it goes
+  for (user = this->users; user != NULL; user = next) {
+    next = user->local_next;
+    flush_user(this, user);
+  }
+
+  return 1;
+}
\ No newline at end of file
@@ -0,0 +1,37 @@
+#ifndef __SERVER_WORKER__
+#define __SERVER_WORKER__
+
+#include "./constants.h"
+
+/**
+ * Creates all of the workers and starts their threads. Each one gets its own
+ * listener on the server's port, so the kernel spreads new connections out
+ * between them.
+ * @return 0 on success, anything else if the server can't run
+ */
+int start_workers();
+
+/**
+ * Leaves a message in a user's outbox, and makes sure the worker that owns
+ * them will look at it. Only the router thread may call this, since it's the
+ * one producer each outbox allows, and the user must be held, or in a pinned
+ * membership snapshot, while it does.
+ * @param user The user to send to
+ * @param message The message to send; the caller's hold on it is handed over.
+ * Does nothing if NULL, so share_message can be passed in directly
+ */
+void deliver(User* user, SharedMessage* message);
+
+/**
+ * Hands a message to every worker, to be delivered to all of their users at
+ * once. Each user still gets it in the same order as whatever was delivered
+ * to them around it. Only the router thread may call this.
+ * @param message The message to send; the caller's hold on it is handed over
+ * @param source The user it came from, who doesn't get it; NULL for nobody.
+ * Must be held while this is called
+ * @param published The `published` epoch of the membership snapshot it's for;
+ * nobody who joined after that gets it
+ */
+void fan_out(SharedMessage* message, User* source, unsigned long published);
+
+#endif
\ No newline at end of file
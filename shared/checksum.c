@@ -0,0 +1,248 @@
+/**
+ * COIS-4310H: Chat App
+ *
+ * @name:         Chat App -- Packet checksums
+ *
+ * @author:       Matthew Brown, #0648289
+ * @date:         March 1st to March 9th, 2021
+ *
+ * @purpose:      This file holds the checksum algorithms packets can be
+ *                verified with. SHA1 is what the RFC has always used; the rest
+ *                can be agreed to at login to save CPU time. CRC32C uses the
+ *                SSE4.2 instruction for it when the processor has one, and
+ *                OpenSSL already picks SHA-NI for SHA-256 on its own.
+ *
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <openssl/sha.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "./checksum.h"
+
+
+// CRC32C (Castagnoli) lookup for four bits at a time, reflected polynomial
+// 0x82f63b78. Only used when there's no hardware instruction for it.
+static const uint32_t crc32c_nibbles[16] = {
+  0x00000000, 0x105ec76f, 0x20bd8ede, 0x30e349b1,
+  0x417b1dbc, 0x5125dad3, 0x61c69362, 0x7198540d,
+  0x82f63b78, 0x92a8fc17, 0xa24bb5a6, 0xb21572c9,
+  0xc38d26c4, 0xd3d3e1ab, 0xe330a81a, 0xf36e6f75
+};
+
+// xxHash64 primes
+static const uint64_t XXH_P1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t XXH_P2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t XXH_P3 = 0x165667B19E3779F9ULL;
+static const uint64_t XXH_P4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t XXH_P5 = 0x27D4EB2F165667C5ULL;
+
+
+// -- CRC32C
+
+static uint32_t crc32c_software(uint32_t crc, const unsigned char* data,
+    size_t length) {
+  size_t i;
+
+  for (i = 0; i < length; i++) {
+    crc ^= data[i];
+    crc = (crc >> 4) ^ crc32c_nibbles[crc & 0x0f];
+    crc = (crc >> 4) ^ crc32c_nibbles[crc & 0x0f];
+  }
+
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(uint32_t crc, const unsigned char* data,
+    size_t length) {
+  uint64_t crc64 = crc;
+  uint64_t word;
+
+  // >> Eight bytes at a time, then whatever is left one by one
+  while (length >= 8) {
+    memcpy(&word, data, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    length -= 8;
+  }
+
+  crc = (uint32_t)crc64;
+  while (length--) crc = _mm_crc32_u8(crc, *data++);
+
+  return crc;
+}
+#endif
+
+static uint32_t crc32c(const unsigned char* data, size_t length) {
+  uint32_t crc = 0xffffffff;
+
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2"))
+    return ~crc32c_hardware(crc, data, length);
+#endif
+
+  return ~crc32c_software(crc, data, length);
+}
+
+
+// -- xxHash64
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char* p) {
+  return (uint64_t)p[0]       | (uint64_t)p[1] << 8  |
+         (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+         (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+         (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint32_t read32(const unsigned char* p) {
+  return (uint32_t)p[0]       | (uint32_t)p[1] << 8 |
+         (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+  acc += input * XXH_P2;
+  acc = rotl64(acc, 31);
+  return acc * XXH_P1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t value) {
+  acc ^= xxh64_round(0, value);
+  return acc * XXH_P1 + XXH_P4;
+}
+
+static uint64_t xxh64(const unsigned char* data, size_t length) {
+  const unsigned char* end = data + length;
+  uint64_t h;
+
+  if (length >= 32) {
+    uint64_t v1 = XXH_P1 + XXH_P2;
+    uint64_t v2 = XXH_P2;
+    uint64_t v3 = 0;
+    uint64_t v4 = -XXH_P1;
+
+    // >> Four lanes of eight bytes each
+    do {
+      v1 = xxh64_round(v1, read64(data));
+      v2 = xxh64_round(v2, read64(data + 8));
+      v3 = xxh64_round(v3, read64(data + 16));
+      v4 = xxh64_round(v4, read64(data + 24));
+      data += 32;
+    } while (end - data >= 32);
+
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = xxh64_merge(h, v1);
+    h = xxh64_merge(h, v2);
+    h = xxh64_merge(h, v3);
+    h = xxh64_merge(h, v4);
+  } else {
+    h = XXH_P5;
+  }
+
+  h += (uint64_t)length;
+
+  // >> Whatever didn't fill a whole stripe
+  while (end - data >= 8) {
+    h ^= xxh64_round(0, read64(data));
+    h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+    data += 8;
+  }
+
+  if (end - data >= 4) {
+    h ^= (uint64_t)read32(data) * XXH_P1;
+    h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+    data += 4;
+  }
+
+  while (data < end) {
+    h ^= (*data++) * XXH_P5;
+    h = rotl64(h, 11) * XXH_P1;
+  }
+
+  // >> Avalanche
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  h ^= h >> 32;
+
+  return h;
+}
+
+
+// -- Public functions
+
+int checksum_length(unsigned char algorithm) {
+  switch (algorithm) {
+    case CHECKSUM_SHA1:   return SHA_DIGEST_LENGTH;
+    case CHECKSUM_CRC32C: return 4;
+    case CHECKSUM_XXH64:  return 8;
+    case CHECKSUM_SHA256: return SHA256_DIGEST_LENGTH;
+    case CHECKSUM_NONE:   return 0;
+    default:              return -1;
+  }
+}
+
+
+void compute_checksum(unsigned char algorithm, const void* data, size_t length,
+    unsigned char* out) {
+  int i;
+  uint64_t value;
+
+  switch (algorithm) {
+    case CHECKSUM_SHA1:
+      SHA1((const unsigned char*)data, length, out);
+      return;
+
+    case CHECKSUM_SHA256:
+      SHA256((const unsigned char*)data, length, out);
+      return;
+
+    case CHECKSUM_CRC32C:
+      value = crc32c((const unsigned char*)data, length);
+      break;
+
+    case CHECKSUM_XXH64:
+      value = xxh64((const unsigned char*)data, length);
+      break;
+
+    default:
+      return;
+  }
+
+  // >> Integer digests go over the wire lowest byte first
+  for (i = 0; i < checksum_length(algorithm); i++) {
+    out[i] = (unsigned char)(value >> (8 * i));
+  }
+}
+
+
+unsigned char checksum_by_name(const char name[]) {
+  static const struct checksum_name {
+    const char name[8];
+    unsigned char algorithm;
+  } names[] = {
+    { "sha1",   CHECKSUM_SHA1   },
+    { "crc32c", CHECKSUM_CRC32C },
+    { "xxh64",  CHECKSUM_XXH64  },
+    { "sha256", CHECKSUM_SHA256 },
+    { "none",   CHECKSUM_NONE   }
+  };
+
+  size_t i;
+
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strcmp(names[i].name, name) == 0) return names[i].algorithm;
+  }
+
+  return CHECKSUM_ANY;
+}
\ No newline at end of file
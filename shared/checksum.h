@@ -0,0 +1,48 @@
+#ifndef __GLOBAL_CHECKSUM__
+#define __GLOBAL_CHECKSUM__
+
+#include <stddef.h>
+
+// -------- Checksum algorithms --------
+
+#define CHECKSUM_SHA1     ((unsigned char)(0x00))  // RFC v3's SHA1; the default
+#define CHECKSUM_CRC32C   ((unsigned char)(0x01))  // CRC32C; SSE4.2 when present
+#define CHECKSUM_XXH64    ((unsigned char)(0x02))  // xxHash, 64-bit variant
+#define CHECKSUM_SHA256   ((unsigned char)(0x03))  // SHA-256; SHA-NI when present
+#define CHECKSUM_NONE     ((unsigned char)(0x04))  // No checksum at all
+
+#define CHECKSUM_ANY      ((unsigned char)(0xff))  // No preference when agreeing
+
+#define CHECKSUM_MAX_LENGTH 32                     // Longest digest (SHA-256)
+
+// Bitmask of every algorithm this implementation can compute
+#define CHECKSUM_SUPPORTED ((unsigned short)( \
+  (1 << CHECKSUM_SHA1) | (1 << CHECKSUM_CRC32C) | (1 << CHECKSUM_XXH64) | \
+  (1 << CHECKSUM_SHA256) | (1 << CHECKSUM_NONE)))
+
+/**
+ * Gets the length of the digest a checksum algorithm produces.
+ * @param algorithm One of the CHECKSUM_ constants
+ * @return The digest length in bytes, or -1 for an unknown algorithm
+ */
+int checksum_length(unsigned char algorithm);
+
+/**
+ * Computes a checksum.
+ * @param algorithm One of the CHECKSUM_ constants
+ * @param data The data to check
+ * @param length How many bytes of data there are
+ * @param out Where to put the digest; at least checksum_length() bytes
+ */
+void compute_checksum(unsigned char algorithm, const void* data, size_t length,
+  unsigned char* out);
+
+/**
+ * Looks up a checksum algorithm by name ("sha1", "crc32c", "xxh64", "sha256",
+ * or "none").
+ * @param name The name to look up
+ * @return The matching CHECKSUM_ constant, or CHECKSUM_ANY if there isn't one
+ */
+unsigned char checksum_by_name(const char name[]);
+
+#endif
\ No newline at end of file
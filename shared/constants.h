@@ -21,9 +21,12 @@
 #define PR 0 // The side of pipes to read from
 #define PW 1 // The side of pipes to write to
 
-#define APP_VER 3
+#define APP_VER 4
 #define PORT 58289
 #define MAX_EPOLL_EVENTS 10
+#define WINDOW_MAX 32     // Most packets a sender may have in flight at once
+#define RECV_BUFFER 65536 // Bytes read off of a socket at a time, at most
+#define MESSAGE_MAX (16 * 1024 * 1024) // Biggest message body anyone takes
 
 #define NUM_ELEMS(x) (int)(sizeof(x) / sizeof((x)[0]))
 #define MIN(x,y) (x <= y ? x : y)
@@ -41,14 +44,19 @@
 #define MSG_LOGIN      ((unsigned short)(0x1001))  // Client is logging in with username
 #define MSG_WHISPER    ((unsigned short)(0x1002))  // Client is whispering from one client to another
 #define MSG_BROADCAST  ((unsigned short)(0x1003))  // Client is sending a message to all other users
+#define MSG_JOIN       ((unsigned short)(0x1004))  // Client is joining the room in receiver_name
+#define MSG_PART       ((unsigned short)(0x1005))  // Client is leaving the room in receiver_name
+#define MSG_ROOM       ((unsigned short)(0x1006))  // Client is sending a message to everyone in a room
 #define MSG_COMMAND    ((unsigned short)(0x100f))  // Client is sending a command to the server
 
 #define MSG_ENC_WHISP  ((unsigned short)(0x1012))  // Encoded version of whisper
 #define MSG_ENC_BROAD  ((unsigned short)(0x1013))  // Encoded version of broadcast
+#define MSG_ENC_ROOM   ((unsigned short)(0x1016))  // Encoded version of room message
 
 // Messages from the server directly
 #define SRV_ANNOUNCE   ((unsigned short)(0x2001))  // Server is announcing an update to all clients
 #define SRV_RESPONSE   ((unsigned short)(0x2002))  // Server is replying to an individual client
+#define SRV_PRESENCE   ((unsigned short)(0x2003))  // Server says who's here, or who came or went
 #define SRV_ERROR      ((unsigned short)(0x200e))  // Server says, "something went wrong"; HTTP 500
 #define USR_ERROR      ((unsigned short)(0x200f))  // Server says, "user did something wrong"; 400
 
@@ -63,5 +71,6 @@
 // -------- Other Constants --------
 
 #define USERNAME_MAX   16                          // Maximum length for usernames
+#define ROOM_MARK      '#'                         // What room names start with; usernames can't
 
 #endif
\ No newline at end of file
@@ -15,6 +15,37 @@
  *                the `packet` struct is only used within this file for
  *                `send_message` and `recv_message`.
  *
+ *                Two wire formats are supported: the fixed 384-byte packets of
+ *                RFC v3, and the compact variable-length frames of RFC v4. Both
+ *                are decoded into a `frame` so that the sending and receiving
+ *                logic doesn't need to care which one is in use. Everybody
+ *                starts out on v3, and upgrades after logging in if both
+ *                parties support it.
+ *
+ *                Once both parties have agreed to it at login, messages are
+ *                sent with a sliding window: up to `window` packets are kept in
+ *                flight, the receiver replies with cumulative acknowledgements,
+ *                and only the packets it reports as corrupted are re-sent.
+ *
+ *                Frames are sent with scatter-gather I/O: their headers are
+ *                encoded on their own, and the data is sent straight out of the
+ *                message's body, a whole window's worth per `sendmsg`. They
+ *                are received the other way around: each connection has a
+ *                buffer that is filled as much as possible with each `recv`,
+ *                and every packet in it is handled before reading again.
+ *
+ *                Transfers are driven by a codec that never waits on the
+ *                socket: bytes are fed in, whole messages come out, and
+ *                whatever needs writing (packets and acknowledgements alike)
+ *                is written as far as the socket allows. `send_message` and
+ *                `recv_message` just run it until they're done.
+ *
+ *                A message going to many connections can be shared between
+ *                them. Its packet headers (checksums included) are encoded
+ *                once for each set of connection settings, by whichever
+ *                connection gets to it first, and every other connection with
+ *                the same settings sends those same headers.
+ *
  */
 
 #include <time.h>
@@ -24,16 +55,34 @@
 #include <openssl/sha.h>
 
 #include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
 #include "./constants.h"
+#include "./checksum.h"
 #include "./messaging.h"
 
-#define PACKET_DATASIZE 256  // The most data a single packet can carry
+#define PACKET_DATASIZE 256          // The most data a v3 packet can carry
+#define PACKET_EXT_MAGIC 0x43415053  // "CAPS"; marks the extension fields as set
+
+#define FRAME_DATASIZE 1024  // The most data a v4 frame can carry
+#define FRAME_PREFIX 5       // Version plus the longest frame length varint
+#define FRAME_MAX 1280       // Big enough for any v4 frame, header included
+#define FRAME_HEADER_MAX 128  // Room for any header; v3's are exactly this
+
+#define TX_FRAMES_MAX (WINDOW_MAX * 2)    // Most frames written out per batch
+#define TX_IOV_MAX (TX_FRAMES_MAX * 3)    // Header, data, and padding per frame
+#define NAK_MAX (WINDOW_MAX + 1)          // Most re-send requests at once
+#define SHARED_ENCODINGS 4                // Most settings a shared message keeps
 
 /**
  * Packet definition defined by the RFC. Used for messaging between servers.
+ *
+ * The `ext_` fields live in the padding the RFC leaves free for
+ * implementations. Older implementations leave garbage there, so they are only
+ * trusted when `ext_magic` is set.
  */
 typedef struct packet {
   struct packet_header {
@@ -46,9 +95,16 @@ typedef struct packet {
     char receiver_name[USERNAME_MAX];
     unsigned char checksum[SHA_DIGEST_LENGTH];
 
+    unsigned int ext_magic;        // PACKET_EXT_MAGIC if the fields below are set
+    unsigned short ext_window;     // The largest window the sender can handle
+    unsigned short ext_checksums;  // Bitmask of checksums the sender supports
+    unsigned char ext_checksum;    // The checksum the sender would like to use
+
     char __padding__[
       128 - (sizeof(unsigned short) * 4) - (sizeof(char) * USERNAME_MAX * 2)
           - (sizeof(char) * SHA_DIGEST_LENGTH) - (sizeof(size_t))
+          - sizeof(unsigned int) - (sizeof(unsigned short) * 2)
+          - sizeof(unsigned char)
     ];
   } header;
   char data[PACKET_DATASIZE];
@@ -56,205 +112,1623 @@ typedef struct packet {
 
 
 /**
- * Sends an empty packet with just the message_type field set; for
- * acknowledgements during send/receive.
- * @param socket The socket to send to
- * @param message_type The acknowledgement type to be made
+ * Room for the encoded header of either wire format, aligned so that a v3
+ * header can be written straight into it.
+ */
+typedef union frame_header {
+  struct packet_header packet;
+  unsigned char bytes[FRAME_HEADER_MAX];
+} FrameHeader;
+
+
+/**
+ * One packet of either wire format, with the header decoded. The data is not
+ * copied; it points into the buffer the packet was read into.
  */
-static void ping(int socket, unsigned short message_type) {
-  Packet packet;
+typedef struct frame {
+  unsigned short app_ver;
+  unsigned short message_type;
+  unsigned short packet_count;
+  unsigned short packet_index;
+  size_t total_length;
+  char sender_name[USERNAME_MAX];
+  char receiver_name[USERNAME_MAX];
+  unsigned char checksum_algorithm;
+  unsigned char checksum[CHECKSUM_MAX_LENGTH];
 
-  packet.header.app_ver = APP_VER;
-  packet.header.packet_count = 1;
-  packet.header.packet_index = 0;
-  packet.header.total_length = 0;
+  unsigned short ext_window;     // The peer's window if it sent one; else 0
+  unsigned short ext_checksums;  // The peer's checksums; else just SHA1
+  unsigned char ext_checksum;    // The peer's preferred checksum; else any
 
-  memset(packet.header.sender_name, 0, USERNAME_MAX);
-  memset(packet.header.receiver_name, 0, USERNAME_MAX);
-  memset(packet.header.checksum, 0, SHA_DIGEST_LENGTH);
+  char* data;          // The payload; in v3, always all PACKET_DATASIZE bytes
+  size_t data_length;  // How many bytes of data there are
+} Frame;
 
-  packet.header.message_type = message_type;
 
-  send(socket, &packet, sizeof(Packet), 0);
-}
+/**
+ * A message waiting to be sent, or one that has been received and not picked
+ * up yet.
+ */
+typedef struct queued_message {
+  Message message;
+  unsigned char owned;          // Whether to free the body once it's been sent
+  unsigned char dropped;        // Set if it was dropped before it went out
+  SharedMessage* shared;        // What the message came from, if it's shared
+  struct queued_message* next;
+} QueuedMessage;
 
 
-int send_message(int socket, Message message) {
-  Packet packet;
+/**
+ * The headers for every packet of a shared message, encoded for one set of
+ * connection settings. Never changed once it's been published.
+ */
+typedef struct encoding {
+  unsigned short version;        // The settings it was encoded for
+  unsigned char checksum;
+  unsigned char checksum_pref;
+  unsigned short count;          // How many packets the message takes
+
+  struct encoded_header {
+    FrameHeader header;
+    size_t length;
+  } headers[];
+} Encoding;
 
-#ifdef __DEBUG__
-// Part of the assignment. See comments below at send_packet:; for details.
 
-  char old[PACKET_DATASIZE];  // Save unmodified copy of data
-  unsigned char reset = 0;    // 0/1 for if the corrupt packet was on purpose
-#endif
+/**
+ * A message that's being sent to more than one connection. Nothing in it
+ * changes after it's created, except for filling in empty encoding slots.
+ */
+struct shared_message {
+  Message message;     // The message; its body belongs to this struct
+  unsigned int refs;   // How many holders there are
+  unsigned char borrowed; // Set if the body belongs to somebody else
+  Encoding* encodings[SHARED_ENCODINGS];  // Headers, for each settings used
+};
 
-  // How many chunks this packet will take?
-  unsigned short packet_count = message.size / PACKET_DATASIZE + 1;
 
-  packet.header.app_ver = APP_VER;
-  packet.header.message_type = message.type;
-  packet.header.packet_count = packet_count;
-  packet.header.total_length = message.size;
+/**
+ * Everything needed to pick a transfer back up where it left off, so that
+ * sending and receiving never have to wait on the socket. One message can be
+ * going out while another comes in; the frames for each are told apart by
+ * whether they're acknowledgements.
+ */
+typedef struct codec {
+  // -- Sending
+  QueuedMessage* send_head;  // Messages to send; the first one is in flight
+  QueuedMessage* send_tail;
+  unsigned long queued;      // How many messages have ever been queued
+  unsigned long sent;        // How many of those are done with
+  unsigned long backlog;     // How many are waiting, not counting dropped ones
+  size_t backlog_bytes;      // How big their bodies are, all together
 
-  strncpy(packet.header.sender_name, message.sender_name, USERNAME_MAX);
-  strncpy(packet.header.receiver_name, message.receiver_name, USERNAME_MAX);
+  unsigned char sending;      // Whether the first message has been started
+  Frame send_frame;           // Header fields for its packets
+  unsigned short send_count;  // How many packets it takes
+  unsigned short send_base;   // Packets before this have been acknowledged
+  unsigned short send_next;   // Packets before this have been sent once
 
-  size_t remaining_size = message.size;
-  unsigned short p_indx = 0;
+  unsigned short resend[WINDOW_MAX];  // Packets the receiver said were bad
+  int resend_count;
 
-  // Use do-while in case message size is zero (meaning it contains metadata
-  // only). Like MSG_LOGIN, the important data is in sender_name
-  do {
-    Packet response;
-    packet.header.packet_index = p_indx;
+  const Encoding* send_encoding;  // Its pre-encoded headers, if it has any
 
-    // >> Determine which slice of the message buffer to send
-    size_t offset = PACKET_DATASIZE * p_indx;
-    size_t amount = MIN(PACKET_DATASIZE, remaining_size);
+  // -- Receiving
+  Message recv;                 // The message coming in; MSG_UNSET if none
+  unsigned char* received;      // Which of its packets have arrived, by index
+  unsigned short recv_count;    // How many packets it takes
+  unsigned short recv_contiguous;  // Packets [0, contiguous) have all arrived
+  unsigned short recv_acked;    // The last cumulative ACK that was queued
 
-    // >> Copy buffer chunk to packet and compute SHA1 hash
-    memcpy(packet.data, message.body + offset, amount);
-    SHA1((unsigned char*)packet.data, PACKET_DATASIZE, packet.header.checksum);
+  QueuedMessage* inbox_head;    // Messages received, waiting for next_message
+  QueuedMessage* inbox_tail;
 
-send_packet:;
+  unsigned short nak[NAK_MAX];  // Packets to ask the sender for again
+  int nak_count;
+  unsigned char ack_due;        // Whether a cumulative ACK needs to go out
+  unsigned short ack_index;     // The count to acknowledge
+
+  // -- Writing
+  FrameHeader headers[TX_FRAMES_MAX];  // Headers for the batch being written
+  struct iovec iov[TX_IOV_MAX];        // The batch, as it's being written
+  int iov_start;                       // First iovec that isn't all written
+  int iov_count;                       // How many iovecs are left to write
+  int frame_count;                     // How many frames are in the batch
 
 #ifdef __DEBUG__
-// Part of the assignment. In order to know if we are successfully recovering
-// from packet error, we force a corrupted packet. This needs to be AFTER the
-// send_packet label, otherwise when the retry is attempted the error will still
-// be present
-
-    // 8% chance seems good
-    if (rand() % 100 > 92 && amount > 0) {
-      // Save old copy of data
-      memcpy(old, packet.data, PACKET_DATASIZE);
-      reset = 1;
-
-      // >> Corrupt one byte of the packet with a random ascii from 32-126
-      int index = rand() % (int)(amount - 1);
-      packet.data[index] = (char)(rand() % (127 - 32) + 32);
-
-      printf("__DEBUG__ :: Corrupted index %i of packet data with char '%c'!\n",
-        index, packet.data[index]);
-    }
+  char corrupted[TX_FRAMES_MAX][FRAME_DATASIZE];  // Copies of corrupted data
 #endif
+} Codec;
 
-    ssize_t b_sent = send(socket, &packet, sizeof(Packet), 0);
-    if (b_sent == -1) {
-      ping(socket, TRANSFER_END);
-      return errno;
-    }
 
-    ssize_t b_recv = recv(socket, &response, sizeof(Packet), 0);
-    if (b_recv == -1) {
-      ping(socket, TRANSFER_END);
-      return errno;
+// -- Wire format helpers
+
+
+/**
+ * Returns whether a connection has switched over to v4 frames.
+ * @param conn The connection to check
+ * @return 1 if using v4 frames, 0 if using v3 packets
+ */
+static inline int uses_frames(const Connection* conn) {
+  return conn->version >= 4;
+}
+
+
+/**
+ * Writes an unsigned integer as a LEB128 varint: seven bits per byte, lowest
+ * first, with the top bit set on every byte but the last.
+ * @param buffer Where to write the varint
+ * @param value The value to write
+ * @return How many bytes were written
+ */
+static size_t put_varint(unsigned char* buffer, size_t value) {
+  size_t i = 0;
+
+  while (value >= 0x80) {
+    buffer[i++] = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+
+  buffer[i++] = (unsigned char)value;
+  return i;
+}
+
+
+/**
+ * Reads a LEB128 varint written by put_varint.
+ * @param buffer Where to read from
+ * @param length How many bytes are available to read
+ * @param value Where to put the value read
+ * @return How many bytes were read, or 0 if the varint runs past `length`
+ */
+static size_t get_varint(const unsigned char* buffer, size_t length,
+    size_t* value) {
+  size_t i;
+  *value = 0;
+
+  for (i = 0; i < length && i < sizeof(size_t) + 2; i++) {
+    *value |= (size_t)(buffer[i] & 0x7f) << (7 * i);
+    if (!(buffer[i] & 0x80)) return i + 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Writes a short in little-endian order.
+ */
+static inline void put_short(unsigned char* buffer, unsigned short value) {
+  buffer[0] = (unsigned char)(value & 0xff);
+  buffer[1] = (unsigned char)(value >> 8);
+}
+
+
+/**
+ * Reads a short in little-endian order.
+ */
+static inline unsigned short get_short(const unsigned char* buffer) {
+  return (unsigned short)(buffer[0] | (buffer[1] << 8));
+}
+
+
+/**
+ * Writes a username as a one-byte length and then the characters, without
+ * the terminating NULL.
+ * @return How many bytes were written
+ */
+static size_t put_name(unsigned char* buffer, const char name[]) {
+  size_t length = 0;
+  while (length < USERNAME_MAX - 1 && name[length] != '\0') length++;
+
+  buffer[0] = (unsigned char)length;
+  memcpy(buffer + 1, name, length);
+
+  return length + 1;
+}
+
+
+/**
+ * Encodes everything in a frame that comes before its data. The data itself
+ * is never copied in; it gets sent straight from wherever it lives.
+ * @param conn The connection the frame is going over
+ * @param frame The frame to encode; its checksum must already be set
+ * @param header Where to write the encoded header
+ * @return The size of the header
+ */
+static size_t encode_header(const Connection* conn, const Frame* frame,
+    FrameHeader* header) {
+
+  // Before login is done, the version advertises the newest one we speak
+  unsigned short app_ver = conn->version > 0 ? conn->version : APP_VER;
+
+  if (!uses_frames(conn)) {
+    struct packet_header* packet = &header->packet;
+    memset(packet, 0, sizeof(struct packet_header));
+
+    packet->app_ver = app_ver;
+    packet->message_type = frame->message_type;
+    packet->packet_count = frame->packet_count;
+    packet->packet_index = frame->packet_index;
+    packet->total_length = frame->total_length;
+
+    memcpy(packet->sender_name, frame->sender_name, USERNAME_MAX);
+    memcpy(packet->receiver_name, frame->receiver_name, USERNAME_MAX);
+    memcpy(packet->checksum, frame->checksum, SHA_DIGEST_LENGTH);
+
+    packet->ext_magic = PACKET_EXT_MAGIC;
+    packet->ext_window = WINDOW_MAX;
+    packet->ext_checksums = CHECKSUM_SUPPORTED;
+    packet->ext_checksum = conn->checksum_pref;
+
+    return sizeof(struct packet_header);
+  }
+
+  // The fields are built after the prefix, since the frame length varint in
+  // the prefix can't be written until everything after it is known
+  unsigned char fields[FRAME_HEADER_MAX];
+  size_t h = 0;
+
+  put_short(fields + h, frame->message_type); h += 2;
+  h += put_varint(fields + h, frame->packet_index);
+  h += put_varint(fields + h, frame->packet_count);
+  h += put_varint(fields + h, frame->total_length);
+  h += put_name(fields + h, frame->sender_name);
+  h += put_name(fields + h, frame->receiver_name);
+
+  // Frames without any data don't carry a checksum, or say which it is
+  if (frame->data_length > 0) {
+    size_t sum_length = checksum_length(frame->checksum_algorithm);
+
+    fields[h++] = frame->checksum_algorithm;
+    memcpy(fields + h, frame->checksum, sum_length);
+    h += sum_length;
+  }
+
+  unsigned char* out = header->bytes;
+  size_t o = 0;
+
+  put_short(out + o, app_ver); o += 2;
+  o += put_varint(out + o, h + frame->data_length);
+  memcpy(out + o, fields, h);
+
+  return o + h;
+}
+
+
+/**
+ * Decodes a frame from its wire format. The frame's data points into the
+ * buffer.
+ * @param conn The connection the frame came from
+ * @param buffer The whole encoded frame
+ * @param length The size of the encoded frame
+ * @param frame Where to put the decoded frame
+ * @return 0 on success, -1 if the frame is malformed
+ */
+static int decode_frame(const Connection* conn, char* buffer, size_t length,
+    Frame* frame) {
+
+  memset(frame, 0, sizeof(Frame));
+  frame->ext_checksums = 1 << CHECKSUM_SHA1;
+  frame->ext_checksum = CHECKSUM_ANY;
+
+  if (!uses_frames(conn)) {
+    Packet* packet = (Packet*)buffer;
+    if (length != sizeof(Packet)) return -1;
+
+    frame->app_ver = packet->header.app_ver;
+    frame->message_type = packet->header.message_type;
+    frame->packet_count = packet->header.packet_count;
+    frame->packet_index = packet->header.packet_index;
+    frame->total_length = packet->header.total_length;
+
+    memcpy(frame->sender_name, packet->header.sender_name, USERNAME_MAX);
+    memcpy(frame->receiver_name, packet->header.receiver_name, USERNAME_MAX);
+    memcpy(frame->checksum, packet->header.checksum, SHA_DIGEST_LENGTH);
+    frame->checksum_algorithm = CHECKSUM_SHA1;
+
+    // RFC v3 says names include their NULL, but don't trust that
+    frame->sender_name[USERNAME_MAX - 1] = '\0';
+    frame->receiver_name[USERNAME_MAX - 1] = '\0';
+
+    if (packet->header.ext_magic == PACKET_EXT_MAGIC) {
+      frame->ext_window = packet->header.ext_window;
+      frame->ext_checksums = packet->header.ext_checksums;
+      frame->ext_checksum = packet->header.ext_checksum;
     }
 
-    // >> Error check
-    if (response.header.message_type == ACK_PACK_ERR) {
+    frame->data = packet->data;
+    frame->data_length = PACKET_DATASIZE;
+    return 0;
+  }
 
-#ifdef __DEBUG__
-      // If this was an intentional packet error, copy back from just_in_case
-      // before jumping back to retry
-      if (amount > 0 && reset == 1) {
-        memcpy(packet.data, old, PACKET_DATASIZE);
-        memset(old, 0, PACKET_DATASIZE);
-        reset = 0;
-      }
-
-      fprintf(stderr, "[INTERNAL] Received ACK_PACK_ERR! Re-sending...\n");
-#endif
+  const unsigned char* in = (const unsigned char*)buffer;
+  size_t i = 0, n, value, name_length;
+
+  if (length < 2) return -1;
+  frame->app_ver = get_short(in); i += 2;
+
+  if (!(n = get_varint(in + i, length - i, &value))) return -1;
+  i += n;
+  if (value != length - i) return -1;
+
+  if (length - i < 2) return -1;
+  frame->message_type = get_short(in + i); i += 2;
+
+  if (!(n = get_varint(in + i, length - i, &value))) return -1;
+  frame->packet_index = (unsigned short)value; i += n;
+  if (!(n = get_varint(in + i, length - i, &value))) return -1;
+  frame->packet_count = (unsigned short)value; i += n;
+  if (!(n = get_varint(in + i, length - i, &value))) return -1;
+  frame->total_length = value; i += n;
+
+  // >> Names; the struct was zeroed, so they end up NULL terminated
+  if (i >= length || (name_length = in[i]) >= USERNAME_MAX) return -1;
+  if (length - i - 1 < name_length) return -1;
+  memcpy(frame->sender_name, in + i + 1, name_length);
+  i += name_length + 1;
+
+  if (i >= length || (name_length = in[i]) >= USERNAME_MAX) return -1;
+  if (length - i - 1 < name_length) return -1;
+  memcpy(frame->receiver_name, in + i + 1, name_length);
+  i += name_length + 1;
+
+  if (i < length) {
+    int sum_length = checksum_length(frame->checksum_algorithm = in[i++]);
+    if (sum_length < 0 || length - i < (size_t)sum_length) return -1;
+
+    memcpy(frame->checksum, in + i, sum_length);
+    i += sum_length;
+  }
+
+  frame->data = buffer + i;
+  frame->data_length = length - i;
+  if (frame->data_length > FRAME_DATASIZE) return -1;
+
+  return 0;
+}
+
+
+/**
+ * Computes the checksum for a frame's data. For v3 packets, it is always SHA1
+ * and covers all of the (zero padded) data section, as the RFC says.
+ * @param conn The connection the frame is for
+ * @param algorithm Which checksum to compute
+ * @param data The data to check
+ * @param length How much data there is
+ * @param out Where to put the checksum
+ */
+static void checksum(const Connection* conn, unsigned char algorithm,
+    const char* data, size_t length, unsigned char out[CHECKSUM_MAX_LENGTH]) {
+
+  if (uses_frames(conn)) {
+    compute_checksum(algorithm, data, length, out);
+  } else if (length < PACKET_DATASIZE) {
+    char padded[PACKET_DATASIZE];
+    memset(padded, 0, PACKET_DATASIZE);
+    memcpy(padded, data, length);
+    compute_checksum(CHECKSUM_SHA1, padded, PACKET_DATASIZE, out);
+  } else {
+    compute_checksum(CHECKSUM_SHA1, data, length, out);
+  }
+}
+
+
+// -- Receive buffer
+
+
+/**
+ * Finds the next whole packet or frame in the connection's receive buffer, and
+ * takes it out of the buffer.
+ * @param conn The connection to look in
+ * @param frame Set to where the frame starts; only valid until the buffer is
+ * read into again
+ * @return The size of the frame; 0 if there isn't a whole one yet, -1 if the
+ * stream can't be split into frames anymore
+ */
+static ssize_t next_frame(Connection* conn, char** frame) {
+  size_t available = conn->recv_end - conn->recv_start;
+  unsigned char* start = (unsigned char*)conn->recv_buffer + conn->recv_start;
+  size_t length = 0;
+
+  // >> Work out how long the next frame is, if enough of it is here to say
+  if (!uses_frames(conn)) {
+    length = sizeof(Packet);
+  } else if (available > 2) {
+    size_t value;
+    size_t n = get_varint(start + 2, available - 2, &value);
 
-      goto send_packet;
-    } else if (response.header.message_type != ACK_PACKET) {
-      ping(socket, TRANSFER_END);
+    // Every frame fits in FRAME_MAX, whose length never needs more varint than
+    // the prefix has room for; anything else means the stream can't be
+    // trusted anymore
+    if (
+      (n > 0 && (value > FRAME_MAX || 2 + n + value > FRAME_MAX)) ||
+      (n == 0 && available >= FRAME_PREFIX)
+    ) {
+      errno = EPROTO;
       return -1;
     }
 
-    p_indx += 1;
-    remaining_size -= amount;
+    if (n > 0) length = 2 + n + value;
+  }
+
+  if (length == 0 || available < length) return 0;
+
+  *frame = conn->recv_buffer + conn->recv_start;
+  conn->recv_start += length;
+  return length;
+}
+
+
+/**
+ * Makes sure there's room for at least one more whole frame at the end of the
+ * receive buffer, by moving whatever's left of a partial frame to the front.
+ * @param conn The connection whose buffer to make room in
+ * @return 0 on success, -1 if the buffer couldn't be allocated
+ */
+static int make_room(Connection* conn) {
+  size_t available = conn->recv_end - conn->recv_start;
+
+  if (conn->recv_buffer == NULL) {
+    conn->recv_buffer = malloc(RECV_BUFFER);
+    if (conn->recv_buffer == NULL) return -1;
+  }
 
-  } while (remaining_size > 0);
+  if (available == 0) {
+    conn->recv_start = conn->recv_end = 0;
+  } else if (RECV_BUFFER - conn->recv_end < FRAME_MAX) {
+    memmove(conn->recv_buffer, conn->recv_buffer + conn->recv_start, available);
+    conn->recv_start = 0;
+    conn->recv_end = available;
+  }
 
   return 0;
 }
 
 
-Message recv_message(int socket) {
-  Packet packet;
-  Message output;
-  char last_pack = 0;
-  unsigned char sha_buff[SHA_DIGEST_LENGTH];
+/**
+ * Gets a connection's codec, creating it if it doesn't exist yet.
+ * @param conn The connection
+ * @return The codec, or NULL if it couldn't be allocated
+ */
+static Codec* get_codec(Connection* conn) {
+  if (conn->codec == NULL) {
+    conn->codec = calloc(1, sizeof(Codec));
+    if (conn->codec != NULL) conn->codec->recv.type = MSG_UNSET;
+  }
 
-  // >> Seed/unset values
-  output.size = 0;
-  output.type = MSG_UNSET;
-  output.body = NULL;
+  return conn->codec;
+}
 
-  do {
-recv_packet:; // To retry receipt after acknowledging failure
 
-    // >> Receive the packet
-    ssize_t b_recv = recv(socket, &packet, sizeof(Packet), 0);
-    if (b_recv == -1) {
-      ping(socket, ACK_PACK_ERR);
-      goto recv_packet;
-    } else if (b_recv == 0) {
-      return output; // return earlier
-    }
+// -- Sending
 
-    // If the transfer was cancelled unexpectedly, return a blank message
-    if (packet.header.message_type == TRANSFER_END) {
-      if (output.body != NULL) free(output.body);
 
-      output.size = 0;
-      memset(output.sender_name, 0, USERNAME_MAX);
-      memset(output.receiver_name, 0, USERNAME_MAX);
+/**
+ * Adds a frame to the batch waiting to be written out. The frame's header is
+ * encoded into the codec unless it already has been, and its data is pointed
+ * to right where it is.
+ * @param conn The connection the frame is going over
+ * @param frame The frame to add
+ * @param encoded The frame's header, already encoded for this connection; NULL
+ * to encode it here
+ */
+static void add_frame(Connection* conn, const Frame* frame,
+    const struct encoded_header* encoded) {
+  static const char zeroes[PACKET_DATASIZE];
 
-      output.type = TRANSFER_END;
-      return output;
-    }
+  Codec* codec = conn->codec;
+  FrameHeader* header = &codec->headers[codec->frame_count];
+  struct iovec* iov = codec->iov;
+  int n = codec->iov_count;
+
+  if (encoded != NULL) {
+    iov[n].iov_base = (void*)&encoded->header;
+    iov[n].iov_len = encoded->length;
+  } else {
+    iov[n].iov_base = header;
+    iov[n].iov_len = encode_header(conn, frame, header);
+  }
+  n++;
+
+  if (frame->data_length > 0) {
+    iov[n].iov_base = frame->data;
+    iov[n].iov_len = frame->data_length;
+    n++;
+  }
+
+  if (!uses_frames(conn) && frame->data_length < PACKET_DATASIZE) {
+    iov[n].iov_base = (void*)zeroes;
+    iov[n].iov_len = PACKET_DATASIZE - frame->data_length;
+    n++;
+  }
+
+#ifdef __DEBUG__
+// Part of the assignment. In order to know if we are successfully recovering
+// from packet error, we force a corrupted packet. The corruption is only done to
+// a copy of the data, so the caller's message and any re-send are always clean
+
+  // 8% chance seems good
+  if (rand() % 100 > 92 && frame->total_length > 0 && frame->data_length > 0) {
+    char* corrupted = codec->corrupted[codec->frame_count];
+
+    // >> Copy the whole data section (padding included for v3) and point the
+    //    frame at the copy instead
+    size_t span = uses_frames(conn) ? frame->data_length : PACKET_DATASIZE;
+    memset(corrupted, 0, span);
+    memcpy(corrupted, frame->data, frame->data_length);
+
+    n -= uses_frames(conn) || frame->data_length == PACKET_DATASIZE ? 1 : 2;
+    iov[n].iov_base = corrupted;
+    iov[n].iov_len = span;
+    n++;
+
+    // >> Corrupt one byte of the data with a random ascii from 32-126
+    int index = rand() % (int)span;
+    corrupted[index] = (char)(rand() % (127 - 32) + 32);
+
+    printf("__DEBUG__ :: Corrupted index %i of packet %i with char '%c'!\n",
+      index, frame->packet_index, corrupted[index]);
+  }
+#endif
+
+  codec->iov_count = n;
+  codec->frame_count += 1;
+}
+
+
+/**
+ * Adds an empty packet with just the message_type field set to the batch; for
+ * acknowledgements during send/receive.
+ * @param conn The connection to send to
+ * @param message_type The acknowledgement type to be made
+ * @param index The packet index the acknowledgement is about; cumulative count
+ * for ACK_PACKET in windowed mode, ignored in stop-and-wait mode
+ */
+static void add_ping(Connection* conn, unsigned short message_type,
+    unsigned short index) {
+  Frame frame;
+
+  memset(&frame, 0, sizeof(Frame));
+  frame.message_type = message_type;
+  frame.packet_count = 1;
+  frame.packet_index = index;
+
+  add_frame(conn, &frame, NULL);
+}
+
+
+/**
+ * Works out how many packets a message takes.
+ * @param conn The connection the message is going over
+ * @param size The size of the message's body
+ * @return The packet count; always at least one
+ */
+static unsigned short count_slices(const Connection* conn, size_t size) {
+  size_t datasize = uses_frames(conn) ? FRAME_DATASIZE : PACKET_DATASIZE;
+
+  // How many chunks this packet will take? v3 always sends a trailing packet,
+  // even if it would be empty
+  size_t count = uses_frames(conn)
+    ? (size + datasize - 1) / datasize
+    : size / datasize + 1;
+
+  return count == 0 ? 1 : (unsigned short)count;
+}
+
+
+/**
+ * Fills in the header fields every packet of a message shares.
+ * @param message The message being sent
+ * @param count How many packets it takes
+ * @param frame Where to put the fields
+ */
+static void start_frame(const Message* message, unsigned short count,
+    Frame* frame) {
+  memset(frame, 0, sizeof(Frame));
+  frame->message_type = message->type;
+  frame->packet_count = count;
+  frame->total_length = message->size;
+
+  strncpy(frame->sender_name, message->sender_name, USERNAME_MAX - 1);
+  strncpy(frame->receiver_name, message->receiver_name, USERNAME_MAX - 1);
+}
+
+
+/**
+ * Points a frame at one slice of a message. Its checksum is left alone.
+ * @param conn The connection the message is going over
+ * @param message The message being sent
+ * @param frame A frame already filled in by start_frame
+ * @param index Which slice of the message it's for
+ */
+static void slice_frame(const Connection* conn, const Message* message,
+    Frame* frame, unsigned short index) {
+  size_t datasize = uses_frames(conn) ? FRAME_DATASIZE : PACKET_DATASIZE;
+  size_t offset = datasize * (size_t)index;
 
-    // >> Check bool for if this is the last packet
-    last_pack = !(packet.header.packet_index + 1 < packet.header.packet_count);
+  frame->packet_index = index;
+  frame->data = message->body + offset;
+  frame->data_length = offset < message->size
+    ? MIN(datasize, message->size - offset)
+    : 0;
+}
+
+
+/**
+ * Checksums the slice a frame points at, the way a connection expects.
+ * @param conn The connection the frame is going over
+ * @param frame The frame to checksum
+ */
+static void checksum_frame(const Connection* conn, Frame* frame) {
+  frame->checksum_algorithm = conn->checksum;
+  checksum(conn, conn->checksum, frame->data, frame->data_length,
+    frame->checksum);
+}
+
+
+/**
+ * Encodes the header of every packet of a message, for the settings a
+ * connection is using.
+ * @param conn The connection whose settings to use
+ * @param message The message to encode
+ * @return The encoding, or NULL if there's no memory for it
+ */
+static Encoding* encode_message(const Connection* conn,
+    const Message* message) {
+  unsigned short count = count_slices(conn, message->size);
+  unsigned short i;
+  Frame frame;
+
+  Encoding* encoding = malloc(
+    sizeof(Encoding) + sizeof(struct encoded_header) * count
+  );
+  if (encoding == NULL) return NULL;
+
+  encoding->version = conn->version;
+  encoding->checksum = conn->checksum;
+  encoding->checksum_pref = conn->checksum_pref;
+  encoding->count = count;
+
+  start_frame(message, count, &frame);
+
+  for (i = 0; i < count; i++) {
+    slice_frame(conn, message, &frame, i);
+    checksum_frame(conn, &frame);
+    encoding->headers[i].length =
+      encode_header(conn, &frame, &encoding->headers[i].header);
+  }
+
+  return encoding;
+}
+
+
+/**
+ * Finds the headers of a shared message encoded for a connection's settings,
+ * encoding them if nobody has yet. When several connections race to fill the
+ * same slot, one of them wins and the rest use its copy.
+ * @param conn The connection the message is going over
+ * @param shared The message
+ * @return The encoding, or NULL if it has to be encoded as it's sent
+ */
+static const Encoding* find_encoding(const Connection* conn,
+    SharedMessage* shared) {
+  Encoding* fresh = NULL;
+  int i;
+
+  for (i = 0; i < SHARED_ENCODINGS; i++) {
+    Encoding* found = __atomic_load_n(&shared->encodings[i], __ATOMIC_ACQUIRE);
+
+    if (found == NULL) {
+      if (fresh == NULL) fresh = encode_message(conn, &shared->message);
+      if (fresh == NULL) return NULL;
+
+      // >> Try to publish ours; if somebody beat us to it, `found` becomes
+      //    theirs
+      if (__atomic_compare_exchange_n(&shared->encodings[i], &found, fresh, 0,
+          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return fresh;
+    }
 
-    // >> Verify SHA1 hash
-    SHA1((unsigned char*)packet.data, PACKET_DATASIZE, sha_buff);
     if (
-      strncmp(
-        (char*)packet.header.checksum, (char*)sha_buff, SHA_DIGEST_LENGTH
-      ) != 0
+      found->version == conn->version &&
+      found->checksum == conn->checksum &&
+      found->checksum_pref == conn->checksum_pref
     ) {
-      ping(socket, ACK_PACK_ERR);
-      goto recv_packet;
+      if (fresh != NULL) free(fresh);
+      return found;
     }
+  }
 
-    // >> Create the required fields for the output message if not set yet
-    if (output.type == MSG_UNSET) {
-      output.type = packet.header.message_type;
-      output.size = packet.header.total_length;
+  // >> Every slot is used by other settings
+  if (fresh != NULL) free(fresh);
+  return NULL;
+}
 
-      if (output.size > 0) output.body = calloc(output.size, 1);
 
-      strncpy(output.receiver_name, packet.header.receiver_name, USERNAME_MAX);
-      strncpy(output.sender_name, packet.header.sender_name, USERNAME_MAX);
-    }
+/**
+ * Adds one slice of the message being sent to the batch.
+ * @param conn The connection the message is going over
+ * @param index Which slice of the message to send
+ */
+static void add_slice(Connection* conn, unsigned short index) {
+  Codec* codec = conn->codec;
+  Message* message = &codec->send_head->message;
+  Frame frame = codec->send_frame;
 
-    // >> If there is body-text, copy it over into the buffer
-    if (output.size > 0) {
-      size_t offset = packet.header.packet_index * PACKET_DATASIZE;
-      size_t amount = !last_pack
-        ? PACKET_DATASIZE
-        : packet.header.total_length % PACKET_DATASIZE;
+  slice_frame(conn, message, &frame, index);
 
-      memcpy(output.body + offset, packet.data, amount);
-    }
+  // >> Shared messages already have their headers, checksums and all
+  if (codec->send_encoding != NULL) {
+    add_frame(conn, &frame, &codec->send_encoding->headers[index]);
+    return;
+  }
+
+  checksum_frame(conn, &frame);
+  add_frame(conn, &frame, NULL);
+}
+
+
+/**
+ * Starts sending the message at the front of the queue.
+ * @param conn The connection to send on
+ */
+static void start_transfer(Connection* conn) {
+  Codec* codec = conn->codec;
+  QueuedMessage* queued = codec->send_head;
+
+  codec->send_count = count_slices(conn, queued->message.size);
+  start_frame(&queued->message, codec->send_count, &codec->send_frame);
+
+  codec->send_encoding = queued->shared != NULL
+    ? find_encoding(conn, queued->shared)
+    : NULL;
+
+  codec->send_base = 0;
+  codec->send_next = 0;
+  codec->resend_count = 0;
+  codec->sending = 1;
+}
+
+
+/**
+ * Wraps up the message being sent if every packet of it has been acknowledged
+ * and nothing still points into its body.
+ * @param conn The connection the message was sent on
+ */
+static void finish_transfer(Connection* conn) {
+  Codec* codec = conn->codec;
+  QueuedMessage* done = codec->send_head;
+
+  if (!codec->sending || codec->send_base < codec->send_count) return;
+  if (codec->iov_count > 0) return;
+
+  codec->send_head = done->next;
+  if (codec->send_head == NULL) codec->send_tail = NULL;
+
+  codec->backlog -= 1;
+  codec->backlog_bytes -= done->message.size;
+
+  if (done->shared != NULL) release_shared(done->shared);
+  else if (done->owned && done->message.body != NULL) free(done->message.body);
+  free(done);
+
+  codec->sending = 0;
+  codec->sent += 1;
+}
+
+
+/**
+ * Drops everything waiting to be sent, for when the connection is broken.
+ * Bodies that belong to the caller are left alone.
+ * @param codec The codec to clear out
+ */
+static void drop_sending(Codec* codec) {
+  while (codec->send_head != NULL) {
+    QueuedMessage* dropped = codec->send_head;
+    codec->send_head = dropped->next;
+
+    if (dropped->shared != NULL) release_shared(dropped->shared);
+    else if (dropped->owned && dropped->message.body != NULL)
+      free(dropped->message.body);
+    free(dropped);
+  }
+
+  codec->send_tail = NULL;
+  codec->sending = 0;
+  codec->sent = codec->queued;
+  codec->backlog = 0;
+  codec->backlog_bytes = 0;
+  codec->iov_count = 0;
+  codec->iov_start = 0;
+  codec->frame_count = 0;
+  codec->nak_count = 0;
+  codec->ack_due = 0;
+}
+
+
+/**
+ * Fills the batch with whatever can be sent right now: acknowledgements for
+ * what's been received first, then re-sends, then as many new packets as the
+ * window allows. Only called once the last batch is completely written.
+ * @param conn The connection to build a batch for
+ */
+static void build_batch(Connection* conn) {
+  Codec* codec = conn->codec;
+  int i;
+
+  codec->iov_start = 0;
+  codec->iov_count = 0;
+  codec->frame_count = 0;
+
+  // >> Acknowledgements; NAK_MAX leaves room for the ACK, all within a batch
+  for (i = 0; i < codec->nak_count; i++) {
+    add_ping(conn, ACK_PACK_ERR, codec->nak[i]);
+  }
+
+  codec->nak_count = 0;
+
+  if (codec->ack_due) {
+    add_ping(conn, ACK_PACKET, codec->ack_index);
+    codec->ack_due = 0;
+  }
 
-    ping(socket, ACK_PACKET);
+  // >> Whatever was dropped before it got to the front is done with already
+  while (
+    !codec->sending && codec->send_head != NULL && codec->send_head->dropped
+  ) {
+    QueuedMessage* dropped = codec->send_head;
+    codec->send_head = dropped->next;
+    if (codec->send_head == NULL) codec->send_tail = NULL;
 
-  } while (!last_pack);
+    free(dropped);
+    codec->sent += 1;
+  }
+
+  if (!codec->sending && codec->send_head != NULL) start_transfer(conn);
+  if (!codec->sending) return;
+
+  // >> Re-send the packets the receiver said were corrupted
+  while (codec->resend_count > 0 && codec->frame_count < TX_FRAMES_MAX) {
+    unsigned short bad = codec->resend[--codec->resend_count];
+
+    if (bad >= codec->send_base && bad < codec->send_next) add_slice(conn, bad);
+  }
+
+  // >> Fill up the window. The window covers packets [base, base + window).
+  //    Packets before `base` have been acknowledged, packets before `next`
+  //    have been sent at least once. With a window of one, this is the RFC's
+  //    stop-and-wait. A packet is always sent, even if message size is zero
+  //    (meaning it contains metadata only). Like MSG_LOGIN, the important data
+  //    is in sender_name
+  while (
+    codec->send_next < codec->send_count &&
+    codec->send_next - codec->send_base < conn->window &&
+    codec->frame_count < TX_FRAMES_MAX
+  ) {
+    add_slice(conn, codec->send_next);
+    codec->send_next += 1;
+  }
+}
+
+
+// -- Receiving
+
+
+/**
+ * Puts a message in the inbox, for next_message to hand out.
+ * @param codec The codec whose inbox to put it in
+ * @param message The message
+ */
+static void push_inbox(Codec* codec, Message message) {
+  QueuedMessage* queued = malloc(sizeof(QueuedMessage));
+  if (queued == NULL) {
+    if (message.body != NULL) free(message.body);
+    return;
+  }
+
+  queued->message = message;
+  queued->owned = 1;
+  queued->dropped = 0;
+  queued->shared = NULL;
+  queued->next = NULL;
+
+  if (codec->inbox_tail != NULL) codec->inbox_tail->next = queued;
+  else codec->inbox_head = queued;
+  codec->inbox_tail = queued;
+}
+
+
+/**
+ * Forgets the message being received, if there is one.
+ * @param codec The codec receiving the message
+ */
+static void reset_receiving(Codec* codec) {
+  if (codec->recv.body != NULL) free(codec->recv.body);
+  if (codec->received != NULL) free(codec->received);
+
+  memset(&codec->recv, 0, sizeof(Message));
+  codec->recv.type = MSG_UNSET;
+  codec->received = NULL;
+
+  codec->recv_count = 1;
+  codec->recv_contiguous = 0;
+  codec->recv_acked = 0;
+}
+
+
+/**
+ * Asks for a packet to be sent again.
+ * @param codec The codec receiving the packet
+ * @param index The packet's index
+ */
+static void add_nak(Codec* codec, unsigned short index) {
+  int i;
+
+  for (i = 0; i < codec->nak_count; i++) {
+    if (codec->nak[i] == index) return;
+  }
+
+  if (codec->nak_count < NAK_MAX) codec->nak[codec->nak_count++] = index;
+}
+
+
+/**
+ * Handles an acknowledgement for the message being sent.
+ * @param conn The connection it came in on
+ * @param frame The acknowledgement
+ */
+static void handle_ack(Connection* conn, const Frame* frame) {
+  Codec* codec = conn->codec;
+  int i;
+
+  // Stray acknowledgements aren't about anything
+  if (!codec->sending) return;
+
+  if (frame->message_type == ACK_PACKET) {
+    // In stop-and-wait the index isn't filled, the ACK is for `base` itself
+    unsigned short acked = conn->window > 1
+      ? frame->packet_index
+      : codec->send_base + 1;
+
+    if (acked > codec->send_base && acked <= codec->send_next)
+      codec->send_base = acked;
+
+    finish_transfer(conn);
+
+  } else if (frame->message_type == ACK_PACK_ERR) {
+    unsigned short bad = conn->window > 1
+      ? frame->packet_index
+      : codec->send_base;
+
+#ifdef __DEBUG__
+    fprintf(stderr, "[INTERNAL] Received ACK_PACK_ERR! Re-sending...\n");
+#endif
+
+    for (i = 0; i < codec->resend_count; i++) {
+      if (codec->resend[i] == bad) return;
+    }
+
+    if (codec->resend_count < WINDOW_MAX)
+      codec->resend[codec->resend_count++] = bad;
+  }
+}
+
+
+/**
+ * Handles a packet of the message being received.
+ * @param conn The connection it came in on
+ * @param frame The packet
+ * @return 0 on success, -1 if the message can't be taken and the connection
+ * has to be dropped
+ */
+static int handle_data(Connection* conn, const Frame* frame) {
+  Codec* codec = conn->codec;
+  Message* output = &codec->recv;
+  unsigned char sum_buff[CHECKSUM_MAX_LENGTH];
+
+  size_t datasize = uses_frames(conn) ? FRAME_DATASIZE : PACKET_DATASIZE;
+  unsigned short index = frame->packet_index;
+
+  // Send a cumulative ACK once this many new packets have arrived in order, so
+  // the sender hears back before its window runs out
+  unsigned short ack_every = conn->window > 1 ? conn->window / 2 : 1;
+
+  // >> Verify checksum, with whichever algorithm the sender says it used; only
+  //    while logging in could that be anything but the one agreed on. Frames
+  //    with no data don't say, and have nothing to check
+  if (frame->data_length > 0) {
+    // >> Once the connection's settled on an algorithm, nothing else is taken;
+    //    otherwise one bad byte could tag a frame as having no checksum at all
+    if (conn->version != 0 && frame->checksum_algorithm != conn->checksum) {
+      add_nak(codec, index);
+      return 0;
+    }
+
+    checksum(conn, frame->checksum_algorithm, frame->data, frame->data_length,
+      sum_buff);
+
+    if (
+      memcmp(frame->checksum, sum_buff,
+        checksum_length(frame->checksum_algorithm)) != 0
+    ) {
+      add_nak(codec, index);
+      return 0;
+    }
+  }
+
+  // >> Create the required fields for the output message if not set yet
+  if (output->type == MSG_UNSET) {
+    unsigned short count = frame->packet_count > 0 ? frame->packet_count : 1;
+
+    // >> The size is whatever the other party says, so it has to fit in the
+    //    packets they say they're sending, and be something worth taking
+    if (
+      frame->total_length > (size_t)count * datasize ||
+      frame->total_length > MESSAGE_MAX
+    ) {
+      errno = EPROTO;
+      return -1;
+    }
+
+    output->type = frame->message_type;
+    output->size = frame->total_length;
+    codec->recv_count = count;
+
+    if (output->size > 0) output->body = calloc(output->size, 1);
+    codec->received = calloc(codec->recv_count, 1);
+
+    if ((output->size > 0 && output->body == NULL) || codec->received == NULL) {
+      reset_receiving(codec);
+      errno = ENOMEM;
+      return -1;
+    }
+
+    memcpy(output->receiver_name, frame->receiver_name, USERNAME_MAX);
+    memcpy(output->sender_name, frame->sender_name, USERNAME_MAX);
+
+    // >> Remember what the other party can do, for negotiate_connection
+    if (conn->version == 0) {
+      conn->peer_version = frame->app_ver;
+      conn->peer_window = frame->ext_window;
+      conn->peer_checksum = frame->ext_checksum;
+      conn->peer_checksums = frame->ext_checksums;
+    }
+  }
+
+  if (index >= codec->recv_count || codec->received[index]) {
+    // Out of range or a duplicate; nothing new to store
+    return 0;
+  }
+
+  // >> If there is body-text, copy it straight out of the receive buffer into
+  //    the message
+  size_t offset = (size_t)index * datasize;
+  if (offset < output->size) {
+    size_t amount = MIN(MIN(datasize, output->size - offset), frame->data_length);
+    memcpy(output->body + offset, frame->data, amount);
+  }
+
+  codec->received[index] = 1;
+  while (
+    codec->recv_contiguous < codec->recv_count &&
+    codec->received[codec->recv_contiguous]
+  ) {
+    codec->recv_contiguous++;
+  }
+
+  // >> Acknowledge; every packet in stop-and-wait, in batches when windowed
+  int complete = codec->recv_contiguous == codec->recv_count;
+
+  if (codec->recv_contiguous - codec->recv_acked >= ack_every || complete) {
+    codec->ack_due = 1;
+    codec->ack_index = codec->recv_contiguous;
+    codec->recv_acked = codec->recv_contiguous;
+  }
+
+  // >> Hand the message over once all of it is here
+  if (complete) {
+    push_inbox(codec, *output);
+
+    output->body = NULL;
+    reset_receiving(codec);
+  }
+
+  return 0;
+}
+
+
+/**
+ * Handles one packet or frame that came in, whichever transfer it's for.
+ * @param conn The connection it came in on
+ * @param buffer The encoded frame
+ * @param length The size of the encoded frame
+ * @return 0 on success, -1 if the connection has to be dropped
+ */
+static int handle_frame(Connection* conn, char* buffer, size_t length) {
+  Codec* codec = conn->codec;
+  Frame frame;
+
+  if (decode_frame(conn, buffer, length, &frame) != 0) {
+    add_nak(codec, codec->recv_contiguous);
+    return 0;
+  }
+
+  // If the transfer was cancelled unexpectedly, hand out a blank message
+  if (frame.message_type == TRANSFER_END) {
+    Message cancelled;
+
+    memset(&cancelled, 0, sizeof(Message));
+    cancelled.type = TRANSFER_END;
+
+    reset_receiving(codec);
+    codec->nak_count = 0;
+    push_inbox(codec, cancelled);
+
+  } else if ((frame.message_type & MASK_TYPE) == MSG_IS_ACK) {
+    handle_ack(conn, &frame);
+
+  } else {
+    return handle_data(conn, &frame);
+  }
+
+  return 0;
+}
+
+
+/**
+ * Handles every whole frame in the receive buffer.
+ * @param conn The connection to handle frames for
+ * @return 0 on success, -1 if the stream can't be split into frames anymore,
+ * or a message in it can't be taken
+ */
+static int handle_frames(Connection* conn) {
+  Codec* codec = conn->codec;
+  unsigned long sent = codec->sent;
+  char* frame;
+  ssize_t length;
+
+  while ((length = next_frame(conn, &frame)) > 0) {
+    if (handle_frame(conn, frame, length) != 0) return -1;
+
+    // >> Until login is done, stop as soon as a message has come in or been
+    //    sent. Whatever follows it may already be in the settings agreed on,
+    //    so it's left in the buffer for negotiate_connection
+    if (conn->version == 0 && (
+      codec->inbox_head != NULL || codec->sent != sent ||
+      (codec->sending && codec->send_base >= codec->send_count)
+    )) break;
+  }
+
+  return length < 0 ? -1 : 0;
+}
+
+
+// -- Connections
+
+
+void init_connection(Connection* conn, int socket) {
+  conn->socket = socket;
+  conn->version = 0;
+  conn->peer_version = 0;
+  conn->window = 1;
+  conn->peer_window = 0;
+  conn->checksum = CHECKSUM_SHA1;
+  conn->checksum_pref = CHECKSUM_ANY;
+  conn->peer_checksum = CHECKSUM_ANY;
+  conn->peer_checksums = 1 << CHECKSUM_SHA1;
+  conn->recv_buffer = NULL;
+  conn->recv_start = 0;
+  conn->recv_end = 0;
+  conn->codec = NULL;
+}
+
+
+void close_connection(Connection* conn) {
+  if (conn->socket != -1) close(conn->socket);
+  if (conn->recv_buffer != NULL) free(conn->recv_buffer);
+
+  if (conn->codec != NULL) {
+    Codec* codec = conn->codec;
+
+    drop_sending(codec);
+    reset_receiving(codec);
+
+    while (codec->inbox_head != NULL) {
+      QueuedMessage* dropped = codec->inbox_head;
+      codec->inbox_head = dropped->next;
+
+      if (dropped->message.body != NULL) free(dropped->message.body);
+      free(dropped);
+    }
+
+    free(codec);
+  }
+
+  conn->socket = -1;
+  conn->recv_buffer = NULL;
+  conn->recv_start = 0;
+  conn->recv_end = 0;
+  conn->codec = NULL;
+}
+
+
+int connection_pending(const Connection* conn) {
+  return conn->codec != NULL && conn->codec->inbox_head != NULL;
+}
+
+
+void negotiate_connection(Connection* conn) {
+  // Peers that don't know about the extension fields get stop-and-wait
+  conn->window = conn->peer_window > 0 ? MIN(WINDOW_MAX, conn->peer_window) : 1;
+
+  // Anyone who didn't say they speak something newer gets RFC v3
+  conn->version = conn->peer_version >= 4 ? MIN(APP_VER, conn->peer_version) : 3;
+
+  // If only one party cares which checksum is used, it gets its way. If they
+  // both want something different, or it isn't supported by both, or there's
+  // only room for SHA1 in the packet, it stays SHA1
+  unsigned char mine = conn->checksum_pref;
+  unsigned char theirs = conn->peer_checksum;
+  unsigned char agreed = mine == CHECKSUM_ANY ? theirs
+    : theirs == CHECKSUM_ANY || theirs == mine ? mine
+    : CHECKSUM_SHA1;
+
+  if (
+    agreed == CHECKSUM_ANY || !uses_frames(conn) ||
+    !((CHECKSUM_SUPPORTED & conn->peer_checksums) & (1 << agreed))
+  ) {
+    agreed = CHECKSUM_SHA1;
+  }
+
+  conn->checksum = agreed;
+
+  // >> Anything the other party already sent with these settings was left
+  //    unread; handle it now. If it's broken, the next read finds out
+  if (conn->codec != NULL) handle_frames(conn);
+}
+
+
+// -- Non-blocking messaging
+
+
+/**
+ * Adds a message to the end of a codec's send queue.
+ * @param codec The codec to add to
+ * @param queued The message, all filled in
+ * @return The message's ticket
+ */
+static unsigned long enqueue(Codec* codec, QueuedMessage* queued) {
+  queued->next = NULL;
+
+  if (codec->send_tail != NULL) codec->send_tail->next = queued;
+  else codec->send_head = queued;
+  codec->send_tail = queued;
+
+  codec->backlog += 1;
+  codec->backlog_bytes += queued->message.size;
+
+  return ++codec->queued;
+}
+
+
+unsigned long queue_message(Connection* conn, Message message, int owned) {
+  Codec* codec = get_codec(conn);
+  QueuedMessage* queued = codec != NULL ? malloc(sizeof(QueuedMessage)) : NULL;
+
+  if (queued == NULL) {
+    if (owned && message.body != NULL) free(message.body);
+    return 0;
+  }
+
+  queued->message = message;
+  queued->owned = owned ? 1 : 0;
+  queued->dropped = 0;
+  queued->shared = NULL;
+
+  return enqueue(codec, queued);
+}
+
+
+SharedMessage* share_message(Message message) {
+  SharedMessage* shared = calloc(1, sizeof(SharedMessage));
+
+  if (shared == NULL) {
+    if (message.body != NULL) free(message.body);
+    return NULL;
+  }
+
+  shared->message = message;
+  shared->refs = 1;
+
+  return shared;
+}
+
+
+SharedMessage* share_borrowed(Message message) {
+  SharedMessage* shared = calloc(1, sizeof(SharedMessage));
+
+  if (shared == NULL) return NULL;
+
+  shared->message = message;
+  shared->refs = 1;
+  shared->borrowed = 1;
+
+  return shared;
+}
+
+
+void hold_shared(SharedMessage* shared) {
+  __atomic_add_fetch(&shared->refs, 1, __ATOMIC_RELAXED);
+}
+
+
+void release_shared(SharedMessage* shared) {
+  int i;
+
+  if (__atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+  for (i = 0; i < SHARED_ENCODINGS; i++) {
+    if (shared->encodings[i] != NULL) free(shared->encodings[i]);
+  }
+
+  if (shared->message.body != NULL && !shared->borrowed)
+    free(shared->message.body);
+  free(shared);
+}
+
+
+unsigned long queue_shared(Connection* conn, SharedMessage* shared) {
+  Codec* codec = get_codec(conn);
+  QueuedMessage* queued = codec != NULL ? malloc(sizeof(QueuedMessage)) : NULL;
+
+  if (queued == NULL) {
+    release_shared(shared);
+    return 0;
+  }
+
+  // The body stays with the shared message; the queue only borrows it
+  queued->message = shared->message;
+  queued->owned = 0;
+  queued->dropped = 0;
+  queued->shared = shared;
+
+  return enqueue(codec, queued);
+}
+
+
+int flush_connection(Connection* conn) {
+  Codec* codec = conn->codec;
+  struct msghdr msg;
+
+  if (codec == NULL) return 0;
+  memset(&msg, 0, sizeof(struct msghdr));
+
+  while (1) {
+    // >> Once everything in the last batch is out, see what's next
+    if (codec->iov_count == 0) {
+      finish_transfer(conn);
+      build_batch(conn);
+
+      if (codec->iov_count == 0) return 0;
+    }
+
+    msg.msg_iov = codec->iov + codec->iov_start;
+    msg.msg_iovlen = codec->iov_count;
+
+    ssize_t b_sent = sendmsg(conn->socket, &msg, MSG_NOSIGNAL);
+    if (b_sent == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+      return -1;
+    }
+
+    // >> Skip past whatever made it out
+    struct iovec* iov = codec->iov + codec->iov_start;
+
+    while (codec->iov_count > 0 && (size_t)b_sent >= iov->iov_len) {
+      b_sent -= iov->iov_len;
+      iov++;
+      codec->iov_start++;
+      codec->iov_count--;
+    }
+
+    if (codec->iov_count > 0) {
+      iov->iov_base = (char*)iov->iov_base + b_sent;
+      iov->iov_len -= b_sent;
+    }
+  }
+}
+
+
+unsigned long connection_backlog(const Connection* conn, size_t* bytes) {
+  const Codec* codec = conn->codec;
+
+  *bytes = codec != NULL ? codec->backlog_bytes : 0;
+  return codec != NULL ? codec->backlog : 0;
+}
+
+
+int connection_sent(const Connection* conn, unsigned long ticket) {
+  return conn->codec != NULL && conn->codec->sent >= ticket;
+}
+
+
+int drop_queued(Connection* conn, int (*pick)(const Message* message)) {
+  Codec* codec = conn->codec;
+  QueuedMessage* queued;
+
+  if (codec == NULL) return 0;
+
+  // >> The one going out can't be taken back; a half-sent message would leave
+  //    the receiver waiting on packets that never come
+  queued = codec->send_head;
+  if (queued != NULL && codec->sending) queued = queued->next;
+
+  for (; queued != NULL; queued = queued->next) {
+    if (queued->dropped || !pick(&queued->message)) continue;
+
+    // >> Let go of the body now, but leave the entry itself in the queue so
+    //    that every ticket after it still means the same thing
+    codec->backlog -= 1;
+    codec->backlog_bytes -= queued->message.size;
+
+    if (queued->shared != NULL) release_shared(queued->shared);
+    else if (queued->owned && queued->message.body != NULL)
+      free(queued->message.body);
+
+    queued->shared = NULL;
+    queued->owned = 0;
+    queued->message.body = NULL;
+    queued->message.size = 0;
+    queued->dropped = 1;
+
+    return 1;
+  }
+
+  return 0;
+}
+
+
+int connection_wants_write(const Connection* conn) {
+  const Codec* codec = conn->codec;
+
+  if (codec == NULL) return 0;
+  if (codec->iov_count > 0 || codec->nak_count > 0 || codec->ack_due) return 1;
+  if (!codec->sending) return codec->send_head != NULL;
+
+  return codec->resend_count > 0 || (
+    codec->send_next < codec->send_count &&
+    codec->send_next - codec->send_base < conn->window
+  );
+}
+
+
+ssize_t read_connection(Connection* conn) {
+  ssize_t b_recv;
+
+  // >> During login, frames are left in the buffer after each message (see
+  //    handle_frames); get to those before waiting on the socket for more
+  b_recv = handle_buffered(conn);
+  if (b_recv != 0) return b_recv;
+
+  if (make_room(conn) != 0) return -1;
+
+  do {
+    b_recv = recv(conn->socket, conn->recv_buffer + conn->recv_end,
+      RECV_BUFFER - conn->recv_end, 0);
+  } while (b_recv == -1 && errno == EINTR);
+
+  if (b_recv <= 0) return b_recv;
+
+  conn->recv_end += b_recv;
+  if (handle_frames(conn) != 0) return -1;
+
+  return b_recv;
+}
+
+
+ssize_t handle_buffered(Connection* conn) {
+  size_t start;
+
+  if (get_codec(conn) == NULL) return -1;
+  if (conn->version != 0 || conn->recv_start == conn->recv_end) return 0;
+
+  start = conn->recv_start;
+  if (handle_frames(conn) != 0) return -1;
+
+  return (ssize_t)(conn->recv_start - start);
+}
+
+
+int feed_connection(Connection* conn, const char* data, size_t length) {
+  if (get_codec(conn) == NULL) return -1;
+
+  while (length > 0) {
+    if (make_room(conn) != 0) return -1;
+
+    size_t amount = MIN(length, RECV_BUFFER - conn->recv_end);
+    memcpy(conn->recv_buffer + conn->recv_end, data, amount);
+    conn->recv_end += amount;
+
+    if (handle_frames(conn) != 0) return -1;
+
+    data += amount;
+    length -= amount;
+  }
+
+  return 0;
+}
+
+
+int next_message(Connection* conn, Message* message) {
+  Codec* codec = conn->codec;
+  QueuedMessage* next;
+
+  if (codec == NULL || codec->inbox_head == NULL) return 0;
+
+  next = codec->inbox_head;
+  codec->inbox_head = next->next;
+  if (codec->inbox_head == NULL) codec->inbox_tail = NULL;
+
+  *message = next->message;
+  free(next);
+
+  return 1;
+}
+
+
+// -- Blocking messaging
+
+
+int send_message(Connection* conn, Message message) {
+  unsigned long ticket = queue_message(conn, message, 0);
+  if (ticket == 0) return -1;
+
+  Codec* codec = conn->codec;
+
+  // >> Keep writing what's allowed and reading acknowledgements until the
+  //    message has all been acknowledged. Anything that comes in meanwhile is
+  //    kept for recv_message
+  while (codec->sent < ticket) {
+    if (flush_connection(conn) != 0) {
+      drop_sending(codec);
+      return errno;
+    }
+
+    if (codec->sent >= ticket) break;
+
+    ssize_t b_recv = read_connection(conn);
+    if (b_recv == -1) {
+      drop_sending(codec);
+      return errno;
+    } else if (b_recv == 0) {
+      drop_sending(codec);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+Message recv_message(Connection* conn) {
+  Message output;
+
+  // >> Seed/unset values
+  memset(&output, 0, sizeof(Message));
+  output.type = MSG_UNSET;
+
+  while (!next_message(conn, &output)) {
+    // >> Let the sender know how far along it is before waiting for more. If
+    //    the socket broke, or the stream can't be split into packets anymore,
+    //    there's no way to recover
+    if (flush_connection(conn) != 0 || read_connection(conn) <= 0) {
+      output.type = MSG_UNSET;
+      return output;
+    }
+  }
 
+  // >> Send the last acknowledgement
+  flush_connection(conn);
   return output;
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #ifndef __GLOBAL_MESSAGING__
 #define __GLOBAL_MESSAGING__
 
+#include <sys/types.h>
 #include <openssl/sha.h>
 
 
@@ -17,21 +18,255 @@ typedef struct message {
 } Message;
 
 
+/**
+ * Per-socket state for the messaging functions. Holds the transfer settings
+ * both parties agreed on when the client logged in, and whatever has been read
+ * off of the socket but not handled yet.
+ */
+typedef struct connection {
+  int socket;                  // The socket FD to send and receive on
+  unsigned short version;      // RFC version in use; 0 until login is done
+  unsigned short peer_version; // RFC version the other party offered
+  unsigned short window;       // Packets allowed in flight; 1 is stop-and-wait
+  unsigned short peer_window;  // Window the other party offered; 0 if none
+
+  unsigned char checksum;        // CHECKSUM_ algorithm in use
+  unsigned char checksum_pref;   // Algorithm to ask for; CHECKSUM_ANY if none
+  unsigned char peer_checksum;   // Algorithm the other party asked for
+  unsigned short peer_checksums; // Bitmask of what the other party supports
+
+  char* recv_buffer;   // RECV_BUFFER bytes; allocated on the first read
+  size_t recv_start;   // Where the first unhandled byte in the buffer is
+  size_t recv_end;     // Where the last read left off
+
+  struct codec* codec; // Transfers in progress; allocated when first needed
+} Connection;
+
+
+/**
+ * A message that's going out over more than one connection. Its body is only
+ * kept once, and its packets are only encoded once for each set of connection
+ * settings, instead of once per connection. It's freed once every holder lets
+ * go of it, and must not be changed after it's been created.
+ */
+typedef struct shared_message SharedMessage;
+
+
+/**
+ * Sets up a connection with the defaults every party understands (RFC v3
+ * packets, stop-and-wait, SHA1), to be used until the login exchange is done.
+ * To ask for a specific checksum, set `checksum_pref` before logging in.
+ * @param conn The connection to initialize
+ * @param socket The socket file descriptor the connection uses
+ */
+void init_connection(Connection* conn, int socket);
+
+
+/**
+ * Closes a connection's socket, and frees its buffers and anything that was
+ * still waiting to be sent or picked up.
+ * @param conn The connection to close
+ */
+void close_connection(Connection* conn);
+
+
+/**
+ * Checks whether a whole message has already been read off of the socket and
+ * not picked up yet; for example, one that came in while sending. Since it's
+ * already been read, epoll won't report it, so anyone waiting on the socket
+ * should check this first.
+ * @param conn The connection to check
+ * @return 1 if there's a message waiting, 0 otherwise
+ */
+int connection_pending(const Connection* conn);
+
+
+/**
+ * Switches a connection over to the best settings both parties support. Must
+ * be called by each side once the login exchange is done: by the server after
+ * sending its response, and by the client after receiving it. Anything already
+ * read past the login exchange is handled then, so check connection_pending
+ * afterwards.
+ * @param conn The connection to upgrade
+ */
+void negotiate_connection(Connection* conn);
+
+
+// -- Non-blocking messaging
+//
+// These never wait on the socket, so they can be used with non-blocking
+// sockets in an event loop: call read_connection when the socket is readable,
+// pick up messages with next_message, and call flush_connection after queueing
+// something, after reading, and whenever the socket is writable again.
+
+
+/**
+ * Queues a message to be sent. Nothing is written until flush_connection.
+ * @param conn The connection to send the message over
+ * @param message The message to send
+ * @param owned Whether the connection should free the message's body once it's
+ * been sent; otherwise, it must stay valid until then
+ * @return A ticket for the message; it has been sent once that many messages
+ * have been, or 0 if it could not be queued
+ */
+unsigned long queue_message(Connection* conn, Message message, int owned);
+
+
+/**
+ * Wraps a message up so that it can be sent over many connections at once.
+ * @param message The message; its body now belongs to the shared message
+ * @return The shared message, with one holder (the caller), or NULL if there
+ * was no memory for it (the body is freed)
+ */
+SharedMessage* share_message(Message message);
+
+
+/**
+ * Wraps a message up like share_message, without taking its body over; it's
+ * never copied or freed, so it must stay valid until the last holder lets go.
+ * @param message The message
+ * @return The shared message, with one holder (the caller), or NULL if there
+ * was no memory for it
+ */
+SharedMessage* share_borrowed(Message message);
+
+
+/**
+ * Adds a holder to a shared message.
+ * @param shared The message to hold
+ */
+void hold_shared(SharedMessage* shared);
+
+
+/**
+ * Removes a holder from a shared message, freeing it if it was the last one.
+ * @param shared The message to release
+ */
+void release_shared(SharedMessage* shared);
+
+
+/**
+ * Queues a shared message to be sent, just like queue_message. The caller's
+ * hold on the message is handed over to the connection, which releases it
+ * once it's been sent.
+ * @param conn The connection to send the message over
+ * @param shared The message to send
+ * @return A ticket for the message, or 0 if it could not be queued
+ */
+unsigned long queue_shared(Connection* conn, SharedMessage* shared);
+
+
+/**
+ * Writes as much of what's waiting to go out (packets of queued messages, and
+ * acknowledgements for received ones) as the socket will take.
+ * @param conn The connection to write to
+ * @return 0 if everything that can be sent was, 1 if the socket is full and
+ * this should be called again when it's writable, -1 on error
+ */
+int flush_connection(Connection* conn);
+
+
+/**
+ * Counts what is waiting to be sent, including the message going out now.
+ * @param conn The connection to check
+ * @param bytes Where to put how many bytes of message bodies that is
+ * @return How many messages are waiting
+ */
+unsigned long connection_backlog(const Connection* conn, size_t* bytes);
+
+
+/**
+ * Checks whether a queued message has been sent, without waiting for it.
+ * @param conn The connection the message was queued on
+ * @param ticket The message's ticket, from queue_message
+ * @return 1 if it has been sent, 0 if not yet
+ */
+int connection_sent(const Connection* conn, unsigned long ticket);
+
+
+/**
+ * Drops the oldest message waiting to be sent that `pick` accepts, letting go
+ * of its body. The message going out now is never dropped. Dropped messages
+ * count as sent for tickets, but nothing of them is written.
+ * @param conn The connection to drop from
+ * @param pick Says whether a message may be dropped; 1 if so, 0 if not
+ * @return 1 if a message was dropped, 0 if none could be
+ */
+int drop_queued(Connection* conn, int (*pick)(const Message* message));
+
+
+/**
+ * Checks whether flush_connection has anything to write.
+ * @param conn The connection to check
+ * @return 1 if there's something to write, 0 otherwise
+ */
+int connection_wants_write(const Connection* conn);
+
+
+/**
+ * Reads whatever is available on the socket and handles every whole packet
+ * read; acknowledgements move the message being sent along, and the rest go
+ * towards the message being received.
+ * @param conn The connection to read from
+ * @return The number of bytes read (or, during login, handled from what was
+ * already read); 0 if the socket was closed, -1 on error (including EAGAIN
+ * when there was nothing to read)
+ */
+ssize_t read_connection(Connection* conn);
+
+
+/**
+ * Handles whatever is left unread in the connection's buffer without reading
+ * from its socket. Only until login is done is anything ever left; see
+ * negotiate_connection. read_connection does this first on its own.
+ * @param conn The connection to handle
+ * @return How many bytes were handled, or -1 if they can't be split into
+ * packets
+ */
+ssize_t handle_buffered(Connection* conn);
+
+
+/**
+ * Handles bytes that came from somewhere other than the connection's socket,
+ * just like read_connection would if it had read them.
+ * @param conn The connection the bytes are for
+ * @param data The bytes
+ * @param length How many bytes there are
+ * @return 0 on success, -1 if the bytes can't be split into packets
+ */
+int feed_connection(Connection* conn, const char* data, size_t length);
+
+
+/**
+ * Picks up the next message that has been completely received.
+ * @param conn The connection to pick it up from
+ * @param message Where to put the message; the caller frees its body
+ * @return 1 if there was a message, 0 otherwise
+ */
+int next_message(Connection* conn, Message* message);
+
+
+// -- Blocking messaging
+//
+// These wait until they're done, so the socket should be a blocking one.
+
+
 /**
  * Sends a message. Message is broken into chunks and sent one by one.
- * @param socket The socket file descriptor to send the message to
+ * @param conn The connection to send the message over
  * @param message The raw data to send inside the packets
  * @return A return code; 0 on success, anything else on error
  */
-int send_message(int socket, Message message);
+int send_message(Connection* conn, Message message);
 
 
 /**
- * Receives a message. Message is read in packet-by-packet.
- * @param socket The socket to read from
+ * Receives a message. The socket is read in large chunks, and every packet
+ * already in the buffer is handled before reading more.
+ * @param conn The connection to read from
  * @return A Message struct containing the sent message and metadata; will be
  * empty on error
  */
-Message recv_message(int socket);
+Message recv_message(Connection* conn);
 
 #endif
\ No newline at end of file
@@ -12,11 +12,15 @@
  *
  */
 
+// localtime_r isn't part of C99
+#define _POSIX_C_SOURCE 200112L
+
 #include <time.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
 
 #include "./constants.h"
+#include "./utility.h"
 
 
 int setup_epoll(int* epoll_fd, int files[], int count) {
@@ -42,11 +46,22 @@ int setup_epoll(int* epoll_fd, int files[], int count) {
 
 
 char* timestamp() {
-  static char timestamp[22];
+  return timestamp_at(time(NULL));
+}
+
 
-  time_t rawtime = time(NULL);
-  struct tm* timeinfo = localtime(&rawtime);
+char* timestamp_at(time_t when) {
+  // Formatting takes a lot longer than checking whether it needs to be done
+  static __thread char timestamp[22];
+  static __thread time_t formatted = (time_t)-1;
+
+  struct tm timeinfo;
+
+  if (when != formatted) {
+    localtime_r(&when, &timeinfo);
+    strftime(timestamp, 22, "[%F %T]", &timeinfo);
+    formatted = when;
+  }
 
-  strftime(timestamp, 22, "[%F %T]", timeinfo);
   return timestamp;
 }
\ No newline at end of file
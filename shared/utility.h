@@ -1,6 +1,8 @@
 #ifndef __GLOBAL_FUNCTIONS__
 #define __GLOBAL_FUNCTIONS__
 
+#include <time.h>
+
 /**
  * Sets up a bunch of file listeners on a specific epoll fd.
  * @param epoll_fd A pointer to the epoll_fd to set
@@ -12,10 +14,18 @@
 int setup_epoll(int* epoll_fd, int files[], int count);
 
 /**
- * Puts the current timestamp in '[YYYY-MM-DD hh:mm:ss]' format into the given
- * buffer.
- * @return A pointer to a null terminated timestamp string, ready for printing
+ * Formats the current time as '[YYYY-MM-DD hh:mm:ss]'. Each thread has its own
+ * copy, which is only formatted again once the second changes.
+ * @return A pointer to a null terminated timestamp string, ready for printing;
+ * good until the calling thread calls this again
  */
 char* timestamp();
 
+/**
+ * Formats a given time like timestamp does, with the same per-thread copy.
+ * @param when The time to format
+ * @return A pointer to the timestamp string
+ */
+char* timestamp_at(time_t when);
+
 #endif
\ No newline at end of file